@@ -0,0 +1,127 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <fluent/loader.hpp>
+#include <unicode/locid.h>
+
+#include "resources.hpp"
+
+using namespace fluent;
+
+static const char *FORMAT_RESOURCE = R"(
+plain = A plain message
+variable = Hello { $name }!
+plural = { $count ->
+    [one] One item
+   *[other] { $count } items
+}
+nested = { plain } and { variable }
+-brand = Fluent
+term = Welcome to { -brand }
+)";
+
+/// Returns a loader containing FORMAT_RESOURCE, compiled or not
+static const FluentLoader& getFormatLoader(bool compiled) {
+    static benchmarks::ResourceDirectory directory("fluent-cpp-bench-format", "en",
+                                                   FORMAT_RESOURCE);
+    static FluentLoader loaders[2];
+    static bool loaded = [] {
+        for (FluentLoader& loader : loaders)
+            loader.addDirectory(directory.path());
+        loaders[1].compile();
+        return true;
+    }();
+    (void)loaded;
+    return loaders[compiled];
+}
+
+static void BM_FormatMessage(benchmark::State& state, const std::string& resId,
+                             const FluentArgs& args) {
+    const FluentLoader& loader = getFormatLoader(state.range(0));
+    std::vector<icu::Locale> locales = {icu::Locale("fr"), icu::Locale("en")};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(loader.formatMessage(locales, resId, args));
+}
+
+static void BM_FormatMessageChain(benchmark::State& state, const std::string& resId,
+                                  const FluentArgs& args) {
+    const FluentLoader& loader = getFormatLoader(state.range(0));
+    LocaleChain chain({icu::Locale("fr"), icu::Locale("en")});
+    for (auto _ : state)
+        benchmark::DoNotOptimize(loader.formatMessage(chain, resId, args));
+}
+
+#define FORMAT_BENCHMARK(name, resId, ...)                                                    \
+    BENCHMARK_CAPTURE(BM_FormatMessage, name, resId, FluentArgs(__VA_ARGS__))                \
+        ->ArgName("compiled")                                                                 \
+        ->Arg(0)                                                                              \
+        ->Arg(1);                                                                             \
+    BENCHMARK_CAPTURE(BM_FormatMessageChain, name, resId, FluentArgs(__VA_ARGS__))           \
+        ->ArgName("compiled")                                                                 \
+        ->Arg(0)                                                                              \
+        ->Arg(1)
+
+FORMAT_BENCHMARK(plain, "plain");
+FORMAT_BENCHMARK(variable, "variable", {{"name", "World"}});
+FORMAT_BENCHMARK(plural, "plural", {{"count", 5}});
+FORMAT_BENCHMARK(nested, "nested", {{"name", "World"}});
+FORMAT_BENCHMARK(term, "term");
+
+static void BM_FormatMessages(benchmark::State& state) {
+    const FluentLoader& loader = getFormatLoader(false);
+    LocaleChain chain({icu::Locale("fr"), icu::Locale("en")});
+    FluentArgs args{{"name", "World"}, {"count", 5}};
+    const char* ids[] = {"plain", "variable", "plural", "nested", "term"};
+    std::vector<MessageRequest> requests;
+    for (int64_t index = 0; index < state.range(0); index++)
+        requests.push_back({ids[index % 5], &args});
+    FormattedBatch batch;
+    for (auto _ : state) {
+        batch.clear();
+        loader.formatMessages(chain, requests, batch, state.range(1));
+        benchmark::DoNotOptimize(batch);
+    }
+    state.SetItemsProcessed(state.iterations() * requests.size());
+}
+BENCHMARK(BM_FormatMessages)
+    ->ArgNames({"messages", "threads"})
+    ->Args({200, 1})
+    ->Args({10000, 1})
+    ->Args({10000, 4});
+
+static void BM_AddDirectory(benchmark::State& state) {
+    for (auto _ : state) {
+        FluentLoader loader;
+        loader.addDirectory("l10n");
+        benchmark::DoNotOptimize(loader);
+    }
+}
+BENCHMARK(BM_AddDirectory);
+
+static void BM_AddDirectorySynthetic(benchmark::State& state) {
+    benchmarks::ResourceDirectory directory(
+        "fluent-cpp-bench-load", "en", benchmarks::syntheticResource(state.range(0)));
+    for (auto _ : state) {
+        FluentLoader loader;
+        loader.addDirectory(directory.path());
+        benchmark::DoNotOptimize(loader);
+    }
+}
+BENCHMARK(BM_AddDirectorySynthetic)->Arg(100)->Arg(10000);
@@ -0,0 +1,79 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <fluent/parser.hpp>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "resources.hpp"
+
+using namespace fluent;
+
+static std::string readFile(const std::filesystem::path& file) {
+    std::ifstream stream(file);
+    std::stringstream contents;
+    contents << stream.rdbuf();
+    return contents.str();
+}
+
+static void BM_Parse(benchmark::State& state, const std::string& contents) {
+    for (auto _ : state) {
+        std::string input = contents;
+        benchmark::DoNotOptimize(parse(std::move(input)));
+    }
+    state.SetBytesProcessed(state.iterations() * contents.size());
+}
+
+static void BM_ParseFile(benchmark::State& state, const std::filesystem::path& file) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parseFile(file));
+    state.SetBytesProcessed(state.iterations() * std::filesystem::file_size(file));
+}
+
+static void BM_ParseSynthetic(benchmark::State& state) {
+    BM_Parse(state, benchmarks::syntheticResource(state.range(0)));
+}
+BENCHMARK(BM_ParseSynthetic)->Arg(100)->Arg(10000);
+
+static void BM_ParseFileSynthetic(benchmark::State& state) {
+    benchmarks::ResourceDirectory directory(
+        "fluent-cpp-bench-parse", "en", benchmarks::syntheticResource(state.range(0)));
+    BM_ParseFile(state, directory.file("en"));
+}
+BENCHMARK(BM_ParseFileSynthetic)->Arg(100)->Arg(10000);
+
+/// Registers a parse and parseFile benchmark for each of the parser test fixtures
+static bool registerFixtures() {
+    std::filesystem::path fixtures = "fixtures";
+    if (!std::filesystem::is_directory(fixtures))
+        return false;
+    for (const auto& entry : std::filesystem::directory_iterator(fixtures)) {
+        if (entry.path().extension() != ".ftl")
+            continue;
+        std::string name = entry.path().stem().string();
+        std::string contents = readFile(entry.path());
+        benchmark::RegisterBenchmark(("BM_Parse/" + name).c_str(), BM_Parse, contents);
+        benchmark::RegisterBenchmark(("BM_ParseFile/" + name).c_str(), BM_ParseFile,
+                                     entry.path());
+    }
+    return true;
+}
+static bool fixturesRegistered = registerFixtures();
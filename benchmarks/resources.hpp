@@ -0,0 +1,98 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file resources.hpp
+ *  \brief Synthetic resources shared by the benchmarks
+ */
+
+#ifndef _FLUENT_BENCHMARKS_RESOURCES_HPP_
+#define _FLUENT_BENCHMARKS_RESOURCES_HPP_
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace fluent::benchmarks {
+
+    /**
+     * \brief Generates a resource with the given number of messages
+     *
+     * Cycles through plain text, variables, selectors, attributes and references to
+     * messages and terms, in roughly the proportions of a real application.
+     */
+    inline std::string syntheticResource(size_t messages) {
+        std::string resource = "# Synthetic benchmark resource\n\n"
+                               "-brand = Fluent\n"
+                               "    .gender = neuter\n\n";
+        for (size_t index = 0; index < messages; index++) {
+            std::string id = "message-" + std::to_string(index);
+            switch (index % 5) {
+                case 0:
+                    resource += id + " = A plain message with some text in it\n";
+                    break;
+                case 1:
+                    resource += id + " = Hello { $name }, you have { $count } messages\n";
+                    break;
+                case 2:
+                    resource += id + " = { $count ->\n"
+                                     "    [one] One item\n"
+                                     "   *[other] { $count } items\n"
+                                     "}\n";
+                    break;
+                case 3:
+                    resource += "## Group comment\n" + id +
+                                " = Welcome to { -brand }\n"
+                                "    .title = { -brand } title\n";
+                    break;
+                case 4:
+                    resource += id + " = See { message-" + std::to_string(index - 4) + " }\n";
+                    break;
+            }
+        }
+        return resource;
+    }
+
+    /**
+     * \brief A temporary resource directory, in the layout expected by
+     *        FluentLoader::addDirectory, which is deleted on destruction
+     */
+    class ResourceDirectory {
+    private:
+        std::filesystem::path root;
+
+    public:
+        ResourceDirectory(const std::string& name, const std::string& locale,
+                          const std::string& contents)
+            : root(std::filesystem::temp_directory_path() / name) {
+            std::filesystem::remove_all(this->root);
+            std::filesystem::create_directories(this->root / locale);
+            std::ofstream(this->root / locale / "main.ftl") << contents;
+        }
+        ~ResourceDirectory() { std::filesystem::remove_all(this->root); }
+
+        std::string path() const { return this->root.string(); }
+        std::filesystem::path file(const std::string& locale) const {
+            return this->root / locale / "main.ftl";
+        }
+    };
+
+} // namespace fluent::benchmarks
+
+#endif
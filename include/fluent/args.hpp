@@ -0,0 +1,116 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file args.hpp
+ *  \brief Lightweight, non-owning arguments for formatting messages
+ */
+
+#ifndef _FLUENT_ARGS_HPP_
+#define _FLUENT_ARGS_HPP_
+
+#include <array>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace fluent {
+
+    namespace ast {
+        /**
+         *  \typedef Variable
+         *  \brief data which may be passed as an argument when formatting messages.
+         */
+        typedef std::variant<std::string, long, double> Variable;
+    } // namespace ast
+
+    /**
+     *  \typedef VariableView
+     *  \brief A non-owning view of an argument value.
+     *
+     *  As ast::Variable, but strings are referred to rather than copied.
+     */
+    typedef std::variant<std::string_view, long, double> VariableView;
+
+    /**
+     * \brief Creates a view of an owned ast::Variable
+     */
+    VariableView toVariableView(const ast::Variable &variable);
+
+    /**
+     * \class FluentArgs
+     * \brief A small, flat collection of message arguments
+     *
+     * Neither argument names nor string values are copied: the caller must keep them
+     * alive while the FluentArgs is in use. Up to INLINE_CAPACITY arguments are stored
+     * inline, so building a FluentArgs on the stack does not allocate in the common case.
+     * Lookups are a linear scan, which for the handful of arguments a message usually
+     * takes is faster than hashing or a tree lookup.
+     *
+     * E.g. ``loader.formatMessageTo(out, locales, "id", {{"name", name}, {"count", 3}})``
+     */
+    class FluentArgs {
+    public:
+        typedef std::pair<std::string_view, VariableView> Argument;
+        static constexpr size_t INLINE_CAPACITY = 8;
+
+    private:
+        std::array<Argument, INLINE_CAPACITY> inlineArgs;
+        size_t inlineCount = 0;
+        // Arguments which did not fit in inlineArgs
+        std::vector<Argument> overflow;
+
+    public:
+        FluentArgs() = default;
+        FluentArgs(std::initializer_list<Argument> args);
+
+        /**
+         * \brief Creates a view of a map of arguments
+         *
+         * The map must outlive the FluentArgs.
+         */
+        FluentArgs(const std::map<std::string, ast::Variable> &args);
+
+        /**
+         * \brief Sets an argument, replacing any existing argument with the same name
+         */
+        void set(std::string_view name, VariableView value);
+
+        /**
+         * \returns The argument with the given name, or nullptr if there is none
+         */
+        const VariableView *find(std::string_view name) const;
+
+        /**
+         * \returns The argument with the given name
+         * \throws std::out_of_range if there is no such argument, as std::map::at does
+         */
+        const VariableView &at(std::string_view name) const;
+
+        inline size_t size() const { return this->inlineCount + this->overflow.size(); }
+        inline bool empty() const { return this->size() == 0; }
+    };
+
+} // namespace fluent
+
+#endif
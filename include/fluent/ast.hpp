@@ -26,12 +26,14 @@
 #define _FLUENT_AST_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <map>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -42,6 +44,14 @@
 
 #include <iostream>
 
+#include "args.hpp"
+#include "format_limits.hpp"
+#include "sink.hpp"
+
+namespace fluent {
+    class FormatContext;
+}
+
 namespace fluent::ast {
 
     /**
@@ -69,20 +79,6 @@ namespace fluent::ast {
     #endif
     };
 
-    /**
-     *  \class TermReference
-     *  \brief A reference to a Term within an expression.
-     */
-    struct TermReference : public MessageReference {
-        using MessageReference::MessageReference;
-
-    #ifdef TEST
-    public:
-        boost::property_tree::ptree getPropertyTree() const override;
-        std::string getPropertyTreeType() const override { return "TermReference"; }
-    #endif
-    };
-
     /**
      * \class StringLiteral
      * \brief A string literal enclosed in an expression, often used for escaping values
@@ -103,6 +99,8 @@ namespace fluent::ast {
      *
      * The number of significant figures will be preserved in NumberLiterals
      *
+     * The literal is parsed once when it is created; value keeps the source text.
+     *
      * E.g.
      * - ``{ -3.14 }``
      * - ``{ 100 }``
@@ -110,19 +108,38 @@ namespace fluent::ast {
     struct NumberLiteral {
         std::string value;
 
-        NumberLiteral(std::string &&value) : value(std::move(value)) {}
+        /// Parses the literal. Integers too large for a long are stored as doubles.
+        NumberLiteral(std::string &&value);
+        NumberLiteral(const NumberLiteral &other);
+        NumberLiteral(NumberLiteral &&other) noexcept;
+        NumberLiteral &operator=(const NumberLiteral &other);
+        NumberLiteral &operator=(NumberLiteral &&other) noexcept;
+        ~NumberLiteral();
 
         /**
          * \brief Localises number literal
+         *
+         * A rendering is kept for each FormatContext the literal has been formatted
+         * with, so formatting it again with any of them does not call ICU.
+         */
+        const std::string format(const FormatContext &context) const;
+        /// \overload const std::string format(const FormatContext &context) const
+        void format(OutputSink &out, const FormatContext &context) const;
+
+        /**
+         * \brief Renders the literal for the locale of context ahead of formatting
+         *
+         * FluentBundle calls this when an entry is added, so that formatting only has
+         * to look the rendering up.
          */
-        const std::string format(const icu::Locale &locid) const;
+        void localize(const FormatContext &context) const;
 
         bool operator==(const NumberLiteral &other) const {
-            return *this == stod(other.value);
+            return *this == other.doubleValue;
         }
 
         bool operator==(const double &other) const {
-            double a = stod(this->value), b = other;
+            double a = this->doubleValue, b = other;
             return std::abs(a - b) <=
                 std::abs(std::min(a, b)) * std::numeric_limits<double>::epsilon();
         }
@@ -131,20 +148,98 @@ namespace fluent::ast {
             return *this == static_cast<double>(other);
         }
 
-        std::variant<long, double> getValue() const {
-            if (this->value.find(".") != std::string::npos) {
-                return std::variant<long, double>(stod(value));
-            } else {
-                return std::variant<long, double>(stol(value));
-            }
-        }
+        std::variant<long, double> getValue() const { return this->number; }
+
+        /// The value of the literal, converted to a double if it is an integer
+        double getDoubleValue() const { return this->doubleValue; }
+
+        /// The number of digits after the decimal point in the literal
+        size_t getPrecision() const { return this->precision; }
+
+    private:
+        /// The rendering of the literal for one FormatContext
+        struct Rendering {
+            /// The FormatContext::getSerial of the context
+            uint64_t context;
+            std::string text;
+            const Rendering *next;
+        };
+
+        std::variant<long, double> number;
+        double doubleValue;
+        size_t precision = 0;
+        /// Renderings are only ever prepended, so a thread which has loaded the head of
+        /// the list can walk it while another thread adds a rendering. Terms shared
+        /// between bundles are formatted in several locales at once.
+        mutable std::atomic<const Rendering *> renderings{nullptr};
+
+        /// Returns the rendering for context, adding it if there is none.
+        /// Returns nullptr if ICU failed to format the number.
+        const Rendering *render(const FormatContext &context) const;
+        static const Rendering *copyRenderings(const Rendering *rendering);
+        static void freeRenderings(const Rendering *rendering);
     };
 
     /**
-     *  \typedef Variable
-     *  \brief data which may be passed as an argument when formatting messages.
+     * \class CallArguments
+     * \brief The arguments passed to a term, e.g. ``-brand(case: "genitive")``
+     *
+     * Argument values can only be literals, so they are converted into the FluentArgs
+     * the term is formatted with when the resource is parsed. The FluentArgs refers to
+     * strings owned by the CallArguments, so it can be neither copied nor moved;
+     * copies of a TermReference share it instead.
+     *
+     * Positional arguments are kept, but are ignored when formatting, as terms only
+     * take named arguments.
      */
-    typedef std::variant<std::string, long, double> Variable;
+    class CallArguments {
+    public:
+        typedef std::variant<StringLiteral, NumberLiteral> Literal;
+        typedef std::pair<std::string, Literal> NamedArgument;
+        typedef std::variant<Literal, NamedArgument> Argument;
+
+    private:
+        std::vector<Literal> positional;
+        std::vector<NamedArgument> named;
+        FluentArgs args;
+
+    public:
+        explicit CallArguments(std::vector<Argument> &&arguments);
+        CallArguments(const CallArguments &) = delete;
+        CallArguments &operator=(const CallArguments &) = delete;
+
+        inline const std::vector<Literal> &getPositional() const { return this->positional; }
+        inline const std::vector<NamedArgument> &getNamed() const { return this->named; }
+        /// The named arguments, as passed to the term
+        inline const FluentArgs &getArgs() const { return this->args; }
+
+    #ifdef TEST
+        boost::property_tree::ptree getPropertyTree() const;
+    #endif
+    };
+
+    /**
+     *  \class TermReference
+     *  \brief A reference to a Term within an expression.
+     */
+    struct TermReference : public MessageReference {
+        /// The arguments passed to the term, or nullptr if it was not called with any
+        std::shared_ptr<const CallArguments> arguments;
+
+        TermReference(std::string &&identifier, std::optional<std::string> &&attribute,
+                      std::optional<std::vector<CallArguments::Argument>> &&arguments =
+                          std::optional<std::vector<CallArguments::Argument>>());
+
+        /// The arguments the term is formatted with
+        const FluentArgs &getArgs() const;
+
+    #ifdef TEST
+    public:
+        boost::property_tree::ptree getPropertyTree() const override;
+        std::string getPropertyTreeType() const override { return "TermReference"; }
+    #endif
+    };
+
     typedef std::variant<std::string, NumberLiteral> VariantKey;
 
     /**
@@ -183,11 +278,11 @@ namespace fluent::ast {
                                 lastVariants.end());
         }
 
-        const std::vector<PatternElement> &find(const icu::Locale &locid,
-                                                const std::string key) const;
-        const std::vector<PatternElement> &find(const icu::Locale &locid,
+        const std::vector<PatternElement> &find(const FormatContext &context,
+                                                std::string_view key) const;
+        const std::vector<PatternElement> &find(const FormatContext &context,
                                                 const double key) const;
-        const std::vector<PatternElement> &find(const icu::Locale &locid,
+        const std::vector<PatternElement> &find(const FormatContext &context,
                                                 const long key) const;
 
     #ifdef TEST
@@ -248,6 +343,35 @@ namespace fluent::ast {
 
     class Term;
     class Message;
+
+    /**
+     *  \typedef MessageLookup
+     *  \brief Callback used to resolve MessageReferences while formatting.
+     *
+     *  Returns a non-owning pointer to the referenced Message, or nullptr if it could
+     *  not be found. The Message must outlive the call to format.
+     */
+    typedef std::function<const Message *(const std::string &)> MessageLookup;
+
+    /**
+     *  \typedef TermLookup
+     *  \brief Callback used to resolve TermReferences while formatting.
+     *
+     *  As MessageLookup, but for Terms.
+     */
+    typedef std::function<const Term *(const std::string &)> TermLookup;
+
+    /**
+     * \brief Tag for constructing an Attribute, Message or Term from a pattern which
+     *        has already been processed, such as one read back from a binary image
+     *
+     * Patterns passed to the other constructors are processed as they come from the
+     * parser: adjacent text is merged, the common indent of their lines is removed,
+     * and whitespace is stripped from their start and end. Doing so again would strip
+     * the indent which was meant to be kept.
+     */
+    struct PreprocessedPattern {};
+
     /**
      *  \class Attribute
      *  \brief A subentity within a Message or Term.
@@ -266,13 +390,28 @@ namespace fluent::ast {
     #endif
 
         inline const std::string &getId() const { return this->id; }
+        inline const std::vector<PatternElement> &getPattern() const { return this->pattern; }
 
         Attribute(std::string &&id, std::vector<PatternElement> &&pattern);
+        Attribute(PreprocessedPattern, std::string &&id, std::vector<PatternElement> &&pattern);
+
+        /// Releases the unused capacity of the attribute's pattern
+        void compact();
+
+        /// Renders the number literals of the attribute for the locale of context
+        void localize(const FormatContext &context) const;
+
+        const std::string format(const FormatContext &context,
+                                 const std::map<std::string, Variable> &args,
+                                 const MessageLookup &messageLookup,
+                                 const TermLookup &termLookup) const;
 
-        const std::string format(
-            const icu::Locale &locId, const std::map<std::string, Variable> &args,
-            const std::function<std::optional<Message>(const std::string &)> messageLookup,
-            const std::function<std::optional<Term>(const std::string &)> termLookup) const;
+        /**
+         * \brief Formats the attribute, appending the result to out
+         */
+        void format(OutputSink &out, const FormatContext &context, const FluentArgs &args,
+                    const MessageLookup &messageLookup, const TermLookup &termLookup,
+                    const FormatLimits &limits = FormatLimits()) const;
     };
 
     /**
@@ -288,35 +427,78 @@ namespace fluent::ast {
         std::optional<Comment> comment;
         std::string id;
         std::vector<PatternElement> pattern;
-        std::unordered_map<std::string, Attribute> attributes;
+        /// Sorted by identifier. Messages rarely have more than a few attributes, so a
+        /// vector is both smaller and faster to search than a hash map.
+        std::vector<Attribute> attributes;
 
     public:
-        inline void setComment(Comment &&comment) { this->comment = comment; }
+        inline void setComment(Comment &&comment) { this->comment = std::move(comment); }
+        inline const std::optional<Comment> &getComment() const { return this->comment; }
 
     #ifdef TEST
         virtual std::string getPropertyTreeType() const { return "Message"; }
         boost::property_tree::ptree getPropertyTree() const;
     #endif
-        inline const std::optional<Attribute>
-        getAttribute(const std::string &identifier) const {
-            auto iter = this->attributes.find(identifier);
-            if (iter != this->attributes.end()) {
-                return std::optional(iter->second);
+        /**
+         * \brief Fetches an Attribute of this message
+         * \returns A pointer to the Attribute, or nullptr if it was not found.
+         *          The pointer remains valid for the lifetime of the Message.
+         */
+        inline const Attribute *getAttribute(std::string_view identifier) const {
+            auto iter = std::lower_bound(
+                this->attributes.begin(), this->attributes.end(), identifier,
+                [](const Attribute &a, std::string_view id) { return a.getId() < id; });
+            if (iter != this->attributes.end() && iter->getId() == identifier) {
+                return &*iter;
             }
-            return std::optional<Attribute>();
+            return nullptr;
         }
 
         inline const std::string &getId() const { return this->id; }
+        inline const std::vector<PatternElement> &getPattern() const { return this->pattern; }
+        /// Returns the attributes of the message, sorted by identifier
+        inline const std::vector<Attribute> &getAttributes() const {
+            return this->attributes;
+        }
+
+        /**
+         * \brief Releases memory which is not needed for formatting
+         *
+         * Frees the unused capacity left in the message's patterns by parsing, and, if
+         * keepComment is false, its comment.
+         */
+        void compact(bool keepComment = true);
+
+        /**
+         * \brief Renders the number literals of the message and its attributes for the
+         *        locale of context
+         * \see NumberLiteral::localize
+         */
+        void localize(const FormatContext &context) const;
+
         Message(std::string &&id, std::vector<Attribute> &&attributes);
 
         Message(std::string &&id, std::vector<PatternElement> &&pattern,
                 std::vector<Attribute> &&attributes = std::vector<Attribute>(),
                 std::optional<Comment> &&comment = std::optional<Comment>());
+        Message(PreprocessedPattern, std::string &&id, std::vector<PatternElement> &&pattern,
+                std::vector<Attribute> &&attributes = std::vector<Attribute>(),
+                std::optional<Comment> &&comment = std::optional<Comment>());
+
+        const std::string format(const FormatContext &context,
+                                 const std::map<std::string, Variable> &args,
+                                 const MessageLookup &messageLookup,
+                                 const TermLookup &termLookup) const;
 
-        const std::string format(
-            const icu::Locale &locId, const std::map<std::string, Variable> &args,
-            const std::function<std::optional<Message>(const std::string &)> messageLookup,
-            const std::function<std::optional<Term>(const std::string &)> termLookup) const;
+        /**
+         * \brief Formats the message, appending the result to out
+         *
+         * Referenced messages and terms are formatted directly into the same sink,
+         * within the given limits.
+         */
+        void format(OutputSink &out, const FormatContext &context, const FluentArgs &args,
+                    const MessageLookup &messageLookup, const TermLookup &termLookup,
+                    const FormatLimits &limits = FormatLimits()) const;
 
         friend std::ostream &operator<<(std::ostream &out,
                                         const fluent::ast::Message &message);
@@ -341,6 +523,18 @@ namespace fluent::ast {
 
     typedef std::variant<AnyComment, Message, Term, Junk> Entry;
 
+    /**
+     * \brief Localises a Variable passed as an argument to a message, appending the
+     *        result to out
+     */
+    void formatVariable(OutputSink &out, const FormatContext &context,
+                        const VariableView &variable);
+
+    /**
+     * \brief Appends the placeholder for a variable which a term was not passed
+     */
+    void appendUnknownVariable(OutputSink &out, std::string_view identifier);
+
     #ifdef TEST
     void processEntry(boost::property_tree::ptree &parent, fluent::ast::Entry &entry);
     #endif
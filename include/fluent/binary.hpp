@@ -0,0 +1,73 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file binary.hpp
+ *  \brief A precompiled binary format for parsed fluent resources
+ */
+
+#ifndef _FLUENT_BINARY_HPP_
+#define _FLUENT_BINARY_HPP_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast.hpp"
+
+namespace fluent {
+
+    /**
+     * \brief The version of the binary format written by serializeResource
+     *
+     * Incremented whenever the layout changes. deserializeResource only accepts images
+     * with exactly this version, so images must be regenerated (e.g. by rebuilding the
+     * ftlembed output) after upgrading.
+     */
+    static constexpr uint32_t BINARY_RESOURCE_VERSION = 3;
+
+    /**
+     * \brief Serializes the messages and terms of a parsed resource into a binary image
+     *
+     * The image starts with a table of every distinct string used by the resource
+     * (identifiers, text and literals), followed by the entries, whose patterns refer to
+     * strings by index. Select expressions are stored as flat lists of variants.
+     *
+     * Comments and Junk are not included, as they are not needed to format messages.
+     * The image does not depend on the host's byte order.
+     */
+    std::string serializeResource(const std::vector<ast::Entry>& entries);
+    /// \brief Serializes a single term, as serializeResource would a resource
+    ///        containing only that term
+    std::string serializeResource(const ast::Term& term);
+
+    /**
+     * \brief Reads the entries of an image created by serializeResource
+     *
+     * The image is read in place; no text parsing takes place.
+     *
+     * \throws std::runtime_error if the image is truncated, malformed, or was written
+     *         with a different BINARY_RESOURCE_VERSION.
+     */
+    std::vector<ast::Entry> deserializeResource(std::string_view image);
+
+} // namespace fluent
+
+#endif
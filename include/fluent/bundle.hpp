@@ -25,46 +25,336 @@
 #ifndef _FLUENT_BUNDLE_HPP_
 #define _FLUENT_BUNDLE_HPP_
 
+#include <array>
+#include <atomic>
 #include <filesystem>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unicode/locid.h>
 #include <unordered_map>
+#include <vector>
 
 #include "ast.hpp"
+#include "compiler.hpp"
+#include "context.hpp"
+#include "symbols.hpp"
 
 namespace fluent {
 
+  /**
+   *  \class LazyEntry
+   *  \brief The unparsed source of a message or term, parsed when it is first used
+   *
+   *  The source is kept alive by sharing ownership of the resource it points into,
+   *  which may be a string or a MappedFile. Parsing is thread-safe, and happens at
+   *  most once, even if the entry is shared between several copies of a bundle.
+   */
+  template <typename T> class LazyEntry {
+    private:
+      std::shared_ptr<const void> resource;
+      std::string_view source;
+      bool keepComment;
+      mutable std::once_flag parsed;
+      mutable std::shared_ptr<const T> value;
+
+    public:
+      /// If keepComment is false, the comment attached to the entry is discarded once
+      /// it is parsed
+      LazyEntry(std::shared_ptr<const void> resource, std::string_view source,
+                bool keepComment = true)
+          : resource(std::move(resource)), source(source), keepComment(keepComment) {}
+
+      /**
+       * \brief Parses the entry if this has not been done yet
+       * \returns The parsed entry, or nullptr if the source did not contain a T
+       */
+      const std::shared_ptr<const T> &get() const;
+  };
+
+  /**
+   *  \class TermPool
+   *  \brief Shares identical terms between bundles
+   *
+   *  Terms such as brand names are often the same in many locales. Terms added
+   *  through the pool are identified by their content, and a term identical to one
+   *  already in use is replaced by a reference to the existing copy. The pool only
+   *  holds weak references, so terms are freed once no bundle uses them.
+   *
+   *  Terms are keyed by a hash of their structure. Only terms whose hashes match are
+   *  serialized, to confirm that they are identical.
+   *
+   *  The pool is thread-safe.
+   */
+  class TermPool {
+    private:
+      mutable std::mutex mutex;
+      std::unordered_multimap<size_t, std::weak_ptr<const ast::Term>> terms;
+      /// The number of terms at which expired terms are next removed from the map
+      size_t pruneThreshold = 64;
+      size_t shared = 0;
+
+    public:
+      /**
+       * \brief Returns a term identical to the given one, which may be shared with
+       *        other bundles
+       */
+      std::shared_ptr<const ast::Term> intern(ast::Term &&term);
+      /// The number of terms intern has replaced with an existing copy
+      size_t getSharedCount() const;
+  };
+
   /**
    *  \class FluentBundle
    *  \brief A class storing messages and associated data for a specific locale
+   *
+   *  Messages and terms are stored in chunked arrays indexed by their interned
+   *  MessageId and TermId, which copies of the bundle share. The symbol tables
+   *  assigning these ids are owned by the caller (usually a FluentLoader) and shared
+   *  between all of its bundles.
+   *
+   *  A bundle used on its own can instead be accessed by identifier, through the
+   *  overloads taking no ids, in which case it interns identifiers in tables of its
+   *  own. A bundle should only be accessed in one of these ways.
    */
   class FluentBundle {
+    public:
+      /// A stored ast::Message or ast::Term together with its compiled form, if any.
+      /// For entries added lazily, value is empty and lazy holds the source instead.
+      /// Entries added from a compiled image only have their compiled form.
+      template <typename T> struct Entry {
+          std::shared_ptr<const T> value;
+          std::shared_ptr<const CompiledMessage> compiled;
+          std::shared_ptr<const LazyEntry<T>> lazy;
+
+          /// The parsed value, parsing it first if necessary, or nullptr if there is
+          /// only the compiled form
+          const T *get() const {
+              if (this->value)
+                  return this->value.get();
+              return this->lazy ? this->lazy->get().get() : nullptr;
+          }
+      };
+
     private:
-      // Mapping of message identifiers to Messages
-      std::unordered_map<std::string, ast::Message> messages;
-      // Mapping of term identifiers to Terms
-      std::unordered_map<std::string, ast::Term> terms;
+      /// Entries indexed by id, stored in fixed-size chunks. Copies of the bundle
+      /// share the chunks, and a chunk is only copied when a bundle sharing it
+      /// modifies one of its entries, so copying a bundle to change a few entries does
+      /// not copy all of them.
+      template <typename T> class EntryTable {
+        public:
+          static constexpr size_t CHUNK_SIZE = 64;
+
+          struct Chunk {
+              std::array<Entry<T>, CHUNK_SIZE> entries;
+              // Set once a second table refers to the chunk
+              std::atomic<bool> shared{false};
+
+              Chunk() = default;
+              Chunk(const Chunk &other) : entries(other.entries) {}
+          };
+
+        private:
+          // Chunks without any entries are null
+          std::vector<std::shared_ptr<Chunk>> chunks;
+
+        public:
+          EntryTable() = default;
+          EntryTable(const EntryTable &other) : chunks(other.chunks) {
+              for (const std::shared_ptr<Chunk> &chunk : this->chunks) {
+                  if (chunk)
+                      chunk->shared.store(true, std::memory_order_relaxed);
+              }
+          }
+          EntryTable &operator=(const EntryTable &other) {
+              if (this != &other) {
+                  EntryTable copy(other);
+                  *this = std::move(copy);
+              }
+              return *this;
+          }
+          EntryTable(EntryTable &&other) = default;
+          EntryTable &operator=(EntryTable &&other) = default;
+
+          /// The entry at index, or nullptr if it is out of range or empty
+          const Entry<T> *find(uint32_t index) const;
+          /// Returns the empty entry at index so that a value can be stored in it, or
+          /// nullptr if it already holds one
+          Entry<T> *reserve(uint32_t index);
+          /// Returns the entry at index so that it can be modified, first copying its
+          /// chunk if it is shared
+          Entry<T> &modify(uint32_t index);
+          /// Calls f with every non-empty entry, copying their chunks if shared
+          template <typename F> void modifyAll(F f);
+      };
+
+      // ICU formatting state for the bundle's locale, shared between copies of the bundle
+      std::shared_ptr<const FormatContext> context;
+      // Messages indexed by MessageId. Ids without a message in this bundle are empty
+      EntryTable<ast::Message> messages;
+      // Terms indexed by TermId
+      EntryTable<ast::Term> terms;
+      // Whether messages are compiled as they are added. Set by compile
+      bool compiled = false;
+
+      struct Symbols {
+          SymbolTable<MessageId> messageIds;
+          SymbolTable<TermId> termIds;
+      };
+      // Tables used by the overloads taking identifiers, created when first needed.
+      // Copies of the bundle share them until one of the copies adds an identifier.
+      std::shared_ptr<Symbols> symbols;
+
+      Symbols &getOwnSymbols();
 
     public:
+      /**
+       * \brief Creates an empty bundle for the given locale
+       *
+       * The ICU objects used to format messages in this locale are created here,
+       * once, and reused for every message formatted from the bundle.
+       */
+      explicit FluentBundle(const icu::Locale &locale);
+
+      /**
+       * \brief The formatting context for this bundle's locale
+       */
+      inline const FormatContext &getContext() const { return *this->context; }
+
       /**
        * \brief Adds the given ast::Message to the bundle
+       *
+       * If the bundle already contains a message with this id, the existing message is
+       * kept.
+       *
+       * \param id: The id of the message's identifier
+       * \param message: The message to add
+       * \param messageIds, termIds: Tables used to intern references if the bundle is
+       *                             compiled.
+       * \returns true if the message was added, false if the bundle already contained
+       *          a message with this id.
        */
-      void addMessage(ast::Message &&message);
+      bool addMessage(MessageId id, ast::Message &&message,
+                      SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds);
+      /// \overload bool addMessage(MessageId id, ast::Message &&message, SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds)
+      bool addMessage(ast::Message &&message);
       /**
        * \brief Adds the given ast::Term to the bundle
+       *
+       * As addMessage, but for terms.
+       */
+      bool addTerm(TermId id, ast::Term &&term, SymbolTable<MessageId> &messageIds,
+                   SymbolTable<TermId> &termIds);
+      /// \overload bool addTerm(TermId id, ast::Term &&term, SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds)
+      bool addTerm(ast::Term &&term);
+      /**
+       * \brief Adds a term which may be shared with other bundles, e.g. one returned
+       *        by TermPool::intern
+       *
+       * As addTerm. If the bundle is compiled, it compiles the term itself, so the
+       * compiled form is not shared.
+       */
+      bool addTerm(TermId id, std::shared_ptr<const ast::Term> term,
+                   SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds);
+      /**
+       * \brief Adds a message which will be parsed the first time it is looked up
+       *
+       * As addMessage, except if the bundle is compiled, in which case the message has
+       * to be parsed immediately so that it can be compiled.
+       */
+      bool addLazyMessage(MessageId id, std::shared_ptr<const LazyEntry<ast::Message>> message,
+                          SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds);
+      /**
+       * \brief Adds a term which will be parsed the first time it is looked up
+       *
+       * As addLazyMessage, but for terms.
+       */
+      bool addLazyTerm(TermId id, std::shared_ptr<const LazyEntry<ast::Term>> term,
+                       SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds);
+      /**
+       * \brief Adds a message which only exists in compiled form, e.g. one read by
+       *        loadCompiledResource
+       *
+       * The message can only be formatted through getCompiledMessage, so it is meant
+       * for compiled bundles; getMessage returns nullptr for it. As addMessage, an
+       * existing message with this id is kept.
+       */
+      bool addCompiledMessage(MessageId id, std::shared_ptr<const CompiledMessage> message);
+      /**
+       * \brief Adds a term which only exists in compiled form
+       *
+       * As addCompiledMessage, but for terms.
+       */
+      bool addCompiledTerm(TermId id, std::shared_ptr<const CompiledMessage> term);
+      /**
+       * \brief Removes a message from the bundle, if it contains one with this id
+       *
+       * Copies of the bundle sharing the message are not affected.
        */
-      void addTerm(ast::Term &&term);
+      void removeMessage(MessageId id);
+      /**
+       * \brief Removes a term from the bundle, if it contains one with this id
+       */
+      void removeTerm(TermId id);
+      /**
+       * \brief Whether the bundle contains a message with this id
+       *
+       * Unlike getMessage, this never parses a lazily added message, and also finds
+       * messages which were added in compiled form only.
+       */
+      bool hasMessage(MessageId id) const;
+      /**
+       * \brief Whether the bundle contains a term with this id
+       */
+      bool hasTerm(TermId id) const;
       /**
        * \brief Fetches an ast::Message from this bundle
-       * \returns The ast::Message, or an empty optional if the ast::Message was not found
+       * \returns A non-owning pointer to the ast::Message, or nullptr if the
+       *          ast::Message was not found or was added in compiled form only. The
+       *          pointer remains valid until the bundle is destroyed.
        */
-      std::optional<ast::Message> getMessage(const std::string &identifier) const;
+      const ast::Message *getMessage(MessageId id) const;
+      /// \overload const ast::Message *getMessage(MessageId id) const
+      const ast::Message *getMessage(std::string_view identifier) const;
       /**
        * \brief Fetches an ast::Term from this bundle
-       * \returns The ast::Term, or an empty optional if the ast::Term was not found
+       * \returns A non-owning pointer to the ast::Term, or nullptr if the ast::Term
+       *          was not found. The pointer remains valid until the bundle is
+       *          destroyed.
+       */
+      const ast::Term *getTerm(TermId id) const;
+      /// \overload const ast::Term *getTerm(TermId id) const
+      const ast::Term *getTerm(std::string_view identifier) const;
+
+      /**
+       * \brief Compiles all messages and terms in the bundle
+       *
+       * Once a bundle has been compiled, messages and terms added to it later are
+       * compiled as they are added. Lazily added entries are parsed in order to be
+       * compiled. The ast::Message objects are kept, so getMessage
+       * and getTerm continue to work.
+       */
+      void compile(SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds);
+      /// \overload void compile(SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds)
+      void compile();
+      /**
+       * \brief Whether compile has been called for this bundle
+       */
+      inline bool isCompiled() const { return this->compiled; }
+      /**
+       * \brief Fetches the compiled form of a message
+       * \returns A non-owning pointer to the CompiledMessage, or nullptr if the message
+       *          was not found or the bundle has not been compiled.
+       */
+      const CompiledMessage *getCompiledMessage(MessageId id) const;
+      /**
+       * \brief Fetches the compiled form of a term
+       * \returns A non-owning pointer to the CompiledMessage, or nullptr if the term
+       *          was not found or the bundle has not been compiled.
        */
-      std::optional<ast::Term> getTerm(const std::string &identifier) const;
+      const CompiledMessage *getCompiledTerm(TermId id) const;
   };
 
 };
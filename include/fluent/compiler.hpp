@@ -0,0 +1,384 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file compiler.hpp
+ *  \brief Compilation of messages into flat instruction streams for fast formatting
+ */
+
+#ifndef _FLUENT_COMPILER_HPP_
+#define _FLUENT_COMPILER_HPP_
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "ast.hpp"
+#include "context.hpp"
+#include "format_limits.hpp"
+#include "sink.hpp"
+#include "symbols.hpp"
+
+namespace fluent {
+
+    class CompiledMessage;
+
+    /**
+     * \class CompiledResolver
+     * \brief Resolves references between compiled messages while formatting
+     */
+    class CompiledResolver {
+    public:
+        virtual ~CompiledResolver() = default;
+        /// \returns The compiled message with the given id, or nullptr
+        virtual const CompiledMessage *getMessage(MessageId id) const = 0;
+        /// \returns The compiled term with the given id, or nullptr
+        virtual const CompiledMessage *getTerm(TermId id) const = 0;
+    };
+
+    /**
+     * \class CompiledMessage
+     * \brief A Message or Term compiled into a flat instruction stream
+     *
+     * The value and attributes of the message share a single instruction stream and
+     * text pool, each starting at its own entry point. Text and string literals are
+     * merged into spans of the text pool, and select expressions with string literal
+     * selectors are resolved during compilation.
+     *
+     * Nothing in the compiled form depends on the locale. Number literals, and select
+     * expressions with number literal selectors, are resolved with the context the
+     * message is formatted with, which for a reference into another locale's bundle is
+     * that of the bundle formatting started in, as for ast::Message::format.
+     *
+     * The compiled form does not refer back to the ast::Message it was built from, though
+     * it shares the (immutable) arguments of the term references in it. Its arrays are
+     * referred to by index rather than by pointer, so that they can also be read in
+     * place from a compiled image (see loadCompiledResource). Copies of a compiled
+     * message share its arrays.
+     */
+    class CompiledMessage {
+    public:
+        static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+        enum class OpCode : uint8_t {
+            /// Appends the span [a, a + b) of the text pool
+            Text,
+            /// Appends the formatted argument named names[a]
+            Variable,
+            /// Appends literals[a], localised
+            Number,
+            /// Formats the message referenced by references[a]
+            Message,
+            /// Formats the term referenced by references[a]
+            Term,
+            /// Evaluates selects[a] and continues execution at the matching variant
+            Select,
+            /// Continues execution at a
+            Jump,
+            /// Ends the current pattern
+            Return,
+        };
+
+        struct Instruction {
+            OpCode op;
+            uint32_t a;
+            uint32_t b;
+        };
+
+        /// The string [offset, offset + length) of a string pool
+        struct StringRef {
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        /// A message or term reference
+        struct Reference {
+            /// The MessageId or TermId of the referenced message or term. For a
+            /// message loaded from a compiled image, the index of the identifier in the
+            /// image instead, which messageIds or termIds maps to the id.
+            uint32_t id;
+            /// Index into names of the identifier, used when reporting missing references
+            uint32_t name;
+            /// Index into names of the attribute, or NONE for the message value
+            uint32_t attribute;
+            /// Index into arguments of the arguments of a term reference, or NONE if
+            /// there are none
+            uint32_t arguments;
+        };
+
+        /// A variant keyed by an identifier
+        struct StringVariant {
+            uint64_t hash;
+            /// Index into names of the key
+            uint32_t name;
+            uint32_t target;
+        };
+
+        /// A variant keyed by a number
+        struct NumberVariant {
+            double value;
+            uint32_t target;
+        };
+
+        /**
+         * Dispatch table for a select expression whose selector is a variable or a
+         * number literal
+         *
+         * Targets are the entry points of the patterns of the variants. Variants are
+         * compiled in order, so when several variants match, the one with the lowest
+         * target is the first in the resource, which is the one Fluent picks.
+         */
+        struct SelectTable {
+            /// Index into names of the selector variable
+            uint32_t variable;
+            /// Variants keyed by a plural category, indexed by PluralCategory. NONE if
+            /// there is no variant for the category.
+            std::array<uint32_t, PLURAL_CATEGORY_COUNT> categories;
+            /// Variants keyed by a number, as numberCount entries of numberVariants
+            /// starting at numbers, sorted by value
+            uint32_t numbers;
+            uint32_t numberCount;
+            /// Variants keyed by an identifier, as an open addressing hash table with
+            /// linear probing in stringCount entries of stringVariants starting at
+            /// strings. Its size is zero or a power of two and empty slots have a name
+            /// of NONE. Only the first variant with a given key is stored.
+            uint32_t strings;
+            uint32_t stringCount;
+            uint32_t defaultTarget;
+            /// Index into literals of the selector if it is a number literal, in which
+            /// case variable is NONE
+            uint32_t literal;
+        };
+
+        /// The entry point of an attribute
+        struct AttributeEntry {
+            /// Index into names of the attribute's identifier
+            uint32_t name;
+            uint32_t entry;
+        };
+
+    private:
+        /// A read-only array, owned by storage
+        template <typename T> struct Span {
+            const T *data = nullptr;
+            uint32_t size = 0;
+
+            const T &operator[](size_t index) const { return this->data[index]; }
+            const T *begin() const { return this->data; }
+            const T *end() const { return this->data + this->size; }
+            bool empty() const { return this->size == 0; }
+        };
+
+        // The arrays are either owned by the message, or point into a compiled image,
+        // from which the message is formatted in place
+        Span<Instruction> code;
+        std::string_view text;
+        /// The pool of the strings in names
+        const char *strings = nullptr;
+        /// Identifiers of variables, references, attributes and variant keys
+        Span<StringRef> names;
+        Span<Reference> references;
+        Span<SelectTable> selects;
+        Span<NumberVariant> numberVariants;
+        Span<StringVariant> stringVariants;
+        /// Number literals, which are localised when the message is formatted
+        Span<ast::NumberLiteral> literals;
+        /// Arguments of term references, shared with the TermReferences they were
+        /// compiled from
+        Span<std::shared_ptr<const ast::CallArguments>> arguments;
+        /// Entry points of the attributes, sorted by identifier
+        Span<AttributeEntry> attributes;
+        /// For a message loaded from a compiled image, the MessageId and TermId of
+        /// each identifier in the image. Empty otherwise.
+        Span<uint32_t> messageIds;
+        Span<uint32_t> termIds;
+        uint32_t valueEntry = NONE;
+        /// Keeps the memory the spans point into alive
+        std::shared_ptr<const void> storage;
+
+        friend class Compiler;
+        friend class CompiledImageWriter;
+        friend class CompiledImageReader;
+
+        std::string_view getName(uint32_t index) const {
+            return std::string_view(this->strings + this->names[index].offset,
+                                    this->names[index].length);
+        }
+
+        /// The id of the message or term a reference refers to
+        uint32_t getId(const Reference &reference, bool isTerm) const {
+            const Span<uint32_t> &ids = isTerm ? this->termIds : this->messageIds;
+            return ids.empty() ? reference.id : ids[reference.id];
+        }
+
+        /// Returns the entry point of an attribute, or NONE if there is no such attribute
+        uint32_t findAttribute(std::string_view attribute) const;
+
+        void execute(uint32_t entry, const FormatContext &context,
+                     const FluentArgs &args, const CompiledResolver &resolver,
+                     OutputSink &out, const FormatLimits &limits) const;
+
+        uint32_t select(const SelectTable &table, const FormatContext &context,
+                        const FluentArgs &args, bool termScope) const;
+        /// Returns the target of the variant matching the selector value key
+        uint32_t select(const SelectTable &table, const FormatContext &context,
+                        const VariableView &key) const;
+
+    public:
+        /**
+         * \brief Compiles a Message or Term
+         *
+         * \param message: The message to compile
+         * \param context: The formatting context of the bundle containing the message.
+         *                 Number literals are rendered for it in advance, but the
+         *                 compiled message can be formatted with any context.
+         * \param messageIds: Table used to intern the identifiers of referenced messages
+         * \param termIds: Table used to intern the identifiers of referenced terms
+         */
+        static CompiledMessage compile(const ast::Message &message,
+                                       const FormatContext &context,
+                                       SymbolTable<MessageId> &messageIds,
+                                       SymbolTable<TermId> &termIds);
+
+        /**
+         * \brief Formats the value of the message
+         *
+         * Equivalent to ast::Message::format on the message this was compiled from.
+         */
+        const std::string format(const FormatContext &context,
+                                 const FluentArgs &args,
+                                 const CompiledResolver &resolver) const;
+
+        /**
+         * \brief Formats an attribute of the message
+         * \returns The formatted attribute, or an empty optional if the message has no
+         *          attribute with the given identifier.
+         */
+        std::optional<std::string>
+        formatAttribute(const std::string &attribute, const FormatContext &context,
+                        const FluentArgs &args,
+                        const CompiledResolver &resolver) const;
+
+        /**
+         * \brief Formats the value of the message, appending the result to out
+         *
+         * References are followed iteratively, within the given limits.
+         */
+        void format(OutputSink &out, const FormatContext &context,
+                    const FluentArgs &args,
+                    const CompiledResolver &resolver,
+                    const FormatLimits &limits = FormatLimits()) const;
+
+        /**
+         * \brief Formats an attribute of the message, appending the result to out
+         * \returns false, without writing anything, if the message has no attribute
+         *          with the given identifier.
+         */
+        bool formatAttribute(OutputSink &out, const std::string &attribute,
+                             const FormatContext &context,
+                             const FluentArgs &args,
+                             const CompiledResolver &resolver,
+                             const FormatLimits &limits = FormatLimits()) const;
+
+        /// Whether the message has an attribute with the given identifier
+        bool hasAttribute(std::string_view attribute) const;
+
+        /**
+         * \brief Whether formatting the value or an attribute of the message may depend
+         *        on the arguments passed, either directly or through the messages it
+         *        references
+         *
+         * \param attribute: The attribute to check, or nullptr for the value
+         * \param maxDepth: References nested deeper than this are assumed to depend on
+         *                  the arguments
+         */
+        bool usesArguments(const std::string *attribute, const CompiledResolver &resolver,
+                           size_t maxDepth) const;
+
+    private:
+        bool usesArguments(uint32_t entry, const CompiledResolver &resolver,
+                           size_t depth, size_t maxDepth) const;
+    };
+
+    /**
+     * \brief The version of the image format written by serializeCompiledResource
+     *
+     * As BINARY_RESOURCE_VERSION, images must be regenerated after upgrading.
+     */
+    static constexpr uint32_t COMPILED_RESOURCE_VERSION = 1;
+
+    /**
+     * \brief Compiles the messages and terms of a resource into an image which they can
+     *        be formatted from in place
+     *
+     * Unlike the images written by serializeResource, the image holds the compiled
+     * form of each entry (see CompiledMessage), laid out as it is used in memory. A
+     * file containing the image can be mapped by each worker of a prefork server, or
+     * placed in shared memory, and all of them format from the same pages.
+     *
+     * The image uses the byte order and struct layout of the platform it was written
+     * on, and can only be loaded on platforms which match it.
+     *
+     * \param locale: The locale whose context the entries are compiled with
+     */
+    std::string serializeCompiledResource(const std::vector<ast::Entry> &entries,
+                                          const icu::Locale &locale);
+
+    /// A message or term read from an image by loadCompiledResource
+    struct CompiledEntry {
+        /// The identifier of the entry, which points into the image
+        std::string_view identifier;
+        bool isTerm;
+        std::shared_ptr<const CompiledMessage> message;
+    };
+
+    /**
+     * \brief Reads the messages and terms of an image created by
+     *        serializeCompiledResource
+     *
+     * The image is checked once, up front, and the messages then run their
+     * instructions and append their text straight from it. Only their number
+     * literals and the arguments of term references are copied out of the image.
+     *
+     * \param owner: Keeps the memory of the image alive, for as long as any of the
+     *               messages is in use. The image must be aligned to 8 bytes, as a
+     *               mapped file is.
+     * \param context: The formatting context of the bundle the entries are added to,
+     *                 which their number literals are rendered for in advance
+     * \param messageIds, termIds: Tables the identifiers used by the image are
+     *                             interned in
+     * \throws std::runtime_error if the image is truncated, malformed or misaligned,
+     *         or was written with a different COMPILED_RESOURCE_VERSION or on a
+     *         platform with a different layout. Nothing is interned in that case.
+     */
+    std::vector<CompiledEntry> loadCompiledResource(std::shared_ptr<const void> owner,
+                                                    std::string_view image,
+                                                    const FormatContext &context,
+                                                    SymbolTable<MessageId> &messageIds,
+                                                    SymbolTable<TermId> &termIds);
+
+} // namespace fluent
+
+#endif
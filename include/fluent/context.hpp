@@ -0,0 +1,152 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file context.hpp
+ *  \brief Locale-specific formatting state shared by all messages in a bundle
+ */
+
+#ifndef _FLUENT_CONTEXT_HPP_
+#define _FLUENT_CONTEXT_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unicode/locid.h>
+#include <unicode/numberformatter.h>
+#include <unicode/plurrule.h>
+#include <vector>
+
+#include "sink.hpp"
+
+namespace fluent {
+
+    /**
+     * \brief The CLDR plural categories
+     */
+    enum class PluralCategory : uint8_t { Zero, One, Two, Few, Many, Other };
+    static constexpr size_t PLURAL_CATEGORY_COUNT = 6;
+
+    /**
+     * \returns The plural category with the given CLDR name (e.g. "one"), or an empty
+     *          optional if name is not a plural category
+     */
+    std::optional<PluralCategory> toPluralCategory(std::string_view name);
+
+    /// \returns The CLDR name of a plural category, e.g. "one"
+    std::string_view getPluralCategoryName(PluralCategory category);
+
+    /**
+     * \class FormatContext
+     * \brief ICU objects used when formatting messages for a specific locale
+     *
+     * ICU plural rules and number formatters are expensive to construct, so they are
+     * created once when the context is created and reused for every message formatted
+     * with it. A FormatContext is immutable once constructed and may be shared between
+     * threads.
+     */
+    class FormatContext {
+    private:
+        /// Distinguishes this context from every other one in the process
+        uint64_t serial;
+        icu::Locale locale;
+        std::unique_ptr<icu::PluralRules> pluralRules;
+        icu::number::LocalizedNumberFormatter numberFormatter;
+        /// Formatters with a minimum number of fraction digits, indexed by that number
+        std::vector<icu::number::LocalizedNumberFormatter> fractionFormatters;
+
+    public:
+        /// The largest number of fraction digits for which a formatter is cached.
+        /// Number literals with more digits than this build their formatter on demand.
+        static constexpr size_t MAX_CACHED_FRACTION_DIGITS = 6;
+
+        explicit FormatContext(const icu::Locale &locale);
+
+        FormatContext(const FormatContext &) = delete;
+        FormatContext &operator=(const FormatContext &) = delete;
+
+        inline const icu::Locale &getLocale() const { return this->locale; }
+
+        /**
+         * \brief A number identifying this context, which no other context created by
+         *        the process has
+         *
+         * Unlike the address of the context, it is never reused once the context is
+         * destroyed, so it can key data cached for the context in longer-lived objects.
+         */
+        inline uint64_t getSerial() const { return this->serial; }
+
+        /**
+         * \brief Localises an integer, appending it to out
+         *
+         * ICU's formatted output is UTF-16; it is transcoded directly into out rather
+         * than through an intermediate string.
+         *
+         * \returns false, without writing anything, if ICU failed to format the number
+         */
+        bool formatNumber(OutputSink &out, long value) const;
+        /// \overload bool formatNumber(OutputSink &out, long value) const
+        bool formatNumber(OutputSink &out, double value) const;
+        /// \overload bool formatNumber(OutputSink &out, long value) const
+        bool formatNumber(OutputSink &out, double value,
+                          size_t minFractionDigits) const;
+
+        /**
+         * \brief Localises an integer
+         * \returns The formatted number, or an empty optional if ICU failed to format it
+         */
+        std::optional<std::string> formatNumber(long value) const;
+
+        /**
+         * \brief Localises a floating point number using the default precision
+         * \returns The formatted number, or an empty optional if ICU failed to format it
+         */
+        std::optional<std::string> formatNumber(double value) const;
+
+        /**
+         * \brief Localises a floating point number, displaying at least
+         *        minFractionDigits digits after the decimal separator
+         * \returns The formatted number, or an empty optional if ICU failed to format it
+         */
+        std::optional<std::string> formatNumber(double value,
+                                                size_t minFractionDigits) const;
+
+        /**
+         * \brief Determines the CLDR plural category (e.g. "one", "other") of a number
+         *
+         * If no plural rules could be loaded for the locale, "other" is returned.
+         */
+        std::string getPluralCategory(double value) const;
+        /// \overload std::string getPluralCategory(double value) const
+        std::string getPluralCategory(long value) const;
+
+        /**
+         * \brief As getPluralCategory, but without converting the name of the category
+         *        from UTF-16
+         */
+        PluralCategory selectPluralCategory(double value) const;
+        /// \overload PluralCategory selectPluralCategory(double value) const
+        PluralCategory selectPluralCategory(long value) const;
+    };
+
+} // namespace fluent
+
+#endif
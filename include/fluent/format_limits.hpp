@@ -0,0 +1,150 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file format_limits.hpp
+ *  \brief Bounds on the work done formatting a single message
+ */
+
+#ifndef _FLUENT_FORMAT_LIMITS_HPP_
+#define _FLUENT_FORMAT_LIMITS_HPP_
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+#include "sink.hpp"
+
+namespace fluent {
+
+    /**
+     * \struct FormatLimits
+     * \brief Limits protecting against translations which expand without bound
+     *
+     * Messages and terms may reference each other, so a small resource can produce an
+     * enormous amount of output (the "billion laughs" attack), or reference itself
+     * forever. References which would form a cycle are never followed, and are
+     * formatted as ``cyclic reference { id }``.
+     */
+    struct FormatLimits {
+        /// The most message and term references which may be nested. Deeper references
+        /// are formatted as ``reference too deep { id }``.
+        size_t maxDepth = 32;
+        /// The most variables and message and term references which may be expanded
+        /// while formatting a message, counting those of the messages it references.
+        /// Formatting stops when the limit is reached.
+        size_t maxPlaceables = 100;
+        /// The longest formatted message, in bytes. Output past the limit is dropped,
+        /// without splitting UTF-8 sequences, and formatting stops.
+        size_t maxOutputSize = 1 << 20;
+    };
+
+    /**
+     * \class FormatBudget
+     * \brief Tracks the placeables and output of a message against its FormatLimits
+     */
+    class FormatBudget : public OutputSink {
+    private:
+        OutputSink &out;
+        const FormatLimits &limits;
+        size_t placeables = 0;
+        size_t written = 0;
+        bool exhausted = false;
+
+    public:
+        FormatBudget(OutputSink &out, const FormatLimits &limits) : out(out), limits(limits) {}
+
+        /// Counts a placeable, returning false if there were already too many
+        bool expand() {
+            if (++this->placeables > this->limits.maxPlaceables)
+                this->exhausted = true;
+            return !this->exhausted;
+        }
+
+        /// Whether formatting should stop
+        bool isExhausted() const { return this->exhausted; }
+
+        void append(std::string_view text) override {
+            if (this->exhausted)
+                return;
+            size_t remaining = this->limits.maxOutputSize - this->written;
+            if (text.size() > remaining) {
+                // Don't end the output with part of a UTF-8 sequence
+                while (remaining > 0 && (text[remaining] & 0xC0) == 0x80)
+                    remaining--;
+                text = text.substr(0, remaining);
+                this->exhausted = true;
+            }
+            this->written += text.size();
+            this->out.append(text);
+        }
+    };
+
+    /**
+     * \class FrameStack
+     * \brief The stack of patterns being formatted
+     *
+     * Formatting follows references with an explicit stack rather than by recursion,
+     * so a deeply nested translation cannot overflow the thread's stack. As with
+     * FluentArgs, the first few frames are stored inline so that formatting a message
+     * does not usually allocate.
+     */
+    template <typename Frame> class FrameStack {
+    public:
+        static constexpr size_t INLINE_CAPACITY = 8;
+
+    private:
+        std::array<Frame, INLINE_CAPACITY> inlineFrames;
+        size_t inlineCount = 0;
+        std::vector<Frame> overflow;
+
+    public:
+        bool empty() const { return this->inlineCount == 0; }
+        size_t size() const { return this->inlineCount + this->overflow.size(); }
+
+        /// The frame being formatted. Invalidated by push.
+        Frame &top() {
+            return this->overflow.empty() ? this->inlineFrames[this->inlineCount - 1]
+                                          : this->overflow.back();
+        }
+
+        const Frame &operator[](size_t index) const {
+            return index < INLINE_CAPACITY ? this->inlineFrames[index]
+                                           : this->overflow[index - INLINE_CAPACITY];
+        }
+
+        void push(const Frame &frame) {
+            if (this->inlineCount < INLINE_CAPACITY)
+                this->inlineFrames[this->inlineCount++] = frame;
+            else
+                this->overflow.push_back(frame);
+        }
+
+        void pop() {
+            if (this->overflow.empty())
+                this->inlineCount--;
+            else
+                this->overflow.pop_back();
+        }
+    };
+
+} // namespace fluent
+
+#endif
@@ -25,42 +25,184 @@
 #ifndef _FLUENT_LOADER_HPP_
 #define _FLUENT_LOADER_HPP_
 
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <istream>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unicode/locid.h>
-#include <unordered_map>
+#include <vector>
 
+#include "args.hpp"
 #include "bundle.hpp"
+#include "format_limits.hpp"
+#include "message_key.hpp"
+#include "metrics.hpp"
+#include "sink.hpp"
+#include "symbols.hpp"
 
 namespace fluent {
 
+    class LocaleChain;
+
+    /**
+     * \struct MessageRequest
+     * \brief A message to be formatted by FluentLoader::formatMessages
+     */
+    struct MessageRequest {
+        /// The identifier of the message, optionally followed by ".attributeId". Must
+        /// remain valid until formatMessages returns.
+        std::string_view resId;
+        /// The arguments to format the message with, which may be shared between
+        /// requests. nullptr if there are none.
+        const FluentArgs* args = nullptr;
+    };
+
+    /**
+     * \class FormattedBatch
+     * \brief The results of FluentLoader::formatMessages
+     *
+     * All results are stored in a single buffer. Clearing the batch keeps the
+     * buffer's capacity, so a batch reused across calls stops allocating once it has
+     * grown to fit.
+     */
+    class FormattedBatch {
+    private:
+        std::string buffer;
+        /// Offset and length of each result in buffer. Missing messages have an
+        /// offset of npos
+        std::vector<std::pair<size_t, size_t>> ranges;
+
+        friend class FluentLoader;
+
+    public:
+        /// The number of results
+        size_t size() const { return this->ranges.size(); }
+        /// Whether the message of the given request was found
+        bool found(size_t index) const { return this->ranges[index].first != std::string::npos; }
+        /// The formatted message, or an empty string if it was not found. Invalidated
+        /// when the batch is modified.
+        std::string_view operator[](size_t index) const {
+            const auto& [offset, length] = this->ranges[index];
+            if (offset == std::string::npos)
+                return std::string_view();
+            return std::string_view(this->buffer).substr(offset, length);
+        }
+        /// Removes all results
+        void clear() {
+            this->buffer.clear();
+            this->ranges.clear();
+        }
+    };
+
+    /**
+     * \brief How a FluentLoader handles a message or term defined by more than one
+     *        resource for the same locale
+     */
+    enum class ConflictPolicy {
+        /// The definition added first is kept, and later ones are ignored
+        FirstWins,
+        /// Each definition replaces the one added before it
+        LastWins,
+        /// Adding the resource throws std::runtime_error, leaving the loader unchanged
+        Error,
+    };
+
     /**
      * \class FluentLoader
      * \brief A high-level loader for storing and accessing fluent resources
+     *
+     * A FluentLoader may be used from multiple threads at once. Formatting never takes
+     * a lock: the loaded resources are held in an immutable snapshot, which readers
+     * acquire with a single atomic load of a std::shared_ptr. Functions modifying the
+     * loader (adding resources, compiling, interning new ids) are serialised with
+     * each other, build a modified copy of the snapshot and publish it atomically once
+     * they are done, so concurrent readers see either all or none of a change.
+     *
+     * Unchanged bundles, messages and terms are shared between snapshots, so the cost
+     * of a write is proportional to the number of identifiers and the size of the
+     * bundles it touches, not to the whole contents of the loader.
      */
     class FluentLoader {
     private:
-        /// Mapping of Locale identifiers to the bundle for that locale.
-        std::unordered_map<std::string, FluentBundle> bundles;
-        void addResource(const icu::Locale locId, const std::filesystem::path& ftlpath);
-        void addResource(const icu::Locale locId, std::vector<ast::Entry>&& entries);
-        void addResource(const icu::Locale locId, std::string&& input);
+        /// An immutable snapshot of everything known to the loader
+        struct State;
+        /// Copy-on-write builder for the next State. Holds writeMutex while alive
+        class Writer;
+        /// Files and directories loaded by addDirectory, and the background thread
+        /// started by watch
+        struct Watcher;
+        /// A fallback chain resolved to the bundles of a State. See LocaleChain
+        struct ResolvedChain;
+        friend class LocaleChain;
+
+        /// The currently published snapshot. Only accessed with std::atomic_load and
+        /// std::atomic_store
+        std::shared_ptr<const State> state;
+        /// Serialises writers. Never taken when formatting
+        std::mutex writeMutex;
+        /// The files being tracked are only accessed while holding writeMutex
+        std::unique_ptr<Watcher> watcher;
+
+        /// Returns the currently published snapshot
+        std::shared_ptr<const State> snapshot() const;
+
+        /// Returns the resolution of chain for the current snapshot, resolving it again
+        /// if the loader has changed since it was last used
+        std::shared_ptr<const ResolvedChain> resolve(const LocaleChain& chain) const;
 
-        std::optional<std::pair<ast::Message, icu::Locale>>
-        getMessage(const std::vector<icu::Locale>& locIdFallback, const std::string& resId) const;
+        bool formatResolvedTo(
+            OutputSink& out,
+            const ResolvedChain& chain,
+            std::string_view resId,
+            const FluentArgs& args) const;
 
-        std::optional<ast::Term> getTerm(const std::vector<icu::Locale>& locIdFallback, const std::string& resId) const;
+        bool formatResolvedTo(
+            OutputSink& out,
+            const ResolvedChain& chain,
+            MessageId id,
+            const std::string* attribute,
+            const FluentArgs& args) const;
+
+        bool formatResolvedTo(
+            OutputSink& out,
+            const ResolvedChain& chain,
+            std::string_view identifier,
+            const std::string* attribute,
+            const FluentArgs& args) const;
+
+        std::shared_ptr<const std::string>
+        getCachedResolved(const ResolvedChain& chain, const std::string& resId) const;
+
+        void loadDirectory(const std::string& dir, std::optional<std::set<std::string>> resources,
+                           unsigned threads, const std::function<void(const icu::Locale&)>& onLocaleLoaded);
+
+        template <typename Args>
+        using EnableIfArgs =
+            std::enable_if_t<std::is_convertible_v<const Args&, const FluentArgs&>, int>;
 
     public:
+        FluentLoader();
+        ~FluentLoader();
+        FluentLoader(const FluentLoader&) = delete;
+        FluentLoader& operator=(const FluentLoader&) = delete;
+
         /**
          * \brief Loads the fluent resource files contained in the given directory.
          *
          * These files should be stored in subdirectories with names equal to the locales
          * for the messages they contain.
          *
-         * All ftl files within these directories will be loaded.
+         * All ftl files within these directories will be loaded. Files for the same
+         * locale are merged into its bundle in order of their paths, using the policy
+         * set by setConflictPolicy.
          *
          * E.g.
          *  - ${root}/en-GB/main.ftl
@@ -78,6 +220,95 @@ namespace fluent {
          */
         void addDirectory(const std::string& dir, const std::set<std::string>& resources);
 
+        /// Called when all resources for a locale have been loaded by addDirectoryAsync
+        typedef std::function<void(const icu::Locale&)> LocaleCallback;
+
+        /**
+         * \brief Loads the fluent resource files in a directory, parsing them in parallel
+         *
+         * As addDirectory, but files are parsed on a pool of worker threads, and
+         * this function returns immediately.
+         *
+         * The resources of each locale are published as soon as every file for that
+         * locale has been parsed, so formatMessage can be used with locales that are
+         * done while others are still loading. Within a locale, files are added in
+         * sorted path order, so the resulting bundles do not depend on which thread
+         * finished first.
+         *
+         * The loader must not be destroyed before the returned future is ready.
+         *
+         * \param dir: Directory to be processed.
+         * \param threads: The number of threads to parse with. If 0, uses
+         *                 std::thread::hardware_concurrency.
+         * \param onLocaleLoaded: If given, called on a worker thread after each locale
+         *                        has been published.
+         * \returns A future which is ready once every locale has been loaded. If a file
+         *          could not be parsed, its locale is not loaded, and the exception is
+         *          rethrown by the future. Other locales are still loaded.
+         */
+        std::future<void> addDirectoryAsync(const std::string& dir, unsigned threads = 0,
+                                            LocaleCallback onLocaleLoaded = LocaleCallback());
+
+        /**
+         * \overload std::future<void> addDirectoryAsync(const std::string& dir, unsigned threads, LocaleCallback onLocaleLoaded)
+         * \param resources: A list of resources to be used. Only ftl files matching
+         *                   these names will be loaded.
+         */
+        std::future<void> addDirectoryAsync(const std::string& dir,
+                                            const std::set<std::string>& resources,
+                                            unsigned threads = 0,
+                                            LocaleCallback onLocaleLoaded = LocaleCallback());
+
+        /**
+         * \brief As addDirectory, but parses files on the given number of threads
+         *
+         * Blocks until all resources have been loaded. See addDirectoryAsync.
+         */
+        void addDirectory(const std::string& dir, unsigned threads);
+
+        /**
+         * \overload void addDirectory(const std::string& dir, unsigned threads)
+         */
+        void addDirectory(const std::string& dir, const std::set<std::string>& resources,
+                          unsigned threads);
+
+        /**
+         * \brief Reloads any resource files loaded by addDirectory that have changed
+         *
+         * Every directory passed to addDirectory is scanned again. Files whose
+         * modification time or size changed are re-parsed, and only the messages and
+         * terms they previously provided are replaced in their locale's bundle. New
+         * files are loaded as if by addDirectory, and messages and terms from files
+         * which were deleted are removed.
+         *
+         * All changes are published at once, so a concurrent formatMessage sees
+         * either the old or the new version of every reloaded file.
+         * If no file has changed, nothing is copied and other writers are not
+         * blocked.
+         *
+         * \returns The number of files which were added, reloaded or removed
+         */
+        size_t reload();
+
+        /**
+         * \brief Starts a background thread calling reload periodically
+         *
+         * If the loader is already being watched, the previous thread is stopped
+         * first. Errors while reloading (e.g. a file which cannot be read) leave the
+         * loaded resources unchanged, and are retried on the next poll.
+         *
+         * \param interval: The time to wait between checks for changed files
+         */
+        void watch(std::chrono::milliseconds interval);
+
+        /**
+         * \brief Stops the thread started by watch, if any
+         *
+         * Also called when the loader is destroyed. watch and stopWatching must not be
+         * called concurrently with each other.
+         */
+        void stopWatching();
+
         /**
          *  \brief Loads a single message
          *
@@ -94,6 +325,151 @@ namespace fluent {
          */
         void addMessage(icu::Locale& locId, std::string&& identifier, std::string&& messageContents);
 
+        /**
+         *  \brief Adds a resource to the bundle for the given locale
+         *
+         *  If the locale already has a bundle, the entries are merged into it. Only
+         *  the entries of this resource are moved into the bundle; the others are
+         *  shared with the previous snapshot. Messages and terms which are already
+         *  defined for the locale are handled according to setConflictPolicy.
+         *
+         *  If setShareTerms is enabled, terms identical to ones already loaded, e.g.
+         *  for another locale, share a single copy.
+         *
+         *  \throws std::runtime_error if the resource cannot be parsed, or if it
+         *          redefines an entry and the policy is ConflictPolicy::Error. The
+         *          loader is unchanged in either case.
+         */
+        void addResource(const icu::Locale locId, const std::filesystem::path& ftlpath);
+        /// \overload void addResource(const icu::Locale locId, const std::filesystem::path& ftlpath)
+        void addResource(const icu::Locale locId, std::vector<ast::Entry>&& entries);
+        /// \overload void addResource(const icu::Locale locId, const std::filesystem::path& ftlpath)
+        void addResource(const icu::Locale locId, std::string&& input);
+        /**
+         *  \brief Adds a resource read from a stream, as addResource
+         *
+         *  The stream is parsed with a StreamParser as it is read, so the source is
+         *  never held in memory as a whole. Resources read from a stream are always
+         *  parsed immediately, even if setLazyParsing is enabled.
+         *
+         *  \throws std::runtime_error if the stream cannot be read, or as addResource
+         */
+        void addResource(const icu::Locale locId, std::istream& input);
+
+        /**
+         *  \brief Adds a binary image created by serializeResource, as addResource
+         *
+         *  The image is read in place and is not needed once this returns, so it can
+         *  be the contents of a MappedFile. Loading an image skips parsing the source
+         *  of the resource.
+         *
+         *  \throws std::runtime_error if the image is malformed
+         */
+        void addBinaryResource(const icu::Locale locId, std::string_view image);
+
+        /**
+         *  \brief Adds a compiled image created by serializeCompiledResource, or by
+         *         ftlembed --compiled, as addResource
+         *
+         *  The messages are formatted in place from the image, which is mapped
+         *  read-only, so processes loading the same file (e.g. the workers of a
+         *  prefork server) share its pages rather than each holding a copy. The file
+         *  must not be modified while it is loaded.
+         *
+         *  The messages only exist in compiled form, so the loader is compiled first,
+         *  as by compile(). The image must have been compiled for the given locale.
+         *
+         *  \throws std::runtime_error if the file cannot be mapped, or as
+         *          loadCompiledResource if the image is invalid. The loader is
+         *          unchanged in that case.
+         */
+        void addCompiledResource(const icu::Locale locId, const std::filesystem::path& file);
+        /**
+         *  \brief Adds a compiled image held in memory, as addCompiledResource
+         *
+         *  \param owner: Keeps the image alive for as long as the loader uses it
+         */
+        void addCompiledResource(const icu::Locale locId, std::shared_ptr<const void> owner,
+                                 std::string_view image);
+
+        /**
+         *  \brief Sets how resources added from then on handle messages and terms
+         *         which are already defined for their locale
+         *
+         *  The default is ConflictPolicy::FirstWins. Entries reloaded by reload are
+         *  added again, so with ConflictPolicy::LastWins a reloaded file takes
+         *  precedence over the other files for its locale.
+         */
+        void setConflictPolicy(ConflictPolicy policy);
+
+        /**
+         *  \brief Sets the limits within which messages are formatted
+         *
+         *  Messages which reference themselves, nest references too deeply, or would
+         *  expand into too many placeables or too much output are cut short rather
+         *  than exhausting the stack or memory of the formatting thread. See
+         *  FormatLimits for the defaults. Cached messages are rendered again with the
+         *  new limits.
+         */
+        void setFormatLimits(const FormatLimits& limits);
+
+        /**
+         *  \brief Sets whether comments attached to messages and terms are kept
+         *
+         *  Comments are kept by default, but are never used when formatting. Setting
+         *  this to false before loading resources saves the memory they would use, and
+         *  resources parsed from then on skip their comments without copying them.
+         */
+        void setKeepComments(bool enabled);
+
+        /**
+         *  \brief Sets whether identical terms are shared between bundles
+         *
+         *  Disabled by default. When enabled, a term loaded from then on which is
+         *  identical to one already loaded, such as a brand name which is the same in
+         *  every locale, reuses the existing copy instead of keeping its own. This
+         *  costs a hash of every term loaded, so it only pays off for loaders holding
+         *  many locales. Terms which are parsed lazily are not shared.
+         */
+        void setShareTerms(bool enabled);
+
+        /**
+         *  \brief Sets whether resources are parsed lazily
+         *
+         *  When enabled, resources loaded from then on are only scanned for the
+         *  identifiers and locations of their messages and terms. Each message or term
+         *  is parsed the first time it is looked up, so the cost of loading a resource
+         *  depends on the messages actually used rather than its size. The source of a
+         *  lazily loaded resource is kept in memory in the meantime.
+         *
+         *  Syntax errors in a lazily loaded message are only detected when it is first
+         *  used, at which point the message is treated as missing.
+         *
+         *  Compiling (see compile) parses every message, so has no benefit when
+         *  combined with lazy parsing.
+         */
+        void setLazyParsing(bool enabled);
+
+        /**
+         *  \brief Sets an observer to be notified of formatting and loading events
+         *
+         *  Replaces the previous observer, if any. Pass nullptr to stop observing.
+         *  See FluentObserver and FluentMetrics.
+         */
+        void setObserver(std::shared_ptr<FluentObserver> observer);
+
+        /**
+         *  \brief Compiles all loaded messages for faster formatting
+         *
+         *  Each message and term is compiled into a flat instruction stream (see
+         *  CompiledMessage), which formatMessage will use from then on. Resources and
+         *  messages added after calling this are compiled as they are loaded.
+         *
+         *  The original AST is kept, so compiling does not change the output of
+         *  formatMessage.
+         */
+        void compile();
+
         /**
          * \brief Formats a message
          *
@@ -104,6 +480,8 @@ namespace fluent {
          * argument names to their values. The argument names should match the arguments
          * used by the message, and all arguments must be provided if the message uses them.
          *              Arguments which are not used will be ignored.
+         * \returns The formatted message, or nullopt if it was not found. A resId which
+         *          is not a valid reference is treated as not found.
          */
         std::optional<std::string>
         formatMessage(
@@ -111,7 +489,293 @@ namespace fluent {
             const std::string& resId,
             const std::map<std::string, fluent::ast::Variable>& args) const;
 
+        /**
+         * \brief Returns the interned id of a message identifier
+         *
+         * Ids are stable for the lifetime of the loader, and may be requested before the
+         * message itself has been loaded. Looking up an identifier which already has an
+         * id does not take the writer lock.
+         */
+        MessageId getMessageId(const std::string& identifier);
+
+        /**
+         * \brief Formats a message using its interned id
+         *
+         * As formatMessage, but skips hashing the message identifier.
+         *
+         * \param locIdFallback: A list of locale identifiers listing the priority to use
+         * when looking up messages.
+         * \param id: The id of the message, as returned by getMessageId
+         * \param args: A map of message argument names to their values.
+         */
+        std::optional<std::string>
+        formatMessage(
+            const std::vector<icu::Locale>& locIdFallback,
+            MessageId id,
+            const std::map<std::string, fluent::ast::Variable>& args) const;
+
+        /**
+         * \overload std::optional<std::string> formatMessage(const std::vector<icu::Locale>& locIdFallback, MessageId id, const std::map<std::string, fluent::ast::Variable>& args) const
+         *
+         * \param attribute: The identifier of the attribute of the message to format
+         */
+        std::optional<std::string>
+        formatMessage(
+            const std::vector<icu::Locale>& locIdFallback,
+            MessageId id,
+            const std::string& attribute,
+            const std::map<std::string, fluent::ast::Variable>& args) const;
+
+        /**
+         * \brief Formats a message using a FluentArgs (or other type convertible to
+         *        FluentArgs) instead of a std::map
+         *
+         * \overload std::optional<std::string> formatMessage(const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const std::map<std::string, fluent::ast::Variable>& args) const
+         */
+        template <typename Args, EnableIfArgs<Args> = 0>
+        std::optional<std::string>
+        formatMessage(
+            const std::vector<icu::Locale>& locIdFallback,
+            const std::string& resId,
+            const Args& args) const {
+            std::string result;
+            if (this->formatMessageTo(result, locIdFallback, resId, args))
+                return result;
+            return std::optional<std::string>();
+        }
+
+        /**
+         * \overload std::optional<std::string> formatMessage(const std::vector<icu::Locale>& locIdFallback, MessageId id, const std::map<std::string, fluent::ast::Variable>& args) const
+         */
+        template <typename Args, EnableIfArgs<Args> = 0>
+        std::optional<std::string>
+        formatMessage(
+            const std::vector<icu::Locale>& locIdFallback,
+            MessageId id,
+            const Args& args) const {
+            std::string result;
+            StringSink sink(result);
+            if (this->formatMessageTo(sink, locIdFallback, id, args))
+                return result;
+            return std::optional<std::string>();
+        }
+
+        /**
+         * \brief Returns the rendered form of a message which does not depend on its
+         *        arguments
+         *
+         * Messages and attributes which reference no variables, either directly or
+         * through the messages and terms they reference, are rendered once per fallback
+         * chain and cached. formatMessage also uses this cache. The cache is cleared
+         * whenever resources are added or reloaded.
+         *
+         * \returns The cached string, which stays valid for as long as the pointer is
+         *          held, even if the loader is modified. nullptr if the message does not
+         *          exist or depends on its arguments.
+         */
+        std::shared_ptr<const std::string>
+        getCachedMessage(const std::vector<icu::Locale>& locIdFallback,
+                         const std::string& resId) const;
+
+        /**
+         * \brief Formats a message, appending the result to a sink
+         *
+         * As formatMessage, but the whole message, including any referenced messages
+         * and terms, is written directly to out instead of being returned as a new
+         * string.
+         *
+         * \returns true if the message was found, false (without writing anything) if
+         *          it was not.
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const std::vector<icu::Locale>& locIdFallback,
+            const std::string& resId,
+            const FluentArgs& args) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const FluentArgs& args) const
+         *
+         * Appends to the end of out, without clearing it, so that a single buffer can
+         * be reused for many messages.
+         */
+        bool formatMessageTo(
+            std::string& out,
+            const std::vector<icu::Locale>& locIdFallback,
+            const std::string& resId,
+            const FluentArgs& args) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const FluentArgs& args) const
+         *
+         * \param id: The id of the message, as returned by getMessageId
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const std::vector<icu::Locale>& locIdFallback,
+            MessageId id,
+            const FluentArgs& args) const;
+
+        /**
+         * \brief Formats a message using a LocaleChain
+         *
+         * As formatMessage, but looks the message and anything it references up
+         * through the bundles chain has been resolved to.
+         */
+        std::optional<std::string>
+        formatMessage(
+            const LocaleChain& chain,
+            const std::string& resId,
+            const FluentArgs& args = FluentArgs()) const;
+
+        /**
+         * \overload std::optional<std::string> formatMessage(const LocaleChain& chain, const std::string& resId, const FluentArgs& args) const
+         *
+         * \param id: The id of the message, as returned by getMessageId
+         */
+        std::optional<std::string>
+        formatMessage(
+            const LocaleChain& chain,
+            MessageId id,
+            const FluentArgs& args = FluentArgs()) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const FluentArgs& args) const
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const LocaleChain& chain,
+            const std::string& resId,
+            const FluentArgs& args) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, MessageId id, const FluentArgs& args) const
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const LocaleChain& chain,
+            MessageId id,
+            const FluentArgs& args) const;
+
+        /**
+         * \brief Formats a message identified by a MessageKey
+         *
+         * As formatMessage, but the reference does not need to be split on every call.
+         */
+        std::optional<std::string>
+        formatMessage(
+            const std::vector<icu::Locale>& locIdFallback,
+            const MessageKey& key,
+            const FluentArgs& args = FluentArgs()) const;
+
+        /**
+         * \overload std::optional<std::string> formatMessage(const std::vector<icu::Locale>& locIdFallback, const MessageKey& key, const FluentArgs& args) const
+         */
+        std::optional<std::string>
+        formatMessage(
+            const LocaleChain& chain,
+            const MessageKey& key,
+            const FluentArgs& args = FluentArgs()) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const FluentArgs& args) const
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const std::vector<icu::Locale>& locIdFallback,
+            const MessageKey& key,
+            const FluentArgs& args) const;
+
+        /**
+         * \overload bool formatMessageTo(OutputSink& out, const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const FluentArgs& args) const
+         */
+        bool formatMessageTo(
+            OutputSink& out,
+            const LocaleChain& chain,
+            const MessageKey& key,
+            const FluentArgs& args) const;
+
+        /**
+         * \brief Formats many messages at once
+         *
+         * Equivalent to calling formatMessage for each request, but the chain is only
+         * resolved once, all messages are formatted with the same snapshot of the
+         * loader (so they are consistent with each other, even if the loader is
+         * modified concurrently), and the results share a single buffer.
+         *
+         * \param chain: The fallback chain to format every message with
+         * \param requests: The messages to format
+         * \param count: The number of requests
+         * \param out: The results are appended to out, in the order of the requests
+         * \param threads: If greater than 1, large batches are split between up to
+         *                 this many threads. Batches below a few hundred messages are
+         *                 always formatted on the calling thread.
+         * \throws std::out_of_range if a message uses an argument which was not given.
+         *         out is left unchanged.
+         */
+        void formatMessages(
+            const LocaleChain& chain,
+            const MessageRequest* requests,
+            size_t count,
+            FormattedBatch& out,
+            unsigned threads = 1) const;
+
+        /**
+         * \overload void formatMessages(const LocaleChain& chain, const MessageRequest* requests, size_t count, FormattedBatch& out, unsigned threads) const
+         */
+        void formatMessages(
+            const LocaleChain& chain,
+            const std::vector<MessageRequest>& requests,
+            FormattedBatch& out,
+            unsigned threads = 1) const {
+            this->formatMessages(chain, requests.data(), requests.size(), out, threads);
+        }
+
+        /**
+         * \overload std::shared_ptr<const std::string> getCachedMessage(const std::vector<icu::Locale>& locIdFallback, const std::string& resId) const
+         */
+        std::shared_ptr<const std::string>
+        getCachedMessage(const LocaleChain& chain, const std::string& resId) const;
+
         friend void addStaticResource(const icu::Locale locId, std::string&& resource);
+        friend void addStaticBinaryResource(const icu::Locale locId, std::string_view image);
+    };
+
+    /**
+     * \class LocaleChain
+     * \brief A locale fallback chain which remembers where its messages were found
+     *
+     * Formatting with a std::vector<icu::Locale> looks each locale up by name, then
+     * searches the bundles in order, for the message and again for every message and
+     * term it references. A LocaleChain is resolved to the loader's bundles the
+     * first time it is used, and records which bundle each message and term was found
+     * in, so that subsequent lookups probe a single bundle.
+     *
+     * The chain is resolved again the first time it is used after the loader has
+     * been modified. Until then, the resolution keeps the loader's previous
+     * resources alive. A LocaleChain may be used from multiple threads at once, and
+     * with multiple loaders, though it only keeps the resolution for the one it was
+     * last used with.
+     */
+    class LocaleChain {
+    private:
+        std::vector<icu::Locale> locales;
+        /// Only accessed with std::atomic_load and std::atomic_store
+        mutable std::shared_ptr<const FluentLoader::ResolvedChain> resolved;
+
+        friend class FluentLoader;
+
+    public:
+        /**
+         * \param locales: The locales to look messages up in, in order of priority.
+         *                 Generally it is expected that the source locale is last.
+         */
+        explicit LocaleChain(std::vector<icu::Locale> locales);
+        LocaleChain(const LocaleChain& other);
+        LocaleChain& operator=(const LocaleChain& other);
+        ~LocaleChain();
+
+        const std::vector<icu::Locale>& getLocales() const { return this->locales; }
     };
 
     /**
@@ -122,6 +786,14 @@ namespace fluent {
      */
     void addStaticResource(const icu::Locale locId, std::string&& resource);
 
+    /**
+     * \brief Adds a precompiled resource to the static loader.
+     *
+     * As addStaticResource, but takes a binary image created by serializeResource
+     * (``ftlembed --binary``), which is loaded without parsing.
+     */
+    void addStaticBinaryResource(const icu::Locale locId, std::string_view image);
+
     /**
      * \brief Formats a message from the static loader.
      *
@@ -133,6 +805,40 @@ namespace fluent {
         const std::string& resId,
         const std::map<std::string, fluent::ast::Variable>& args);
 
+    /**
+     * \brief Returns the id of a message in the static loader
+     *
+     * \see FluentLoader::getMessageId
+     */
+    MessageId getStaticMessageId(const std::string& identifier);
+
+    /**
+     * \brief Formats a message from the static loader using its interned id
+     *
+     * \overload std::optional<std::string> formatStaticMessage(const std::vector<icu::Locale>& locIdFallback, const std::string& resId, const std::map<std::string, fluent::ast::Variable>& args)
+     */
+    std::optional<std::string> formatStaticMessage(
+        const std::vector<icu::Locale>& locIdFallback,
+        MessageId id,
+        const FluentArgs& args);
+
+    /**
+     * \brief Formats a message type generated by ``ftlembed --catalog``
+     *
+     * The message's id is looked up the first time each message type is formatted,
+     * and each of its arguments must be passed to its constructor, so a missing
+     * argument or misspelt message is a compile error.
+     *
+     * E.g. ``formatStaticMessage(locales, l10n::main::greeting(name))``
+     */
+    template <typename Message, typename = decltype(Message::identifier)>
+    std::optional<std::string> formatStaticMessage(
+        const std::vector<icu::Locale>& locIdFallback,
+        const Message& message) {
+        static const MessageId id = getStaticMessageId(std::string(Message::identifier));
+        return formatStaticMessage(locIdFallback, id, message.getArgs());
+    }
+
 }
 
 #endif
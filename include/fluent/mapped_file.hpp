@@ -0,0 +1,77 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file mapped_file.hpp
+ *  \brief Read-only memory mapping of resource files
+ */
+
+#ifndef _FLUENT_MAPPED_FILE_HPP_
+#define _FLUENT_MAPPED_FILE_HPP_
+
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+
+namespace fluent {
+
+    /**
+     * \class MappedFile
+     * \brief The contents of a file, mapped read-only into memory
+     *
+     * The contents can be read without copying them into a buffer first, and pages are
+     * only loaded by the OS as they are touched. The mapping is released when the
+     * MappedFile is destroyed, which invalidates any views of its contents.
+     */
+    class MappedFile {
+    private:
+        const char* data = nullptr;
+        size_t size = 0;
+    #ifdef _WIN32
+        void* fileHandle = nullptr;
+        void* mappingHandle = nullptr;
+    #endif
+
+        void close();
+
+    public:
+        /**
+         * \brief Maps the given file
+         * \throws std::filesystem::filesystem_error if the file cannot be opened or
+         *         mapped.
+         */
+        explicit MappedFile(const std::filesystem::path& file);
+        ~MappedFile();
+
+        MappedFile(MappedFile&& other) noexcept;
+        MappedFile& operator=(MappedFile&& other) noexcept;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        /**
+         * \brief The contents of the file. Valid as long as the MappedFile is alive
+         */
+        inline std::string_view getContents() const {
+            return std::string_view(this->data, this->size);
+        }
+    };
+
+} // namespace fluent
+
+#endif
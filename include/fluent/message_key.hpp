@@ -0,0 +1,94 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file message_key.hpp
+ *  \brief Identifiers of messages and their attributes
+ */
+
+#ifndef _FLUENT_MESSAGE_KEY_HPP_
+#define _FLUENT_MESSAGE_KEY_HPP_
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace fluent {
+
+    /**
+     * \struct MessageKeyView
+     * \brief A message identifier and optional attribute, referring to an existing string
+     */
+    struct MessageKeyView {
+        std::string_view identifier;
+        std::optional<std::string_view> attribute;
+    };
+
+    /**
+     * \brief Splits a message reference of the form "messageId" or
+     *        "messageId.attributeId"
+     *
+     * Unlike parseMessageReference, this does not invoke the parser or allocate, and
+     * does not throw.
+     *
+     * \returns The identifier and attribute, or nullopt if either is not a valid
+     *          fluent identifier.
+     */
+    std::optional<MessageKeyView> splitMessageKey(std::string_view resId) noexcept;
+
+    /**
+     * \class MessageKey
+     * \brief A pre-parsed reference to a message or one of its attributes
+     *
+     * Formatting with a MessageKey skips splitting the reference on every call.
+     */
+    class MessageKey {
+    private:
+        std::string identifier;
+        std::optional<std::string> attribute;
+
+    public:
+        explicit MessageKey(std::string identifier,
+                            std::optional<std::string> attribute = std::nullopt)
+            : identifier(std::move(identifier)), attribute(std::move(attribute)) {}
+
+        /**
+         * \brief Parses a reference of the form "messageId" or "messageId.attributeId"
+         *
+         * \returns The key, or nullopt if the reference is not valid.
+         */
+        static std::optional<MessageKey> parse(std::string_view resId);
+
+        const std::string& getIdentifier() const { return this->identifier; }
+        /// Returns the attribute, or nullptr if the key refers to the message's value
+        const std::string* getAttribute() const {
+            return this->attribute ? &*this->attribute : nullptr;
+        }
+        /// Returns the key in the form accepted by parse
+        std::string toString() const;
+
+        bool operator==(const MessageKey& other) const {
+            return this->identifier == other.identifier && this->attribute == other.attribute;
+        }
+        bool operator!=(const MessageKey& other) const { return !(*this == other); }
+    };
+
+} // namespace fluent
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file metrics.hpp
+ *  \brief Observing how a FluentLoader is used
+ */
+
+#ifndef _FLUENT_METRICS_HPP_
+#define _FLUENT_METRICS_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fluent {
+
+    /**
+     * \struct FormatEvent
+     * \brief Describes a single call to FluentLoader::formatMessage
+     */
+    struct FormatEvent {
+        /// The identifier of the message requested
+        std::string_view identifier;
+        /// The attribute requested, if any
+        const std::string *attribute;
+        /// The name of the locale the message was found in, empty if it was not found
+        std::string_view locale;
+        /// The position of locale in the fallback chain formatted with, 0 being the
+        /// preferred locale. Only meaningful if the message was found.
+        size_t fallbackDepth;
+        bool found;
+        /// The time taken to look up and format the message
+        std::chrono::nanoseconds duration;
+    };
+
+    /**
+     * \struct ResourceEvent
+     * \brief Describes a resource added to a FluentLoader
+     */
+    struct ResourceEvent {
+        /// The name of the locale the resource was added to
+        std::string_view locale;
+        /// The file the resource was loaded from, empty for resources loaded from
+        /// memory
+        std::string_view source;
+        /// The number of messages and terms added
+        size_t messages = 0;
+        size_t terms = 0;
+        /// The number of messages and terms which were not added, as the locale
+        /// already contained entries with the same identifier (see ConflictPolicy)
+        size_t rejected = 0;
+        /// The number of entries which could not be parsed. Lazily parsed resources
+        /// (see FluentLoader::setLazyParsing) only detect syntax errors when a message
+        /// is first used, so always report 0.
+        size_t junk = 0;
+    };
+
+    /**
+     * \class FluentObserver
+     * \brief Receives events from the FluentLoader it is attached to
+     *
+     * See FluentLoader::setObserver. Observers are called from whichever thread
+     * formats messages or loads resources, possibly from several at once, so must be
+     * thread-safe. onResourceLoaded is called while the loader is being modified, and
+     * must not modify the loader.
+     *
+     * If the library is built with FLUENT_NO_INSTRUMENTATION defined, the hooks are
+     * compiled out and observers are never called. Otherwise, a loader with no
+     * observer only pays for a null check.
+     */
+    class FluentObserver {
+    public:
+        virtual ~FluentObserver() = default;
+        /// Called after formatting a message, or failing to find it
+        virtual void onFormat(const FormatEvent &) {}
+        /// Called after adding or reloading a resource
+        virtual void onResourceLoaded(const ResourceEvent &) {}
+    };
+
+    /**
+     * \class FluentMetrics
+     * \brief A FluentObserver which counts formatting and loading events
+     *
+     * Totals are atomic counters. Per-message counts are kept in a map guarded by a
+     * mutex, so they are only collected if enabled in the constructor.
+     */
+    class FluentMetrics : public FluentObserver {
+    public:
+        /// Statistics for a single message
+        struct MessageStats {
+            uint64_t formats = 0;
+            uint64_t fallbacks = 0;
+            std::chrono::nanoseconds duration{0};
+        };
+
+    private:
+        bool perMessage;
+        std::atomic<uint64_t> formats{0};
+        std::atomic<uint64_t> missing{0};
+        std::atomic<uint64_t> fallbacks{0};
+        std::atomic<uint64_t> nanoseconds{0};
+        std::atomic<uint64_t> resources{0};
+        std::atomic<uint64_t> junk{0};
+        std::atomic<uint64_t> rejected{0};
+
+        mutable std::mutex mutex;
+        std::map<std::string, MessageStats, std::less<>> messages;
+        /// Junk entries per resource source, for those which produced any
+        std::map<std::string, uint64_t, std::less<>> junkBySource;
+
+    public:
+        /// \param perMessage: Whether to collect statistics for each message
+        explicit FluentMetrics(bool perMessage = true) : perMessage(perMessage) {}
+
+        void onFormat(const FormatEvent &event) override;
+        void onResourceLoaded(const ResourceEvent &event) override;
+
+        /// The number of messages formatted successfully
+        uint64_t getFormatCount() const { return this->formats.load(); }
+        /// The number of messages which were requested, but not found in any locale
+        uint64_t getMissingCount() const { return this->missing.load(); }
+        /// The number of messages found in a locale other than the preferred one
+        uint64_t getFallbackCount() const { return this->fallbacks.load(); }
+        /// The total time spent formatting
+        std::chrono::nanoseconds getFormatDuration() const {
+            return std::chrono::nanoseconds(this->nanoseconds.load());
+        }
+        uint64_t getResourceCount() const { return this->resources.load(); }
+        uint64_t getJunkCount() const { return this->junk.load(); }
+        uint64_t getRejectedCount() const { return this->rejected.load(); }
+
+        /// Returns a copy of the per-message statistics, indexed by message identifier
+        std::map<std::string, MessageStats, std::less<>> getMessageStats() const;
+
+        /**
+         * \brief Writes the metrics in the Prometheus text exposition format
+         *
+         * \param prefix: Prepended to the name of every metric
+         */
+        void writePrometheus(std::ostream &out, std::string_view prefix = "fluent_") const;
+    };
+
+} // namespace fluent
+
+#endif
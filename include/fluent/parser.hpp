@@ -27,14 +27,132 @@
 
 #include "fluent/ast.hpp"
 #include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 namespace fluent {
+    /**
+     * \brief Options controlling how a resource is parsed
+     */
+    struct ParseOptions {
+        /// Whether parsing fails if the resource contains any syntax errors, rather than
+        /// only if it cannot be parsed at all
+        bool strict = false;
+        /// Whether comments are parsed, both as ast::AnyComment entries and attached to
+        /// messages and terms. Otherwise they are skipped without being copied.
+        bool keepComments = true;
+        /// Whether invalid entries are returned as ast::Junk. Otherwise they are
+        /// skipped without being copied.
+        bool keepJunk = true;
+    };
+
     // Fixme: return a map instead of a vector
+    /**
+     * \brief Parses a fluent resource file
+     *
+     * The file is memory-mapped and parsed in place, without first being read into a
+     * buffer.
+     *
+     * \throws std::filesystem::filesystem_error if the file cannot be opened
+     */
     std::vector<ast::Entry> parseFile(const std::filesystem::path& file, bool strict = false);
+    std::vector<ast::Entry> parseFile(const std::filesystem::path& file, const ParseOptions& options);
     std::vector<ast::Entry> parse(std::string&& contents, bool strict = false);
+    std::vector<ast::Entry> parse(std::string&& contents, const ParseOptions& options);
     std::vector<ast::PatternElement> parsePattern(const std::string& input);
+
+    /**
+     * \brief The location of a top-level message or term, as found by scanResource
+     */
+    struct EntrySpan {
+        enum class Kind { Message, Term };
+        Kind kind;
+        /// The identifier of the entry, without the leading - of terms
+        std::string_view identifier;
+        /// The source of the whole entry, including its attributes
+        std::string_view source;
+    };
+
+    /**
+     * \brief Finds the messages and terms in a resource without parsing them
+     *
+     * This only looks at the start of each line: entries start on lines beginning
+     * with an identifier (or - and an identifier) followed by =, and extend until the
+     * next line beginning with an identifier, a - or a #. A span includes the # comment
+     * directly preceding its entry, which parseEntry attaches to it; other comments
+     * are skipped. The entries are not validated, so parseEntry may later find that a
+     * span only contains Junk.
+     *
+     * The returned views point into contents.
+     */
+    std::vector<EntrySpan> scanResource(std::string_view contents);
+
+    /**
+     * \brief Parses the source of a single entry found by scanResource
+     *
+     * \returns The ast::Message or ast::Term, or an empty optional if the source is
+     *          not a valid entry.
+     */
+    std::optional<ast::Entry> parseEntry(std::string_view source);
     ast::MessageReference parseMessageReference(const std::string& input);
+
+    /**
+     * \class StreamParser
+     * \brief Parses a resource which arrives in chunks, e.g. from a socket or a
+     *        decompressor
+     *
+     * Entries are passed to the callback as soon as they are complete, which is
+     * when the first character of the next entry arrives, or when finish is called.
+     * Only the entry currently being received is buffered.
+     *
+     * Entries are delimited as in scanResource. As there, a comment is kept together
+     * with the entry directly following it so that it is attached to it.
+     */
+    class StreamParser {
+    public:
+        typedef std::function<void(ast::Entry&&)> Callback;
+
+    private:
+        Callback callback;
+        ParseOptions options;
+        /// The source of the current entry, followed by any incomplete line
+        std::string buffer;
+        /// The offset in buffer of the start of the line being received
+        size_t lineStart = 0;
+        /// Whether the start of that line has been checked for a new entry
+        bool lineChecked = false;
+        bool previousLineIsComment = false;
+
+        /// Parses buffer up to end, and removes it from the buffer
+        void flush(size_t end);
+
+    public:
+        explicit StreamParser(Callback callback, const ParseOptions& options = ParseOptions());
+
+        /**
+         * \brief Appends the next chunk of the resource
+         *
+         * Chunks may end anywhere, including in the middle of a line or of a UTF-8
+         * sequence.
+         *
+         * \throws std::runtime_error if a completed entry cannot be parsed, under the
+         *         same conditions as parse. Exceptions thrown by the callback are
+         *         also propagated.
+         */
+        void feed(std::string_view chunk);
+
+        /**
+         * \brief Parses the rest of the resource
+         *
+         * The parser is left empty, and can be used for another resource.
+         *
+         * \throws std::runtime_error as feed
+         */
+        void finish();
+    };
 } // namespace fluent
 
 #endif
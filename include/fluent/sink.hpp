@@ -0,0 +1,100 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file sink.hpp
+ *  \brief Destinations for formatted output
+ */
+
+#ifndef _FLUENT_SINK_HPP_
+#define _FLUENT_SINK_HPP_
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace fluent {
+
+    /**
+     * \class OutputSink
+     * \brief A destination which formatted messages are appended to
+     *
+     * Formatting writes every part of a message, including referenced messages, terms
+     * and select expression variants, directly to a single sink.
+     */
+    class OutputSink {
+    public:
+        virtual ~OutputSink() = default;
+        /// Appends text to the output
+        virtual void append(std::string_view text) = 0;
+    };
+
+    /**
+     * \class StringSink
+     * \brief Appends output to an existing std::string
+     *
+     * The string is not cleared, so one buffer can be reused (or accumulate several
+     * messages) without reallocating.
+     */
+    class StringSink : public OutputSink {
+    private:
+        std::string &out;
+
+    public:
+        explicit StringSink(std::string &out) : out(out) {}
+        void append(std::string_view text) override { this->out.append(text); }
+    };
+
+    /**
+     * \class StreamSink
+     * \brief Writes output to a std::ostream
+     */
+    class StreamSink : public OutputSink {
+    private:
+        std::ostream &out;
+
+    public:
+        explicit StreamSink(std::ostream &out) : out(out) {}
+        void append(std::string_view text) override {
+            this->out.write(text.data(), static_cast<std::streamsize>(text.size()));
+        }
+    };
+
+    /**
+     * \class IteratorSink
+     * \brief Writes output through a char output iterator, such as
+     *        std::back_insert_iterator or fmt::appender
+     */
+    template <typename OutputIt> class IteratorSink : public OutputSink {
+    private:
+        OutputIt out;
+
+    public:
+        explicit IteratorSink(OutputIt out) : out(out) {}
+        void append(std::string_view text) override {
+            this->out = std::copy(text.begin(), text.end(), this->out);
+        }
+        /// The iterator positioned after the last character written
+        OutputIt get() const { return this->out; }
+    };
+
+} // namespace fluent
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file symbols.hpp
+ *  \brief Interning of message, term and locale identifiers as dense integers
+ */
+
+#ifndef _FLUENT_SYMBOLS_HPP_
+#define _FLUENT_SYMBOLS_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace fluent {
+
+    /**
+     * \class SymbolId
+     * \brief A dense integer standing in for an interned identifier
+     *
+     * The Tag distinguishes identifiers from different namespaces (messages, terms and
+     * locales), so that they cannot be mixed up.
+     */
+    template <typename Tag> struct SymbolId {
+        uint32_t index;
+
+        constexpr explicit SymbolId(uint32_t index) : index(index) {}
+
+        constexpr bool operator==(const SymbolId &other) const {
+            return this->index == other.index;
+        }
+        constexpr bool operator!=(const SymbolId &other) const {
+            return this->index != other.index;
+        }
+    };
+
+    /// Interned identifier of a Message
+    typedef SymbolId<struct MessageTag> MessageId;
+    /// Interned identifier of a Term
+    typedef SymbolId<struct TermTag> TermId;
+    /// Interned name of a locale
+    typedef SymbolId<struct LocaleTag> LocaleId;
+
+    /**
+     * \class SymbolTable
+     * \brief An append-only mapping of identifiers to dense integers
+     *
+     * Ids are assigned in the order identifiers are first interned, starting at 0, and
+     * are never invalidated, so they can be used to index flat arrays.
+     *
+     * Copies of a table share its contents, so copying is cheap. The contents are
+     * only copied when a table sharing them interns a new identifier, and are never
+     * modified once shared, so a copy may be read while another copy is interned
+     * into.
+     */
+    template <typename Id> class SymbolTable {
+    private:
+        struct Contents {
+            // A deque is used so that the views used as keys stay valid as it grows
+            std::deque<std::string> names;
+            std::unordered_map<std::string_view, uint32_t> indices;
+            // Set once a second table refers to the contents
+            std::atomic<bool> shared{false};
+
+            Contents() = default;
+            Contents(const Contents &other) : names(other.names) {
+                for (uint32_t i = 0; i < this->names.size(); i++) {
+                    this->indices.emplace(this->names[i], i);
+                }
+            }
+        };
+        std::shared_ptr<Contents> contents;
+
+    public:
+        SymbolTable() : contents(std::make_shared<Contents>()) {}
+        SymbolTable(const SymbolTable &other) : contents(other.contents) {
+            this->contents->shared.store(true, std::memory_order_relaxed);
+        }
+        SymbolTable &operator=(const SymbolTable &other) {
+            if (this != &other) {
+                SymbolTable copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+        // A moved-from table may only be assigned to or destroyed
+        SymbolTable(SymbolTable &&other) = default;
+        SymbolTable &operator=(SymbolTable &&other) = default;
+
+        /**
+         * \brief Returns the id of the given identifier, assigning it a new id if it
+         *        has not been seen before.
+         */
+        Id intern(std::string_view name) {
+            if (std::optional<Id> id = this->find(name))
+                return *id;
+            if (this->contents->shared.load(std::memory_order_relaxed))
+                this->contents = std::make_shared<Contents>(*this->contents);
+            Contents &contents = *this->contents;
+            uint32_t index = static_cast<uint32_t>(contents.names.size());
+            contents.names.emplace_back(name);
+            contents.indices.emplace(contents.names.back(), index);
+            return Id(index);
+        }
+
+        /**
+         * \brief Returns the id of the given identifier, or an empty optional if it has
+         *        not been interned.
+         */
+        std::optional<Id> find(std::string_view name) const {
+            auto iter = this->contents->indices.find(name);
+            if (iter != this->contents->indices.end())
+                return Id(iter->second);
+            return std::optional<Id>();
+        }
+
+        /**
+         * \brief Returns the identifier the given id was assigned to
+         */
+        const std::string &getName(Id id) const {
+            return this->contents->names[id.index];
+        }
+
+        /**
+         * \brief The number of interned identifiers. All ids are less than this.
+         */
+        size_t size() const { return this->contents->names.size(); }
+    };
+
+} // namespace fluent
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/args.hpp"
+#include <stdexcept>
+
+namespace fluent {
+
+    VariableView toVariableView(const ast::Variable &variable) {
+        return std::visit([](const auto &arg) { return VariableView(arg); }, variable);
+    }
+
+    FluentArgs::FluentArgs(std::initializer_list<Argument> args) {
+        for (const Argument &arg : args) {
+            this->set(arg.first, arg.second);
+        }
+    }
+
+    FluentArgs::FluentArgs(const std::map<std::string, ast::Variable> &args) {
+        for (const auto &[name, value] : args) {
+            this->set(name, toVariableView(value));
+        }
+    }
+
+    void FluentArgs::set(std::string_view name, VariableView value) {
+        for (size_t i = 0; i < this->inlineCount; i++) {
+            if (this->inlineArgs[i].first == name) {
+                this->inlineArgs[i].second = value;
+                return;
+            }
+        }
+        for (Argument &arg : this->overflow) {
+            if (arg.first == name) {
+                arg.second = value;
+                return;
+            }
+        }
+        if (this->inlineCount < INLINE_CAPACITY) {
+            this->inlineArgs[this->inlineCount++] = Argument(name, value);
+        } else {
+            this->overflow.emplace_back(name, value);
+        }
+    }
+
+    const VariableView *FluentArgs::find(std::string_view name) const {
+        for (size_t i = 0; i < this->inlineCount; i++) {
+            if (this->inlineArgs[i].first == name)
+                return &this->inlineArgs[i].second;
+        }
+        for (const Argument &arg : this->overflow) {
+            if (arg.first == name)
+                return &arg.second;
+        }
+        return nullptr;
+    }
+
+    const VariableView &FluentArgs::at(std::string_view name) const {
+        const VariableView *value = this->find(name);
+        if (!value)
+            throw std::out_of_range("Missing argument: " + std::string(name));
+        return *value;
+    }
+
+} // namespace fluent
@@ -18,12 +18,12 @@
  */
 
 #include "fluent/ast.hpp"
+#include "fluent/context.hpp"
 #include <algorithm>
 #include <iomanip>
 #include <limits>
 #include <sstream>
-#include <unicode/errorcode.h>
-#include <unicode/numberformatter.h>
+#include <stdexcept>
 
 namespace fluent::ast {
     template <class> inline constexpr bool always_false_v = false;
@@ -51,7 +51,7 @@ namespace fluent::ast {
 
     std::ostream &operator<<(std::ostream &out, const Message &message) {
         out << message.id << " = ";
-        for (fluent::ast::PatternElement value : message.pattern) {
+        for (const fluent::ast::PatternElement &value : message.pattern) {
             out << value;
         }
         return out;
@@ -73,129 +73,114 @@ namespace fluent::ast {
         return result.str();
     }
 
-    // The first text element should be stripped to remove leading whitespace
-    std::string stripStart(const std::string &str, const std::string &ws = " \r\n") {
-        const auto begin = str.find_first_not_of(ws);
-        if (begin == std::string::npos) {
-            return "";
-        }
-
-        return str.substr(begin, std::string::npos);
-    }
-
-    std::string stripEnd(const std::string &str, const std::string &ws = " \r\n") {
-        const auto end = str.find_last_not_of(ws);
-        return str.substr(0, end + 1);
-    }
-
-    std::string replaceNewlines(std::string &str) {
-        size_t pos;
-        // DOS newlines should be replaced with Unix newlines
-        while ((pos = str.find("\r\n")) != std::string::npos) {
-            str.replace(pos, 2, "\n");
-        }
-        return str;
-    }
-
     /**
-     * Finds minimum indent (on lines with something other than whitespace)
+     * Finds the minimum indent of the lines of a text element which start after a
+     * newline. Lines containing only whitespace are ignored, unless the element ends
+     * with such a line and is followed by a placeable, in which case that line is the
+     * indent of the placeable.
      */
-    size_t getMinIndent(const std::string &value) {
-        std::stringstream ss(value);
-        std::string line;
+    static size_t getMinIndent(std::string_view text, bool beforePlaceable) {
         size_t minIndent = std::numeric_limits<size_t>::max();
-        while (std::getline(ss, line, '\n')) {
-            size_t startpos = line.find_first_not_of("\r\n ");
-            // Ignore lines which only contain whitespace
-            if (startpos != std::string::npos && startpos < minIndent) {
-                minIndent = startpos;
-            }
+        size_t newline = text.find('\n');
+        while (newline != std::string_view::npos) {
+            size_t start = newline + 1;
+            newline = text.find('\n', start);
+            size_t end = newline == std::string_view::npos ? text.size() : newline;
+            size_t content = std::min(text.find_first_not_of(' ', start), end);
+            bool blank = content == end || (content + 1 == end && text[content] == '\r');
+            if (!blank || (newline == std::string_view::npos && beforePlaceable))
+                minIndent = std::min(minIndent, content - start);
         }
         return minIndent;
     }
 
     /**
-     * Removes minimum indent from all lines
+     * Removes up to indent spaces from each line after a newline, clears lines which
+     * only contain whitespace, and replaces DOS newlines with Unix newlines.
+     *
+     * The text only ever shrinks, so this is done in place in a single pass.
      */
-    std::string stripIndent(const std::string value, const size_t indent) {
-        std::stringstream ss(value);
-        std::stringstream result;
-        std::string line;
-        while (std::getline(ss, line, '\n')) {
-            size_t startpos = line.find_first_not_of("\r\n ");
-            // Clear lines which only contain whitespace
-            if (startpos == std::string::npos) {
-                line = "";
-            } else if (startpos > 0) {
-                line.replace(0, std::min(indent, startpos), "");
+    static void normalizeText(std::string &text, size_t indent, bool beforePlaceable) {
+        size_t read = 0;
+        size_t write = 0;
+        // The first line continues the line of the previous element, so is not indented
+        bool indented = false;
+        while (true) {
+            size_t newline = text.find('\n', read);
+            size_t end = newline == std::string::npos ? text.size() : newline;
+            if (newline != std::string::npos && end > read && text[end - 1] == '\r')
+                end--;
+            size_t start = read;
+            if (indented) {
+                size_t content = start;
+                while (content < end && text[content] == ' ')
+                    content++;
+                if (content == end && !(newline == std::string::npos && beforePlaceable))
+                    start = end;
+                else
+                    start += std::min(indent, content - start);
             }
-            result << line << '\n';
+            std::char_traits<char>::move(&text[write], text.data() + start, end - start);
+            write += end - start;
+            if (newline == std::string::npos)
+                break;
+            text[write++] = '\n';
+            read = newline + 1;
+            indented = true;
         }
-
-        return result.str();
+        text.resize(write);
     }
 
     void addPattern(
         std::vector<PatternElement>&& newPattern,
         std::vector<PatternElement>& existingPattern
     ) {
-        bool lastString = false;
-        std::string last;
+        size_t first = existingPattern.size();
+        // Adjacent text elements are merged, so that each line is only processed once
+        for (PatternElement &elem : newPattern) {
+            std::string *text = std::get_if<std::string>(&elem);
+            std::string *last = existingPattern.size() > first
+                                    ? std::get_if<std::string>(&existingPattern.back())
+                                    : nullptr;
+            if (text && last)
+                *last += *text;
+            else
+                existingPattern.push_back(std::move(elem));
+        }
+
         size_t minIndent = std::numeric_limits<size_t>::max();
-        for (ast::PatternElement elem : newPattern) {
-            std::visit(
-                [&](const auto &arg) {
-                    using T = std::decay_t<decltype(arg)>;
-                    if constexpr (std::is_same_v<T, std::string>) {
-                        size_t indent = getMinIndent(arg);
-                        if (indent < minIndent)
-                            minIndent = indent;
-                    }
-                },
-                elem
-            );
+        for (size_t index = first; index < existingPattern.size(); index++) {
+            if (const std::string *text = std::get_if<std::string>(&existingPattern[index]))
+                minIndent = std::min(
+                    minIndent, getMinIndent(*text, index + 1 < existingPattern.size()));
         }
-        // Only strip leading whitespace from the first text element
-        bool first = true;
-        for (ast::PatternElement elem : newPattern) {
-            std::visit(
-                [&](const auto &arg) {
-                    using T = std::decay_t<decltype(arg)>;
-                    if constexpr (std::is_same_v<T, std::string>) {
-                        // If the previous element was a string, merge with it
-                        last += arg;
-                        if (!lastString) {
-                            lastString = true;
-                            last = arg;
-                        }
-                    } else {
-                        if (lastString) {
-                            if (first) {
-                                existingPattern.push_back(PatternElement(stripStart(
-                                    stripIndent(replaceNewlines(last), minIndent))));
-                                first = false;
-                            } else {
-                                existingPattern.push_back(PatternElement(
-                                    stripIndent(replaceNewlines(last), minIndent)));
-                            }
-                            last = std::string();
-                            lastString = false;
-                        }
-                        existingPattern.push_back(elem);
-                    }
-                },
-                elem
-            );
+        for (size_t index = first; index < existingPattern.size(); index++) {
+            if (std::string *text = std::get_if<std::string>(&existingPattern[index]))
+                normalizeText(*text, minIndent, index + 1 < existingPattern.size());
         }
-        // Only strip trailing whitespace from the last text element
-        if (lastString) {
-            if (first) {
-                existingPattern.push_back(PatternElement(stripStart(stripEnd(stripIndent(replaceNewlines(last), minIndent)))));
-            }
-            else {
-                existingPattern.push_back(PatternElement(stripEnd(stripIndent(replaceNewlines(last), minIndent))));
-            }
+
+        if (existingPattern.size() == first)
+            return;
+        // Blank lines before the first line with content are dropped, along with the
+        // whitespace before the pattern on the line of its identifier
+        if (std::string *text = std::get_if<std::string>(&existingPattern[first])) {
+            size_t begin = 0;
+            while (begin < text->size() && (*text)[begin] == ' ')
+                begin++;
+            while (begin < text->size() && (*text)[begin] == '\n')
+                begin++;
+            text->erase(0, begin);
         }
+        // As is trailing whitespace, including blank lines at the end
+        if (std::string *text = std::get_if<std::string>(&existingPattern.back()))
+            text->erase(text->find_last_not_of(" \r\n") + 1);
+        existingPattern.erase(
+            std::remove_if(existingPattern.begin() + first, existingPattern.end(),
+                           [](const PatternElement &elem) {
+                               const std::string *text = std::get_if<std::string>(&elem);
+                               return text && text->empty();
+                           }),
+            existingPattern.end());
     }
 
     Attribute::Attribute(std::string &&id, std::vector<PatternElement> &&pattern)
@@ -204,6 +189,10 @@ namespace fluent::ast {
         addPattern(std::move(pattern), this->pattern);
     }
 
+    Attribute::Attribute(PreprocessedPattern, std::string &&id,
+                         std::vector<PatternElement> &&pattern)
+        : id(std::move(id)), pattern(std::move(pattern)) {}
+
     Message::Message(std::string &&id, std::vector<Attribute> &&attributes)
         : Message(std::move(id), std::vector<PatternElement>(), std::move(attributes)) {}
 
@@ -212,81 +201,270 @@ namespace fluent::ast {
         std::vector<PatternElement>&& pattern,
         std::vector<Attribute>&& attributes, 
         std::optional<Comment>&& comment
-    ) : comment(std::move(comment)), id(std::move(id)) 
+    ) : Message(PreprocessedPattern(), std::move(id), std::vector<PatternElement>(),
+                std::move(attributes), std::move(comment))
     {
         addPattern(std::move(pattern), this->pattern);
-        for (ast::Attribute &attribute : attributes) {
-            this->attributes.insert(std::make_pair(attribute.getId(), attribute));
+    }
+
+    Message::Message(
+        PreprocessedPattern,
+        std::string&& id,
+        std::vector<PatternElement>&& pattern,
+        std::vector<Attribute>&& attributes,
+        std::optional<Comment>&& comment
+    ) : comment(std::move(comment)), id(std::move(id)), pattern(std::move(pattern))
+    {
+        // If an attribute is defined more than once, the first definition is used
+        std::stable_sort(attributes.begin(), attributes.end(),
+                         [](const Attribute &a, const Attribute &b) {
+                             return a.getId() < b.getId();
+                         });
+        auto last = std::unique(attributes.begin(), attributes.end(),
+                                [](const Attribute &a, const Attribute &b) {
+                                    return a.getId() == b.getId();
+                                });
+        attributes.erase(last, attributes.end());
+        this->attributes = std::move(attributes);
+    }
+
+    /// Releases the unused capacity of a pattern and everything nested in it
+    static void compactPattern(std::vector<PatternElement> &pattern) {
+        pattern.shrink_to_fit();
+        for (PatternElement &element : pattern) {
+            std::visit(
+                [](auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, std::string>) {
+                        arg.shrink_to_fit();
+                    } else if constexpr (std::is_same_v<T, SelectExpression>) {
+                        compactPattern(arg.selector);
+                        arg.variants.shrink_to_fit();
+                        for (auto &variant : arg.variants)
+                            compactPattern(variant.second);
+                    }
+                },
+                element);
         }
     }
 
-    const std::string NumberLiteral::format(const icu::Locale& locid) const {
-        static const icu::number::LocalizedNumberFormatter formatter = icu::number::NumberFormatter::withLocale(locid);
-        icu::ErrorCode status;
-        std::string buffer;
+    void Attribute::compact() { compactPattern(this->pattern); }
+
+    static void localizePattern(const std::vector<PatternElement> &pattern,
+                                const FormatContext &context) {
+        for (const PatternElement &element : pattern) {
+            std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, NumberLiteral>) {
+                        arg.localize(context);
+                    } else if constexpr (std::is_same_v<T, SelectExpression>) {
+                        // The selector and keys are compared rather than formatted
+                        for (const auto &variant : arg.variants)
+                            localizePattern(variant.second, context);
+                    }
+                },
+                element);
+        }
+    }
+
+    void Attribute::localize(const FormatContext &context) const {
+        localizePattern(this->pattern, context);
+    }
+
+    void Message::localize(const FormatContext &context) const {
+        localizePattern(this->pattern, context);
+        for (const Attribute &attribute : this->attributes)
+            attribute.localize(context);
+    }
 
+    void Message::compact(bool keepComment) {
+        compactPattern(this->pattern);
+        this->attributes.shrink_to_fit();
+        for (Attribute &attribute : this->attributes)
+            attribute.compact();
+        if (!keepComment)
+            this->comment.reset();
+    }
+
+    CallArguments::CallArguments(std::vector<Argument> &&arguments) {
+        for (Argument &argument : arguments) {
+            if (Literal *literal = std::get_if<Literal>(&argument))
+                this->positional.push_back(std::move(*literal));
+            else
+                this->named.push_back(std::move(std::get<NamedArgument>(argument)));
+        }
+        // named is not modified from here on, so the views into it stay valid
+        for (const auto &[name, value] : this->named) {
+            this->args.set(name, std::visit(
+                [](const auto &literal) -> VariableView {
+                    using T = std::decay_t<decltype(literal)>;
+                    if constexpr (std::is_same_v<T, StringLiteral>)
+                        return std::string_view(literal.value);
+                    else
+                        return std::visit([](auto number) { return VariableView(number); },
+                                          literal.getValue());
+                },
+                value));
+        }
+    }
+
+    TermReference::TermReference(std::string &&identifier,
+                                 std::optional<std::string> &&attribute,
+                                 std::optional<std::vector<CallArguments::Argument>> &&arguments)
+        : MessageReference(std::move(identifier), std::move(attribute)) {
+        if (arguments)
+            this->arguments = std::make_shared<const CallArguments>(std::move(*arguments));
+    }
+
+    const FluentArgs &TermReference::getArgs() const {
+        static const FluentArgs noArgs;
+        return this->arguments ? this->arguments->getArgs() : noArgs;
+    }
+
+    NumberLiteral::NumberLiteral(std::string &&value) : value(std::move(value)) {
         size_t decimalPos = this->value.find_first_of(".");
-        std::string result;
         if (decimalPos == std::string::npos) {
-            result = formatter
-                .formatInt(stol(this->value), status)
-                .toString(status)
-                .toUTF8String(buffer);
+            try {
+                this->number = stol(this->value);
+            } catch (const std::out_of_range &) {
+                this->number = stod(this->value);
+            }
         } else {
-            size_t significantDigits = this->value.size() - decimalPos - 1;
+            this->precision = this->value.size() - decimalPos - 1;
+            this->number = stod(this->value);
+        }
+        this->doubleValue = std::visit(
+            [](auto number) { return static_cast<double>(number); }, this->number);
+    }
+
+    NumberLiteral::NumberLiteral(const NumberLiteral &other)
+        : value(other.value), number(other.number), doubleValue(other.doubleValue),
+          precision(other.precision),
+          renderings(copyRenderings(other.renderings.load(std::memory_order_acquire))) {}
+
+    NumberLiteral::NumberLiteral(NumberLiteral &&other) noexcept
+        : value(std::move(other.value)), number(other.number),
+          doubleValue(other.doubleValue), precision(other.precision),
+          renderings(other.renderings.exchange(nullptr, std::memory_order_acq_rel)) {}
+
+    NumberLiteral &NumberLiteral::operator=(const NumberLiteral &other) {
+        if (this != &other) {
+            this->value = other.value;
+            this->number = other.number;
+            this->doubleValue = other.doubleValue;
+            this->precision = other.precision;
+            freeRenderings(this->renderings.exchange(
+                copyRenderings(other.renderings.load(std::memory_order_acquire)),
+                std::memory_order_acq_rel));
+        }
+        return *this;
+    }
+
+    NumberLiteral &NumberLiteral::operator=(NumberLiteral &&other) noexcept {
+        if (this != &other) {
+            this->value = std::move(other.value);
+            this->number = other.number;
+            this->doubleValue = other.doubleValue;
+            this->precision = other.precision;
+            freeRenderings(this->renderings.exchange(
+                other.renderings.exchange(nullptr, std::memory_order_acq_rel),
+                std::memory_order_acq_rel));
+        }
+        return *this;
+    }
+
+    NumberLiteral::~NumberLiteral() {
+        freeRenderings(this->renderings.load(std::memory_order_acquire));
+    }
+
+    const NumberLiteral::Rendering *
+    NumberLiteral::copyRenderings(const Rendering *rendering) {
+        if (!rendering)
+            return nullptr;
+        return new Rendering{rendering->context, rendering->text,
+                             copyRenderings(rendering->next)};
+    }
+
+    void NumberLiteral::freeRenderings(const Rendering *rendering) {
+        while (rendering) {
+            const Rendering *next = rendering->next;
+            delete rendering;
+            rendering = next;
+        }
+    }
 
-            return formatter
-                .precision(icu::number::Precision::minFraction(significantDigits))
-                .formatDouble(stod(this->value), status)
-                .toString(status)
-                .toUTF8String(buffer);
+    const NumberLiteral::Rendering *
+    NumberLiteral::render(const FormatContext &context) const {
+        const Rendering *head = this->renderings.load(std::memory_order_acquire);
+        for (const Rendering *rendering = head; rendering; rendering = rendering->next) {
+            if (rendering->context == context.getSerial())
+                return rendering;
         }
 
-        if (status.isSuccess()) {
-            return result;
+        std::string text;
+        StringSink sink(text);
+        bool formatted;
+        if (const long *integer = std::get_if<long>(&this->number))
+            formatted = context.formatNumber(sink, *integer);
+        else
+            formatted = context.formatNumber(sink, std::get<double>(this->number),
+                                             this->precision);
+        if (!formatted)
+            return nullptr;
+
+        Rendering *added = new Rendering{context.getSerial(), std::move(text), head};
+        while (!this->renderings.compare_exchange_weak(added->next, added,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_acquire)) {
+            // Another thread added a rendering first, possibly for the same locale
+            for (const Rendering *rendering = added->next; rendering != head;
+                 rendering = rendering->next) {
+                if (rendering->context == context.getSerial()) {
+                    delete added;
+                    return rendering;
+                }
+            }
+            head = added->next;
+        }
+        return added;
+    }
+
+    void NumberLiteral::localize(const FormatContext &context) const {
+        this->render(context);
+    }
+
+    const std::string NumberLiteral::format(const FormatContext& context) const {
+        std::string buffer;
+        StringSink sink(buffer);
+        this->format(sink, context);
+        return buffer;
+    }
+
+    void NumberLiteral::format(OutputSink &out, const FormatContext& context) const {
+        if (const Rendering *rendering = this->render(context)) {
+            out.append(rendering->text);
         } else {
             std::cerr 
                 << "Formatting number literal \"" << this->value
-                << "\"failed: " << status.errorName() << std::endl;
+                << "\" failed" << std::endl;
             // Fall back to the original literal value if formatting fails
-            return this->value;
+            out.append(this->value);
         }
     }
 
-    const std::string formatVariable(const icu::Locale& locid, const Variable &variable) {
-        std::string buffer;
-        return std::visit(
+    void formatVariable(OutputSink &out, const FormatContext& context, const VariableView &variable) {
+        std::visit(
             [&](const auto &arg) {
                 using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, std::string>) {
-                    return arg;
+                if constexpr (std::is_same_v<T, std::string_view>) {
+                    out.append(arg);
                 } 
-                else if constexpr (std::is_same_v<T, long>) {
-                    icu::ErrorCode status;
-                    std::string result = icu::number::NumberFormatter::withLocale(locid)
-                                            .formatInt(arg, status)
-                                            .toString(status)
-                                            .toUTF8String(buffer);
-                    if (status.isSuccess()) {
-                        return result;
-                    } else {
+                else {
+                    if (!context.formatNumber(out, arg)) {
                         std::cerr << "Formatting number \"" << arg
-                                << "\"failed: " << status.errorName() << std::endl;
-                        return std::to_string(arg);
-                    }
-                } 
-                else if constexpr (std::is_same_v<T, double>) {
-                    icu::ErrorCode status;
-                    std::string result = icu::number::NumberFormatter::withLocale(locid)
-                                            .formatDouble(arg, status)
-                                            .toString(status)
-                                            .toUTF8String(buffer);
-                    if (status.isSuccess()) {
-                        return result;
-                    } else {
-                        std::cerr << "Formatting number \"" << arg
-                                << "\"failed: " << status.errorName() << std::endl;
-                        return std::to_string(arg);
+                                << "\" failed" << std::endl;
+                        out.append(std::to_string(arg));
                     }
                 }
             },
@@ -294,9 +472,9 @@ namespace fluent::ast {
         );
     }
 
-    const std::vector<PatternElement>& SelectExpression::find(const icu::Locale& locid, const std::string key) const 
+    const std::vector<PatternElement>& SelectExpression::find(const FormatContext& context, std::string_view key) const 
     {
-        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&key](auto elem) {
+        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&key](const auto &elem) {
             return std::visit(
                 [&](const auto &arg) {
                     using T = std::decay_t<decltype(arg)>;
@@ -315,17 +493,16 @@ namespace fluent::ast {
         return this->variants[this->defaultVariant].second;
     }
 
-    const std::vector<PatternElement>& SelectExpression::find(const icu::Locale& locid, const double key) const 
+    const std::vector<PatternElement>& SelectExpression::find(const FormatContext& context, const double key) const 
     {
-        icu::ErrorCode status;
-        icu::PluralRules *pluralRules = icu::PluralRules::forLocale(locid, status);
-        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&](auto elem) {
+        const std::string_view category =
+            getPluralCategoryName(context.selectPluralCategory(key));
+        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&](const auto &elem) {
             return std::visit(
                 [&](const auto &arg) {
                     using T = std::decay_t<decltype(arg)>;
                     if constexpr (std::is_same_v<T, std::string>) {
-                        std::string buffer;
-                        return pluralRules->select(key).toUTF8String(buffer) == arg;
+                        return category == arg;
                     } else if constexpr (std::is_same_v<T, ast::NumberLiteral>) {
                         return arg == key;
                     } else {
@@ -341,18 +518,16 @@ namespace fluent::ast {
         return this->variants[this->defaultVariant].second;
     }
 
-    const std::vector<PatternElement>& SelectExpression::find(const icu::Locale& locid, const long key) const 
+    const std::vector<PatternElement>& SelectExpression::find(const FormatContext& context, const long key) const 
     {
-        icu::ErrorCode status;
-        icu::PluralRules *pluralRules = icu::PluralRules::forLocale(locid, status);
-        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&](auto elem) {
+        const std::string_view category =
+            getPluralCategoryName(context.selectPluralCategory(key));
+        auto it = std::find_if(this->variants.begin(), this->variants.end(), [&](const auto &elem) {
             return std::visit(
                 [&](const auto &arg) {
                     using T = std::decay_t<decltype(arg)>;
                     if constexpr (std::is_same_v<T, std::string>) {
-                        std::string buffer;
-                        return pluralRules->select(static_cast<int32_t>(key))
-                                .toUTF8String(buffer) == arg;
+                        return category == arg;
                     } else if constexpr (std::is_same_v<T, ast::NumberLiteral>) {
                         return arg == key;
                     } else {
@@ -368,113 +543,227 @@ namespace fluent::ast {
         return this->variants[this->defaultVariant].second;
     }
 
-    const std::vector<PatternElement> getSelectExpressionPattern(
-        const icu::Locale& locid, 
+    /// Finds the variant of a select expression to format. If termScope is true, a
+    /// selector naming an argument which was not passed picks the default variant.
+    const std::vector<PatternElement> &getSelectExpressionPattern(
+        const FormatContext& context, 
         const SelectExpression& expr,
-        const std::map<std::string, Variable>& args
+        const FluentArgs& args,
+        bool termScope
     ) {
+        static const std::vector<PatternElement> invalidSelector;
         return std::visit(
-            [&](const auto &arg) {
+            [&](const auto &arg) -> const std::vector<PatternElement> & {
                 using T = std::decay_t<decltype(arg)>;
                 if constexpr (std::is_same_v<T, ast::StringLiteral>) {
-                    return expr.find(locid, arg.value);
+                    return expr.find(context, arg.value);
                 } else if constexpr (std::is_same_v<T, ast::NumberLiteral>) {
                     return std::visit(
-                        [&](const auto &value) { return expr.find(locid, value); },
+                        [&](const auto &value) -> const std::vector<PatternElement> & {
+                            return expr.find(context, value);
+                        },
                         arg.getValue());
                 } else if constexpr (std::is_same_v<T, ast::VariableReference>) {
+                    const VariableView *selector = args.find(arg.identifier);
+                    if (!selector && termScope)
+                        return expr.variants[expr.defaultVariant].second;
                     return std::visit(
-                        [&](const auto &value) { return expr.find(locid, value); },
-                        args.at(arg.identifier));
+                        [&](const auto &value) -> const std::vector<PatternElement> & {
+                            return expr.find(context, value);
+                        },
+                        selector ? *selector : args.at(arg.identifier));
                 } else { // else invalid selector.
-                    return std::vector<PatternElement>();
+                    return invalidSelector;
                 }
             },
             expr.selector[0]);
     }
 
-    const std::string formatPattern(
-        const icu::Locale& locid, 
+    static void appendUnknown(OutputSink &out, const char *kind, const char *prefix,
+                              const MessageReference &ref) {
+        // FIXME: This could probably be handled better
+        out.append(kind);
+        out.append(" { ");
+        out.append(prefix);
+        out.append(ref.identifier);
+        out.append(" }");
+    }
+
+    void appendUnknownVariable(OutputSink &out, std::string_view identifier) {
+        out.append("unknown variable { $");
+        out.append(identifier);
+        out.append(" }");
+    }
+
+    /// A pattern being formatted, and the next element of it to format
+    struct PatternFrame {
+        const std::vector<PatternElement> *pattern = nullptr;
+        size_t next = 0;
+        const FluentArgs *args = nullptr;
+        /// The number of references followed to reach the pattern
+        size_t depth = 0;
+        /// Whether the pattern belongs to a term, or something a term references. Terms
+        /// need not be passed every argument they use.
+        bool termScope = false;
+    };
+
+    static void formatPattern(
+        OutputSink& output,
+        const FormatContext& context, 
         const std::vector<ast::PatternElement>& pattern,
-        const std::map<std::string, Variable>& args,
-        const std::function<std::optional<Message>(const std::string &)> messageLookup,
-        const std::function<std::optional<Term>(const std::string &)> termLookup
+        const FluentArgs& args,
+        const MessageLookup& messageLookup,
+        const TermLookup& termLookup,
+        const FormatLimits& limits
     ) {
-        std::stringstream values;
-
-        for (const PatternElement &elem : pattern) {
+        FormatBudget out(output, limits);
+        FrameStack<PatternFrame> stack;
+        stack.push(PatternFrame{&pattern, 0, &args, 0, false});
+
+        // Starts formatting the pattern of a message or term, unless doing so would
+        // recurse or nest too deeply
+        auto enter = [&](const std::vector<PatternElement> &referenced,
+                         const FluentArgs &referencedArgs, size_t depth, bool termScope,
+                         const char *prefix, const MessageReference &ref) {
+            for (size_t i = 0; i < stack.size(); i++) {
+                if (stack[i].pattern == &referenced) {
+                    appendUnknown(out, "cyclic reference", prefix, ref);
+                    return;
+                }
+            }
+            if (depth > limits.maxDepth) {
+                appendUnknown(out, "reference too deep", prefix, ref);
+                return;
+            }
+            stack.push(PatternFrame{&referenced, 0, &referencedArgs, depth, termScope});
+        };
+
+        while (!stack.empty() && !out.isExhausted()) {
+            PatternFrame &frame = stack.top();
+            if (frame.next == frame.pattern->size()) {
+                stack.pop();
+                continue;
+            }
+            // frame is invalidated when a pattern is pushed
+            const PatternElement &elem = (*frame.pattern)[frame.next++];
+            const FluentArgs &args = *frame.args;
+            size_t depth = frame.depth;
+            bool termScope = frame.termScope;
             std::visit(
                 [&](const auto &arg) {
                     using T = std::decay_t<decltype(arg)>;
                     if constexpr (std::is_same_v<T, std::string>)
-                        values << arg;
+                        out.append(arg);
                     else if constexpr (std::is_same_v<T, StringLiteral>)
-                        values << arg.value;
+                        out.append(arg.value);
                     else if constexpr (std::is_same_v<T, NumberLiteral>) {
-                        values << arg.format(locid);
+                        arg.format(out, context);
                     } else if constexpr (std::is_same_v<T, MessageReference>) {
-                        auto message = messageLookup(arg.identifier);
+                        if (!out.expand())
+                            return;
+                        const Message *message = messageLookup(arg.identifier);
                         if (message) {
                             if (arg.attribute) {
-                                std::optional<Attribute> attribute =
+                                const Attribute *attribute =
                                     message->getAttribute(*arg.attribute);
-                                values << attribute->format(locid, args, messageLookup,
-                                                            termLookup);
+                                if (attribute) {
+                                    enter(attribute->getPattern(), args, depth + 1, termScope, "",
+                                          arg);
+                                } else {
+                                    appendUnknown(out, "unknown attribute", "", arg);
+                                }
                             } else {
-                                values << message->format(locid, args, messageLookup,
-                                                        termLookup);
+                                enter(message->getPattern(), args, depth + 1, termScope, "", arg);
                             }
                         } else {
-                            // FIXME: This could probably be handled better
-                            values << "unknown message " << arg;
+                            appendUnknown(out, "unknown message", "", arg);
                         }
                     } else if constexpr (std::is_same_v<T, TermReference>) {
-                        // FIXME: TermReferences can also have arguments
-                        auto term = termLookup(arg.identifier);
+                        if (!out.expand())
+                            return;
+                        const Term *term = termLookup(arg.identifier);
                         if (term) {
                             if (arg.attribute) {
-                                std::optional<Attribute> attribute =
+                                const Attribute *attribute =
                                     term->getAttribute(*arg.attribute);
-                                values << attribute->format(locid, {}, messageLookup,
-                                                            termLookup);
+                                if (attribute) {
+                                    enter(attribute->getPattern(), arg.getArgs(), depth + 1,
+                                          true, "-", arg);
+                                } else {
+                                    appendUnknown(out, "unknown attribute", "-", arg);
+                                }
                             } else {
-                                values
-                                    << term->format(locid, {}, messageLookup, termLookup);
+                                enter(term->getPattern(), arg.getArgs(), depth + 1, true, "-", arg);
                             }
                         } else {
-                            // FIXME: This could probably be handled better
-                            values << "unknown message " << arg;
+                            appendUnknown(out, "unknown message", "-", arg);
                         }
                     } else if constexpr (std::is_same_v<T, SelectExpression>) {
-                        values << formatPattern(
-                            locid, getSelectExpressionPattern(locid, arg, args), args,
-                            messageLookup, termLookup);
-                    } else if constexpr (std::is_same_v<T, VariableReference>)
-                        values << formatVariable(locid, args.at(arg.identifier));
-                    else
+                        // Variants are part of the pattern, so don't count towards the
+                        // reference depth
+                        stack.push(PatternFrame{
+                            &getSelectExpressionPattern(context, arg, args, termScope), 0,
+                            &args, depth, termScope});
+                    } else if constexpr (std::is_same_v<T, VariableReference>) {
+                        if (!out.expand())
+                            return;
+                        const VariableView *variable = args.find(arg.identifier);
+                        if (variable || !termScope)
+                            formatVariable(out, context,
+                                           variable ? *variable : args.at(arg.identifier));
+                        else
+                            appendUnknownVariable(out, arg.identifier);
+                    } else
                         static_assert(always_false_v<T>, "non-exhaustive visitor!");
                 },
                 elem);
         }
-        return values.str();
     }
 
     const std::string Attribute::format(
-        const icu::Locale& locid,
+        const FormatContext& context,
         const std::map<std::string, Variable>& args,
-        const std::function<std::optional<Message>(const std::string &)> messageLookup,
-        const std::function<std::optional<Term>(const std::string &)> termLookup
+        const MessageLookup& messageLookup,
+        const TermLookup& termLookup
     ) const {
-        return formatPattern(locid, this->pattern, args, messageLookup, termLookup);
+        std::string result;
+        StringSink sink(result);
+        this->format(sink, context, FluentArgs(args), messageLookup, termLookup);
+        return result;
+    }
+
+    void Attribute::format(
+        OutputSink& out,
+        const FormatContext& context,
+        const FluentArgs& args,
+        const MessageLookup& messageLookup,
+        const TermLookup& termLookup,
+        const FormatLimits& limits
+    ) const {
+        formatPattern(out, context, this->pattern, args, messageLookup, termLookup, limits);
     }
 
     const std::string Message::format(
-        const icu::Locale& locid,
+        const FormatContext& context,
         const std::map<std::string, Variable>& args,
-        const std::function<std::optional<Message>(const std::string &)> messageLookup,
-        const std::function<std::optional<Term>(const std::string &)> termLookup
+        const MessageLookup& messageLookup,
+        const TermLookup& termLookup
+    ) const {
+        std::string result;
+        StringSink sink(result);
+        this->format(sink, context, FluentArgs(args), messageLookup, termLookup);
+        return result;
+    }
+
+    void Message::format(
+        OutputSink& out,
+        const FormatContext& context,
+        const FluentArgs& args,
+        const MessageLookup& messageLookup,
+        const TermLookup& termLookup,
+        const FormatLimits& limits
     ) const {
-        return formatPattern(locid, this->pattern, args, messageLookup, termLookup);
+        formatPattern(out, context, this->pattern, args, messageLookup, termLookup, limits);
     }
 
 #ifdef TEST
@@ -498,9 +787,45 @@ namespace fluent::ast {
         return root;
     }
 
+    static pt::ptree getLiteralPropertyTree(const CallArguments::Literal &literal) {
+        pt::ptree expression;
+        std::visit(
+            [&](const auto &arg) {
+                using T = std::decay_t<decltype(arg)>;
+                expression.put("value", arg.value);
+                expression.put("type", std::is_same_v<T, StringLiteral> ? "StringLiteral"
+                                                                        : "NumberLiteral");
+            },
+            literal);
+        return expression;
+    }
+
+    boost::property_tree::ptree CallArguments::getPropertyTree() const {
+        pt::ptree root, positional, named;
+        root.put("type", "CallArguments");
+        for (const Literal &literal : this->positional)
+            positional.push_back(std::make_pair("", getLiteralPropertyTree(literal)));
+        for (const auto &[name, value] : this->named) {
+            pt::ptree argument, id;
+            argument.put("type", "NamedArgument");
+            id.put("type", "Identifier");
+            id.put("name", name);
+            argument.add_child("name", id);
+            argument.add_child("value", getLiteralPropertyTree(value));
+            named.push_back(std::make_pair("", argument));
+        }
+        root.add_child("positional", positional);
+        root.add_child("named", named);
+        return root;
+    }
+
     boost::property_tree::ptree TermReference::getPropertyTree() const {
         pt::ptree root = MessageReference::getPropertyTree();
-        root.put("arguments", "null");
+        pt::ptree &expression = root.get_child("expression");
+        if (this->arguments)
+            expression.add_child("arguments", this->arguments->getPropertyTree());
+        else
+            expression.put("arguments", "null");
         return root;
     }
 
@@ -592,8 +917,8 @@ namespace fluent::ast {
             message.put("attributes", "");
         } else {
             pt::ptree attributes;
-            for (auto attribute : this->attributes) {
-                attributes.push_back(std::make_pair("", attribute.second.getPropertyTree()));
+            for (const Attribute &attribute : this->attributes) {
+                attributes.push_back(std::make_pair("", attribute.getPropertyTree()));
             }
             message.add_child("attributes", attributes);
         }
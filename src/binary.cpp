@@ -0,0 +1,426 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/binary.hpp"
+#include "fluent/symbols.hpp"
+
+#include <stdexcept>
+
+namespace fluent {
+    template <class> inline constexpr bool always_false_v = false;
+
+    /*
+     * Layout of an image. All integers are unsigned 32-bit little-endian unless noted.
+     *
+     *   "FTLB" version
+     *   stringCount (length bytes){stringCount}
+     *   entryCount entry{entryCount}
+     *
+     *   entry     ::= kind:u8 id:string pattern attributeCount (id:string pattern){attributeCount}
+     *   pattern   ::= elementCount element{elementCount}
+     *   element   ::= kind:u8 payload
+     *   payload   ::= string                                  (Text, literals, variables)
+     *               | id:string attribute:string?             (message references)
+     *               | id:string attribute:string? arguments   (term references)
+     *               | element variantCount default variant{variantCount}  (select)
+     *   variant   ::= keyKind:u8 key:string pattern
+     *   arguments ::= NONE | argumentCount (name:string? literal){argumentCount}
+     *   literal   ::= kind:u8 value:string                    (string and number literals)
+     *
+     * Strings are indices into the string table, and optional strings use NONE when
+     * they are absent.
+     */
+    static constexpr char MAGIC[4] = {'F', 'T', 'L', 'B'};
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    enum class EntryKind : uint8_t { Message, Term };
+    enum class ElementKind : uint8_t {
+        Text,
+        StringLiteral,
+        NumberLiteral,
+        VariableReference,
+        MessageReference,
+        TermReference,
+        SelectExpression
+    };
+    enum class KeyKind : uint8_t { Identifier, Number };
+
+    typedef SymbolId<struct StringTag> StringId;
+
+    class ResourceWriter {
+    private:
+        SymbolTable<StringId> strings;
+        std::string body;
+        uint32_t entryCount = 0;
+
+        static void writeU32(std::string &out, uint32_t value) {
+            for (int shift = 0; shift < 32; shift += 8)
+                out.push_back(static_cast<char>((value >> shift) & 0xff));
+        }
+
+        void writeU8(uint8_t value) { this->body.push_back(static_cast<char>(value)); }
+        void writeU32(uint32_t value) { writeU32(this->body, value); }
+        void writeString(std::string_view value) {
+            this->writeU32(this->strings.intern(value).index);
+        }
+        void writeOptionalString(const std::optional<std::string> &value) {
+            if (value)
+                this->writeString(*value);
+            else
+                this->writeU32(NONE);
+        }
+
+        void writePattern(const std::vector<ast::PatternElement> &pattern) {
+            this->writeU32(static_cast<uint32_t>(pattern.size()));
+            for (const ast::PatternElement &element : pattern)
+                this->writeElement(element);
+        }
+
+        void writeLiteral(const ast::CallArguments::Literal &literal) {
+            std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    this->writeU8(static_cast<uint8_t>(std::is_same_v<T, ast::StringLiteral>
+                                                           ? ElementKind::StringLiteral
+                                                           : ElementKind::NumberLiteral));
+                    this->writeString(arg.value);
+                },
+                literal);
+        }
+
+        /// Positional arguments are written first, without a name
+        void writeArguments(const ast::CallArguments *arguments) {
+            if (!arguments) {
+                this->writeU32(NONE);
+                return;
+            }
+            this->writeU32(static_cast<uint32_t>(arguments->getPositional().size() +
+                                                 arguments->getNamed().size()));
+            for (const ast::CallArguments::Literal &literal : arguments->getPositional()) {
+                this->writeU32(NONE);
+                this->writeLiteral(literal);
+            }
+            for (const auto &[name, value] : arguments->getNamed()) {
+                this->writeString(name);
+                this->writeLiteral(value);
+            }
+        }
+
+        void writeElement(const ast::PatternElement &element) {
+            std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, std::string>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::Text));
+                        this->writeString(arg);
+                    } else if constexpr (std::is_same_v<T, ast::StringLiteral>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::StringLiteral));
+                        this->writeString(arg.value);
+                    } else if constexpr (std::is_same_v<T, ast::NumberLiteral>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::NumberLiteral));
+                        this->writeString(arg.value);
+                    } else if constexpr (std::is_same_v<T, ast::VariableReference>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::VariableReference));
+                        this->writeString(arg.identifier);
+                    } else if constexpr (std::is_same_v<T, ast::TermReference>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::TermReference));
+                        this->writeString(arg.identifier);
+                        this->writeOptionalString(arg.attribute);
+                        this->writeArguments(arg.arguments.get());
+                    } else if constexpr (std::is_same_v<T, ast::MessageReference>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::MessageReference));
+                        this->writeString(arg.identifier);
+                        this->writeOptionalString(arg.attribute);
+                    } else if constexpr (std::is_same_v<T, ast::SelectExpression>) {
+                        this->writeU8(static_cast<uint8_t>(ElementKind::SelectExpression));
+                        this->writeElement(arg.selector.front());
+                        this->writeU32(static_cast<uint32_t>(arg.variants.size()));
+                        this->writeU32(static_cast<uint32_t>(arg.defaultVariant));
+                        for (const auto &[key, pattern] : arg.variants) {
+                            if (const std::string *identifier = std::get_if<std::string>(&key)) {
+                                this->writeU8(static_cast<uint8_t>(KeyKind::Identifier));
+                                this->writeString(*identifier);
+                            } else {
+                                this->writeU8(static_cast<uint8_t>(KeyKind::Number));
+                                this->writeString(std::get<ast::NumberLiteral>(key).value);
+                            }
+                            this->writePattern(pattern);
+                        }
+                    } else {
+                        static_assert(always_false_v<T>, "non-exhaustive visitor!");
+                    }
+                },
+                element);
+        }
+
+    public:
+        void writeMessage(EntryKind kind, const ast::Message &message) {
+            this->entryCount++;
+            this->writeU8(static_cast<uint8_t>(kind));
+            this->writeString(message.getId());
+            this->writePattern(message.getPattern());
+
+            // Attributes are kept sorted, so the same resource always produces the
+            // same image
+            this->writeU32(static_cast<uint32_t>(message.getAttributes().size()));
+            for (const ast::Attribute &attribute : message.getAttributes()) {
+                this->writeString(attribute.getId());
+                this->writePattern(attribute.getPattern());
+            }
+        }
+
+        std::string finish() const {
+            std::string image(MAGIC, sizeof(MAGIC));
+            writeU32(image, BINARY_RESOURCE_VERSION);
+            writeU32(image, static_cast<uint32_t>(this->strings.size()));
+            for (uint32_t index = 0; index < this->strings.size(); index++) {
+                const std::string &value = this->strings.getName(StringId(index));
+                writeU32(image, static_cast<uint32_t>(value.size()));
+                image += value;
+            }
+            writeU32(image, this->entryCount);
+            image += this->body;
+            return image;
+        }
+    };
+
+    class ResourceReader {
+    private:
+        std::string_view image;
+        size_t offset = 0;
+        std::vector<std::string_view> strings;
+
+        [[noreturn]] static void fail(const char *reason) {
+            throw std::runtime_error(std::string("Invalid binary resource: ") + reason);
+        }
+
+        std::string_view readBytes(size_t count) {
+            if (count > this->image.size() - this->offset)
+                fail("unexpected end of data");
+            std::string_view bytes = this->image.substr(this->offset, count);
+            this->offset += count;
+            return bytes;
+        }
+
+        uint8_t readU8() { return static_cast<uint8_t>(this->readBytes(1)[0]); }
+
+        uint32_t readU32() {
+            std::string_view bytes = this->readBytes(4);
+            uint32_t value = 0;
+            for (int i = 3; i >= 0; i--)
+                value = (value << 8) | static_cast<uint8_t>(bytes[i]);
+            return value;
+        }
+
+        /// Reads a count of items which each take at least one byte, so that a corrupt
+        /// count cannot cause a huge allocation
+        uint32_t readCount() {
+            uint32_t count = this->readU32();
+            if (count > this->image.size() - this->offset)
+                fail("count exceeds size of data");
+            return count;
+        }
+
+        std::string readString() {
+            uint32_t index = this->readU32();
+            if (index >= this->strings.size())
+                fail("string index out of range");
+            return std::string(this->strings[index]);
+        }
+
+        std::optional<std::string> readOptionalString() {
+            uint32_t index = this->readU32();
+            if (index == NONE)
+                return std::optional<std::string>();
+            if (index >= this->strings.size())
+                fail("string index out of range");
+            return std::string(this->strings[index]);
+        }
+
+        std::vector<ast::PatternElement> readPattern() {
+            uint32_t count = this->readCount();
+            std::vector<ast::PatternElement> pattern;
+            pattern.reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+                pattern.push_back(this->readElement());
+            return pattern;
+        }
+
+        ast::CallArguments::Literal readLiteral() {
+            ElementKind kind = static_cast<ElementKind>(this->readU8());
+            if (kind == ElementKind::StringLiteral)
+                return ast::StringLiteral(this->readString());
+            if (kind != ElementKind::NumberLiteral)
+                fail("unknown argument kind");
+            return ast::NumberLiteral(this->readString());
+        }
+
+        std::optional<std::vector<ast::CallArguments::Argument>> readArguments() {
+            uint32_t count = this->readU32();
+            if (count == NONE)
+                return std::nullopt;
+            if (count > this->image.size() - this->offset)
+                fail("count exceeds size of data");
+            std::vector<ast::CallArguments::Argument> arguments;
+            arguments.reserve(count);
+            for (uint32_t i = 0; i < count; i++) {
+                std::optional<std::string> name = this->readOptionalString();
+                ast::CallArguments::Literal value = this->readLiteral();
+                if (name)
+                    arguments.emplace_back(
+                        ast::CallArguments::NamedArgument(std::move(*name), std::move(value)));
+                else
+                    arguments.emplace_back(std::move(value));
+            }
+            return arguments;
+        }
+
+        ast::PatternElement readElement() {
+            switch (static_cast<ElementKind>(this->readU8())) {
+            case ElementKind::Text:
+                return ast::PatternElement(this->readString());
+            case ElementKind::StringLiteral:
+                return ast::PatternElement(ast::StringLiteral(this->readString()));
+            case ElementKind::NumberLiteral:
+                return ast::PatternElement(ast::NumberLiteral(this->readString()));
+            case ElementKind::VariableReference:
+                return ast::PatternElement(ast::VariableReference(this->readString()));
+            case ElementKind::MessageReference: {
+                std::string identifier = this->readString();
+                return ast::PatternElement(
+                    ast::MessageReference(std::move(identifier), this->readOptionalString()));
+            }
+            case ElementKind::TermReference: {
+                std::string identifier = this->readString();
+                std::optional<std::string> attribute = this->readOptionalString();
+                return ast::PatternElement(ast::TermReference(
+                    std::move(identifier), std::move(attribute), this->readArguments()));
+            }
+            case ElementKind::SelectExpression: {
+                ast::PatternElement selector = this->readElement();
+                uint32_t count = this->readCount();
+                uint32_t defaultVariant = this->readU32();
+                if (defaultVariant >= count)
+                    fail("default variant out of range");
+                std::vector<ast::SelectExpression::VariantType> first, last;
+                std::optional<ast::SelectExpression::VariantType> fallback;
+                for (uint32_t i = 0; i < count; i++) {
+                    KeyKind keyKind = static_cast<KeyKind>(this->readU8());
+                    std::string key = this->readString();
+                    ast::VariantKey variantKey;
+                    if (keyKind == KeyKind::Identifier)
+                        variantKey = std::move(key);
+                    else if (keyKind == KeyKind::Number)
+                        variantKey = ast::NumberLiteral(std::move(key));
+                    else
+                        fail("unknown variant key kind");
+                    ast::SelectExpression::VariantType variant(std::move(variantKey),
+                                                               this->readPattern());
+                    if (i < defaultVariant)
+                        first.push_back(std::move(variant));
+                    else if (i == defaultVariant)
+                        fallback = std::move(variant);
+                    else
+                        last.push_back(std::move(variant));
+                }
+                return ast::PatternElement(ast::SelectExpression(
+                    std::move(selector), std::move(first), std::move(*fallback),
+                    std::move(last)));
+            }
+            }
+            fail("unknown pattern element kind");
+        }
+
+    public:
+        explicit ResourceReader(std::string_view image) : image(image) {}
+
+        std::vector<ast::Entry> read() {
+            if (this->readBytes(sizeof(MAGIC)) != std::string_view(MAGIC, sizeof(MAGIC)))
+                fail("not a fluent binary resource");
+            if (this->readU32() != BINARY_RESOURCE_VERSION)
+                fail("unsupported version");
+
+            uint32_t stringCount = this->readCount();
+            this->strings.reserve(stringCount);
+            for (uint32_t i = 0; i < stringCount; i++)
+                this->strings.push_back(this->readBytes(this->readU32()));
+
+            uint32_t entryCount = this->readCount();
+            std::vector<ast::Entry> entries;
+            entries.reserve(entryCount);
+            for (uint32_t i = 0; i < entryCount; i++) {
+                EntryKind kind = static_cast<EntryKind>(this->readU8());
+                std::string id = this->readString();
+                std::vector<ast::PatternElement> pattern = this->readPattern();
+                uint32_t attributeCount = this->readCount();
+                std::vector<ast::Attribute> attributes;
+                attributes.reserve(attributeCount);
+                for (uint32_t j = 0; j < attributeCount; j++) {
+                    std::string attributeId = this->readString();
+                    attributes.emplace_back(ast::PreprocessedPattern(), std::move(attributeId),
+                                            this->readPattern());
+                }
+                // Patterns were processed when they were parsed
+                if (kind == EntryKind::Message)
+                    entries.emplace_back(ast::Message(ast::PreprocessedPattern(), std::move(id),
+                                                      std::move(pattern), std::move(attributes)));
+                else if (kind == EntryKind::Term)
+                    entries.emplace_back(ast::Term(ast::PreprocessedPattern(), std::move(id),
+                                                   std::move(pattern), std::move(attributes)));
+                else
+                    fail("unknown entry kind");
+            }
+            if (this->offset != this->image.size())
+                fail("trailing data");
+            return entries;
+        }
+    };
+
+    std::string serializeResource(const std::vector<ast::Entry> &entries) {
+        ResourceWriter writer;
+        for (const ast::Entry &entry : entries) {
+            std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, ast::Message>) {
+                        writer.writeMessage(EntryKind::Message, arg);
+                    } else if constexpr (std::is_same_v<T, ast::Term>) {
+                        writer.writeMessage(EntryKind::Term, arg);
+                    } else if constexpr (std::is_same_v<T, ast::AnyComment>) {
+                    } else if constexpr (std::is_same_v<T, ast::Junk>) {
+                    } else {
+                        static_assert(always_false_v<T>, "non-exhaustive visitor!");
+                    }
+                },
+                entry);
+        }
+        return writer.finish();
+    }
+
+    std::string serializeResource(const ast::Term &term) {
+        ResourceWriter writer;
+        writer.writeMessage(EntryKind::Term, term);
+        return writer.finish();
+    }
+
+    std::vector<ast::Entry> deserializeResource(std::string_view image) {
+        return ResourceReader(image).read();
+    }
+
+} // namespace fluent
@@ -18,33 +18,392 @@
  */
 
 #include "fluent/bundle.hpp"
+#include "fluent/binary.hpp"
+#include "fluent/parser.hpp"
 
 namespace fluent {
 
-    void FluentBundle::addMessage(ast::Message&& message) {
-        this->messages.insert(std::make_pair(message.getId(), message));
+    template <typename T>
+    const std::shared_ptr<const T>& LazyEntry<T>::get() const {
+        std::call_once(this->parsed, [this]() {
+            std::optional<ast::Entry> entry = parseEntry(this->source);
+            if (entry && std::holds_alternative<T>(*entry)) {
+                T &value = std::get<T>(*entry);
+                value.compact(this->keepComment);
+                this->value = std::make_shared<const T>(std::move(value));
+            }
+        });
+        return this->value;
     }
 
-    void FluentBundle::addTerm(ast::Term&& term) {
-        this->terms.insert(std::make_pair(term.getId(), term));
+    template class LazyEntry<ast::Message>;
+    template class LazyEntry<ast::Term>;
+
+    static void hashCombine(size_t& seed, size_t value) {
+        seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+
+    static void hashString(size_t& seed, std::string_view value) {
+        hashCombine(seed, std::hash<std::string_view>()(value));
+    }
+
+    static void hashLiteral(size_t& seed, const ast::CallArguments::Literal& literal) {
+        hashCombine(seed, literal.index());
+        std::visit([&](const auto& value) { hashString(seed, value.value); }, literal);
+    }
+
+    static void hashKey(size_t& seed, const ast::VariantKey& key) {
+        hashCombine(seed, key.index());
+        if (const std::string* identifier = std::get_if<std::string>(&key))
+            hashString(seed, *identifier);
+        else
+            hashString(seed, std::get<ast::NumberLiteral>(key).value);
+    }
+
+    static void hashArguments(size_t& seed, const ast::CallArguments& arguments) {
+        for (const auto& literal : arguments.getPositional())
+            hashLiteral(seed, literal);
+        for (const auto& [name, literal] : arguments.getNamed()) {
+            hashString(seed, name);
+            hashLiteral(seed, literal);
+        }
+    }
+
+    /// Hashes everything in a pattern which affects formatting. Equal patterns have
+    /// equal hashes; patterns with equal hashes are compared by their binary image.
+    static void hashPattern(size_t& seed,
+                            const std::vector<ast::PatternElement>& pattern) {
+        hashCombine(seed, pattern.size());
+        for (const ast::PatternElement& element : pattern) {
+            hashCombine(seed, element.index());
+            std::visit(
+                [&](const auto& arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, std::string>) {
+                        hashString(seed, arg);
+                    } else if constexpr (std::is_same_v<T, ast::StringLiteral> ||
+                                         std::is_same_v<T, ast::NumberLiteral>) {
+                        hashString(seed, arg.value);
+                    } else if constexpr (std::is_same_v<T, ast::VariableReference>) {
+                        hashString(seed, arg.identifier);
+                    } else if constexpr (std::is_same_v<T, ast::MessageReference> ||
+                                         std::is_same_v<T, ast::TermReference>) {
+                        hashString(seed, arg.identifier);
+                        hashString(seed, arg.attribute.value_or(""));
+                        if constexpr (std::is_same_v<T, ast::TermReference>) {
+                            if (arg.arguments)
+                                hashArguments(seed, *arg.arguments);
+                        }
+                    } else if constexpr (std::is_same_v<T, ast::SelectExpression>) {
+                        hashPattern(seed, arg.selector);
+                        hashCombine(seed, arg.defaultVariant);
+                        for (const auto& [key, variant] : arg.variants) {
+                            hashKey(seed, key);
+                            hashPattern(seed, variant);
+                        }
+                    }
+                },
+                element);
+        }
+    }
+
+    static size_t hashTerm(const ast::Term& term) {
+        size_t seed = 0;
+        hashString(seed, term.getId());
+        hashPattern(seed, term.getPattern());
+        for (const ast::Attribute& attribute : term.getAttributes()) {
+            hashString(seed, attribute.getId());
+            hashPattern(seed, attribute.getPattern());
+        }
+        hashString(seed, term.getComment() ? term.getComment()->getValue() : "");
+        return seed;
+    }
+
+    /// Whether two terms with the same hash are identical. The binary image covers
+    /// everything which affects formatting, but not comments.
+    static bool sameTerm(const ast::Term& a, const ast::Term& b,
+                         const std::string& imageOfB) {
+        std::string commentA = a.getComment() ? a.getComment()->getValue() : "";
+        std::string commentB = b.getComment() ? b.getComment()->getValue() : "";
+        return commentA == commentB && serializeResource(a) == imageOfB;
+    }
+
+    std::shared_ptr<const ast::Term> TermPool::intern(ast::Term&& term) {
+        size_t hash = hashTerm(term);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto [begin, end] = this->terms.equal_range(hash);
+        if (begin != end) {
+            std::string image = serializeResource(term);
+            for (auto iter = begin; iter != end; ++iter) {
+                std::shared_ptr<const ast::Term> existing = iter->second.lock();
+                if (existing && sameTerm(*existing, term, image)) {
+                    this->shared++;
+                    return existing;
+                }
+            }
+        }
+        auto result = std::make_shared<const ast::Term>(std::move(term));
+        this->terms.emplace(hash, result);
+
+        if (this->terms.size() >= this->pruneThreshold) {
+            for (auto iter = this->terms.begin(); iter != this->terms.end();) {
+                if (iter->second.expired())
+                    iter = this->terms.erase(iter);
+                else
+                    ++iter;
+            }
+            this->pruneThreshold = std::max<size_t>(64, this->terms.size() * 2);
+        }
+        return result;
+    }
+
+    size_t TermPool::getSharedCount() const {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->shared;
+    }
+
+    FluentBundle::FluentBundle(const icu::Locale& locale)
+        : context(std::make_shared<const FormatContext>(locale)) {}
+
+    template <typename T>
+    const FluentBundle::Entry<T>*
+    FluentBundle::EntryTable<T>::find(uint32_t index) const {
+        size_t chunk = index / CHUNK_SIZE;
+        if (chunk >= this->chunks.size() || !this->chunks[chunk])
+            return nullptr;
+        const Entry<T>& entry = this->chunks[chunk]->entries[index % CHUNK_SIZE];
+        return entry.value || entry.lazy || entry.compiled ? &entry : nullptr;
+    }
+
+    template <typename T>
+    FluentBundle::Entry<T>& FluentBundle::EntryTable<T>::modify(uint32_t index) {
+        size_t chunk = index / CHUNK_SIZE;
+        if (chunk >= this->chunks.size())
+            this->chunks.resize(chunk + 1);
+        std::shared_ptr<Chunk>& slot = this->chunks[chunk];
+        if (!slot)
+            slot = std::make_shared<Chunk>();
+        else if (slot->shared.load(std::memory_order_relaxed))
+            slot = std::make_shared<Chunk>(*slot);
+        return slot->entries[index % CHUNK_SIZE];
     }
 
-    std::optional<ast::Message> FluentBundle::getMessage(const std::string& identifier) const {
-        auto result = this->messages.find(identifier);
-        if (result != this->messages.end()) {
-            return std::optional(result->second);
-        } else {
-            return std::optional<ast::Message>();
+    template <typename T>
+    template <typename F>
+    void FluentBundle::EntryTable<T>::modifyAll(F f) {
+        for (size_t chunk = 0; chunk < this->chunks.size(); chunk++) {
+            if (!this->chunks[chunk])
+                continue;
+            for (size_t offset = 0; offset < CHUNK_SIZE; offset++) {
+                uint32_t index = static_cast<uint32_t>(chunk * CHUNK_SIZE + offset);
+                if (this->find(index))
+                    f(this->modify(index));
+            }
         }
     }
 
-    std::optional<ast::Term> FluentBundle::getTerm(const std::string& identifier) const {
-        auto result = this->terms.find(identifier);
-        if (result != this->terms.end()) {
-            return std::optional(result->second);
-        } else {
-            return std::optional<ast::Term>();
+    template <typename T>
+    FluentBundle::Entry<T>* FluentBundle::EntryTable<T>::reserve(uint32_t index) {
+        if (this->find(index))
+            return nullptr;
+        return &this->modify(index);
+    }
+
+    /// Compiles an entry, parsing it first if it is lazy. Lazy entries which turn out
+    /// not to be valid are left uncompiled.
+    template <typename T>
+    static void compileEntry(
+        FluentBundle::Entry<T>& entry, const FormatContext& context,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        const T* value = entry.get();
+        if (value) {
+            entry.compiled = std::make_shared<const CompiledMessage>(
+                CompiledMessage::compile(*value, context, messageIds, termIds));
         }
     }
 
+    /// Prepares a parsed entry for formatting: compiled bundles compile it, others
+    /// render its number literals, which the compiled form already contains as text
+    template <typename T>
+    static void prepareEntry(
+        FluentBundle::Entry<T>& entry, bool compiled, const FormatContext& context,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        if (compiled)
+            compileEntry(entry, context, messageIds, termIds);
+        else
+            entry.value->localize(context);
+    }
+
+    bool FluentBundle::addMessage(
+        MessageId id, ast::Message&& message,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        Entry<ast::Message>* entry = this->messages.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->value = std::make_shared<const ast::Message>(std::move(message));
+        prepareEntry(*entry, this->compiled, *this->context, messageIds, termIds);
+        return true;
+    }
+
+    bool FluentBundle::addTerm(
+        TermId id, ast::Term&& term,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        Entry<ast::Term>* entry = this->terms.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->value = std::make_shared<const ast::Term>(std::move(term));
+        prepareEntry(*entry, this->compiled, *this->context, messageIds, termIds);
+        return true;
+    }
+
+    bool FluentBundle::addTerm(
+        TermId id, std::shared_ptr<const ast::Term> term,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        Entry<ast::Term>* entry = this->terms.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->value = std::move(term);
+        prepareEntry(*entry, this->compiled, *this->context, messageIds, termIds);
+        return true;
+    }
+
+    bool FluentBundle::addLazyMessage(
+        MessageId id, std::shared_ptr<const LazyEntry<ast::Message>> message,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        Entry<ast::Message>* entry = this->messages.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->lazy = std::move(message);
+        if (this->compiled)
+            compileEntry(*entry, *this->context, messageIds, termIds);
+        return true;
+    }
+
+    bool FluentBundle::addLazyTerm(
+        TermId id, std::shared_ptr<const LazyEntry<ast::Term>> term,
+        SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds
+    ) {
+        Entry<ast::Term>* entry = this->terms.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->lazy = std::move(term);
+        if (this->compiled)
+            compileEntry(*entry, *this->context, messageIds, termIds);
+        return true;
+    }
+
+    bool FluentBundle::addCompiledMessage(
+        MessageId id, std::shared_ptr<const CompiledMessage> message
+    ) {
+        Entry<ast::Message>* entry = this->messages.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->compiled = std::move(message);
+        return true;
+    }
+
+    bool FluentBundle::addCompiledTerm(
+        TermId id, std::shared_ptr<const CompiledMessage> term
+    ) {
+        Entry<ast::Term>* entry = this->terms.reserve(id.index);
+        if (!entry)
+            return false;
+        entry->compiled = std::move(term);
+        return true;
+    }
+
+    FluentBundle::Symbols& FluentBundle::getOwnSymbols() {
+        if (!this->symbols)
+            this->symbols = std::make_shared<Symbols>();
+        else if (this->symbols.use_count() > 1)
+            this->symbols = std::make_shared<Symbols>(*this->symbols);
+        return *this->symbols;
+    }
+
+    bool FluentBundle::addMessage(ast::Message&& message) {
+        Symbols& symbols = this->getOwnSymbols();
+        MessageId id = symbols.messageIds.intern(message.getId());
+        return this->addMessage(id, std::move(message), symbols.messageIds, symbols.termIds);
+    }
+
+    bool FluentBundle::addTerm(ast::Term&& term) {
+        Symbols& symbols = this->getOwnSymbols();
+        TermId id = symbols.termIds.intern(term.getId());
+        return this->addTerm(id, std::move(term), symbols.messageIds, symbols.termIds);
+    }
+
+    void FluentBundle::removeMessage(MessageId id) {
+        if (this->messages.find(id.index))
+            this->messages.modify(id.index) = Entry<ast::Message>();
+    }
+
+    void FluentBundle::removeTerm(TermId id) {
+        if (this->terms.find(id.index))
+            this->terms.modify(id.index) = Entry<ast::Term>();
+    }
+
+    bool FluentBundle::hasMessage(MessageId id) const {
+        return this->messages.find(id.index) != nullptr;
+    }
+
+    bool FluentBundle::hasTerm(TermId id) const {
+        return this->terms.find(id.index) != nullptr;
+    }
+
+    const ast::Message* FluentBundle::getMessage(MessageId id) const {
+        const Entry<ast::Message>* entry = this->messages.find(id.index);
+        return entry ? entry->get() : nullptr;
+    }
+
+    const ast::Term* FluentBundle::getTerm(TermId id) const {
+        const Entry<ast::Term>* entry = this->terms.find(id.index);
+        return entry ? entry->get() : nullptr;
+    }
+
+    const ast::Message* FluentBundle::getMessage(std::string_view identifier) const {
+        std::optional<MessageId> id =
+            this->symbols ? this->symbols->messageIds.find(identifier) : std::nullopt;
+        return id ? this->getMessage(*id) : nullptr;
+    }
+
+    const ast::Term* FluentBundle::getTerm(std::string_view identifier) const {
+        std::optional<TermId> id =
+            this->symbols ? this->symbols->termIds.find(identifier) : std::nullopt;
+        return id ? this->getTerm(*id) : nullptr;
+    }
+
+    void FluentBundle::compile() {
+        Symbols& symbols = this->getOwnSymbols();
+        this->compile(symbols.messageIds, symbols.termIds);
+    }
+
+    void FluentBundle::compile(SymbolTable<MessageId>& messageIds, SymbolTable<TermId>& termIds) {
+        if (this->compiled)
+            return;
+        this->messages.modifyAll([&](Entry<ast::Message>& entry) {
+            compileEntry(entry, *this->context, messageIds, termIds);
+        });
+        this->terms.modifyAll([&](Entry<ast::Term>& entry) {
+            compileEntry(entry, *this->context, messageIds, termIds);
+        });
+        this->compiled = true;
+    }
+
+    const CompiledMessage* FluentBundle::getCompiledMessage(MessageId id) const {
+        const Entry<ast::Message>* entry = this->messages.find(id.index);
+        return entry ? entry->compiled.get() : nullptr;
+    }
+
+    const CompiledMessage* FluentBundle::getCompiledTerm(TermId id) const {
+        const Entry<ast::Term>* entry = this->terms.find(id.index);
+        return entry ? entry->compiled.get() : nullptr;
+    }
+
 } // namespace fluent
@@ -0,0 +1,1158 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/compiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace fluent {
+    template <class> inline constexpr bool always_false_v = false;
+
+    using OpCode = CompiledMessage::OpCode;
+    using Instruction = CompiledMessage::Instruction;
+
+    using StringRef = CompiledMessage::StringRef;
+    using NumberVariant = CompiledMessage::NumberVariant;
+    using StringVariant = CompiledMessage::StringVariant;
+    using SelectTable = CompiledMessage::SelectTable;
+    using AttributeEntry = CompiledMessage::AttributeEntry;
+
+    /// Hashes the key of a string variant. Unlike std::hash, the result is the same in
+    /// every process, as it is stored in compiled images.
+    static uint64_t hashKey(std::string_view key) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (char c : key) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    /// The arrays of a message compiled in memory
+    struct CompiledStorage {
+        std::vector<Instruction> code;
+        std::string text;
+        std::string strings;
+        std::vector<StringRef> names;
+        std::vector<CompiledMessage::Reference> references;
+        std::vector<SelectTable> selects;
+        std::vector<NumberVariant> numberVariants;
+        std::vector<StringVariant> stringVariants;
+        std::vector<ast::NumberLiteral> literals;
+        std::vector<std::shared_ptr<const ast::CallArguments>> arguments;
+        std::vector<AttributeEntry> attributes;
+    };
+
+    /**
+     * Builds the instruction stream of a single CompiledMessage
+     */
+    class Compiler {
+    private:
+        CompiledStorage &result;
+        const FormatContext &context;
+        SymbolTable<MessageId> &messageIds;
+        SymbolTable<TermId> &termIds;
+        std::unordered_map<std::string, uint32_t> nameIndices;
+        // Index of the last Text instruction if it may be extended by the next text span.
+        // Text cannot be merged across an instruction which is the target of a jump.
+        uint32_t lastText = CompiledMessage::NONE;
+
+        uint32_t position() const { return static_cast<uint32_t>(result.code.size()); }
+
+        uint32_t label() {
+            this->lastText = CompiledMessage::NONE;
+            return this->position();
+        }
+
+        void emit(OpCode op, uint32_t a = 0, uint32_t b = 0) {
+            this->lastText = CompiledMessage::NONE;
+            result.code.push_back(Instruction{op, a, b});
+        }
+
+        void emitText(const std::string &text) {
+            if (text.empty())
+                return;
+            uint32_t offset = static_cast<uint32_t>(result.text.size());
+            uint32_t length = static_cast<uint32_t>(text.size());
+            result.text += text;
+            if (this->lastText != CompiledMessage::NONE) {
+                result.code[this->lastText].b += length;
+            } else {
+                result.code.push_back(Instruction{OpCode::Text, offset, length});
+                this->lastText = this->position() - 1;
+            }
+        }
+
+        uint32_t literal(const ast::NumberLiteral &literal) {
+            uint32_t index = static_cast<uint32_t>(result.literals.size());
+            result.literals.push_back(literal);
+            // Most messages are formatted in the locale of their own bundle
+            result.literals.back().localize(this->context);
+            return index;
+        }
+
+        uint32_t reference(uint32_t id, const ast::MessageReference &ref,
+                           std::shared_ptr<const ast::CallArguments> arguments = nullptr) {
+            uint32_t argumentsIndex = CompiledMessage::NONE;
+            if (arguments) {
+                argumentsIndex = static_cast<uint32_t>(result.arguments.size());
+                result.arguments.push_back(std::move(arguments));
+            }
+            uint32_t index = static_cast<uint32_t>(result.references.size());
+            result.references.push_back(CompiledMessage::Reference{
+                id, this->name(ref.identifier),
+                ref.attribute ? this->name(*ref.attribute) : CompiledMessage::NONE,
+                argumentsIndex});
+            return index;
+        }
+
+        void compileSelect(const ast::SelectExpression &expr) {
+            std::visit(
+                [&](const auto &selector) {
+                    using T = std::decay_t<decltype(selector)>;
+                    if constexpr (std::is_same_v<T, ast::StringLiteral>) {
+                        // String literal selectors always pick the same variant
+                        this->compilePattern(expr.find(this->context, selector.value));
+                    } else if constexpr (std::is_same_v<T, ast::NumberLiteral>) {
+                        // The plural category of the literal depends on the locale
+                        this->compileSelectTable(expr, CompiledMessage::NONE,
+                                                 this->literal(selector));
+                    } else if constexpr (std::is_same_v<T, ast::VariableReference>) {
+                        this->compileSelectTable(expr, this->name(selector.identifier),
+                                                 CompiledMessage::NONE);
+                    }
+                    // Other selectors are invalid and produce no output
+                },
+                expr.selector[0]);
+        }
+
+        /// Compiles a select expression whose selector is either the variable
+        /// names[variable] or the number literal literals[literal]
+        void compileSelectTable(const ast::SelectExpression &expr, uint32_t variable,
+                                uint32_t literal) {
+            // Note: result.selects may be reallocated by nested select expressions, so
+            // the table is referred to by index
+            uint32_t table = static_cast<uint32_t>(result.selects.size());
+            result.selects.push_back(
+                SelectTable{variable, {}, 0, 0, 0, 0, 0, literal});
+            result.selects[table].categories.fill(CompiledMessage::NONE);
+            this->emit(OpCode::Select, table);
+
+            // Nested select expressions add their variants first, so the variants of
+            // this one are collected separately
+            std::vector<NumberVariant> numbers;
+            std::vector<StringVariant> strings;
+            std::vector<uint32_t> exits;
+            for (size_t i = 0; i < expr.variants.size(); i++) {
+                uint32_t target = this->label();
+                this->addVariant(table, numbers, strings, expr.variants[i].first, target);
+                if (i == expr.defaultVariant)
+                    result.selects[table].defaultTarget = target;
+                this->compilePattern(expr.variants[i].second);
+                exits.push_back(this->position());
+                this->emit(OpCode::Jump);
+            }
+            uint32_t end = this->label();
+            for (uint32_t exit : exits) {
+                result.code[exit].a = end;
+            }
+
+            // The sort is stable, so the first of several equal keys stays first
+            std::stable_sort(numbers.begin(), numbers.end(),
+                             [](const auto &a, const auto &b) { return a.value < b.value; });
+            strings = hashStrings(strings);
+            SelectTable &select = result.selects[table];
+            select.numbers = static_cast<uint32_t>(result.numberVariants.size());
+            select.numberCount = static_cast<uint32_t>(numbers.size());
+            result.numberVariants.insert(result.numberVariants.end(), numbers.begin(),
+                                         numbers.end());
+            select.strings = static_cast<uint32_t>(result.stringVariants.size());
+            select.stringCount = static_cast<uint32_t>(strings.size());
+            result.stringVariants.insert(result.stringVariants.end(), strings.begin(),
+                                         strings.end());
+        }
+
+        /// Builds the hash table of string variants from the variants in resource order
+        static std::vector<StringVariant>
+        hashStrings(const std::vector<StringVariant> &variants) {
+            if (variants.empty())
+                return {};
+            // At most half full, so probe sequences stay short
+            size_t size = 1;
+            while (size < variants.size() * 2)
+                size *= 2;
+            std::vector<StringVariant> slots(size,
+                                             StringVariant{0, CompiledMessage::NONE, 0});
+            for (const StringVariant &variant : variants) {
+                size_t slot = variant.hash & (size - 1);
+                // Names are interned, so equal keys have the same name
+                while (slots[slot].name != CompiledMessage::NONE &&
+                       slots[slot].name != variant.name)
+                    slot = (slot + 1) & (size - 1);
+                // Earlier variants take precedence over later ones with the same key
+                if (slots[slot].name == CompiledMessage::NONE)
+                    slots[slot] = variant;
+            }
+            return slots;
+        }
+
+        void addVariant(uint32_t table, std::vector<NumberVariant> &numbers,
+                        std::vector<StringVariant> &strings, const ast::VariantKey &key,
+                        uint32_t target) {
+            if (const std::string *identifier = std::get_if<std::string>(&key)) {
+                strings.push_back(
+                    StringVariant{hashKey(*identifier), this->name(*identifier), target});
+                std::optional<PluralCategory> category = toPluralCategory(*identifier);
+                auto &categories = result.selects[table].categories;
+                if (category && categories[size_t(*category)] == CompiledMessage::NONE)
+                    categories[size_t(*category)] = target;
+            } else {
+                numbers.push_back(NumberVariant{
+                    std::get<ast::NumberLiteral>(key).getDoubleValue(), target});
+            }
+        }
+
+    public:
+        Compiler(CompiledStorage &result, const FormatContext &context,
+                 SymbolTable<MessageId> &messageIds, SymbolTable<TermId> &termIds)
+            : result(result), context(context), messageIds(messageIds), termIds(termIds) {}
+
+        uint32_t name(const std::string &identifier) {
+            auto iter = this->nameIndices.find(identifier);
+            if (iter != this->nameIndices.end())
+                return iter->second;
+            uint32_t index = static_cast<uint32_t>(result.names.size());
+            result.names.push_back(
+                StringRef{static_cast<uint32_t>(result.strings.size()),
+                          static_cast<uint32_t>(identifier.size())});
+            result.strings += identifier;
+            this->nameIndices.emplace(identifier, index);
+            return index;
+        }
+
+        void compilePattern(const std::vector<ast::PatternElement> &pattern) {
+            for (const ast::PatternElement &elem : pattern) {
+                std::visit(
+                    [&](const auto &arg) {
+                        using T = std::decay_t<decltype(arg)>;
+                        if constexpr (std::is_same_v<T, std::string>)
+                            this->emitText(arg);
+                        else if constexpr (std::is_same_v<T, ast::StringLiteral>)
+                            this->emitText(arg.value);
+                        else if constexpr (std::is_same_v<T, ast::NumberLiteral>)
+                            this->emit(OpCode::Number, this->literal(arg));
+                        else if constexpr (std::is_same_v<T, ast::VariableReference>)
+                            this->emit(OpCode::Variable, this->name(arg.identifier));
+                        else if constexpr (std::is_same_v<T, ast::TermReference>)
+                            this->emit(OpCode::Term,
+                                       this->reference(
+                                           this->termIds.intern(arg.identifier).index, arg,
+                                           arg.arguments));
+                        else if constexpr (std::is_same_v<T, ast::MessageReference>)
+                            this->emit(OpCode::Message,
+                                       this->reference(
+                                           this->messageIds.intern(arg.identifier).index,
+                                           arg));
+                        else if constexpr (std::is_same_v<T, ast::SelectExpression>)
+                            this->compileSelect(arg);
+                        else
+                            static_assert(always_false_v<T>, "non-exhaustive visitor!");
+                    },
+                    elem);
+            }
+        }
+
+        uint32_t compileEntry(const std::vector<ast::PatternElement> &pattern) {
+            uint32_t entry = this->label();
+            this->compilePattern(pattern);
+            this->emit(OpCode::Return);
+            return entry;
+        }
+    };
+
+    CompiledMessage CompiledMessage::compile(const ast::Message &message,
+                                             const FormatContext &context,
+                                             SymbolTable<MessageId> &messageIds,
+                                             SymbolTable<TermId> &termIds) {
+        auto storage = std::make_shared<CompiledStorage>();
+        Compiler compiler(*storage, context, messageIds, termIds);
+        CompiledMessage result;
+        result.valueEntry = compiler.compileEntry(message.getPattern());
+        // Attributes are sorted by the message, so stay sorted here
+        storage->attributes.reserve(message.getAttributes().size());
+        for (const ast::Attribute &attribute : message.getAttributes()) {
+            uint32_t name = compiler.name(attribute.getId());
+            storage->attributes.push_back(
+                AttributeEntry{name, compiler.compileEntry(attribute.getPattern())});
+        }
+
+        auto span = [](const auto &values) {
+            using T = typename std::decay_t<decltype(values)>::value_type;
+            return Span<T>{values.data(), static_cast<uint32_t>(values.size())};
+        };
+        result.code = span(storage->code);
+        result.text = storage->text;
+        result.strings = storage->strings.data();
+        result.names = span(storage->names);
+        result.references = span(storage->references);
+        result.selects = span(storage->selects);
+        result.numberVariants = span(storage->numberVariants);
+        result.stringVariants = span(storage->stringVariants);
+        result.literals = span(storage->literals);
+        result.arguments = span(storage->arguments);
+        result.attributes = span(storage->attributes);
+        result.storage = std::move(storage);
+        return result;
+    }
+
+    uint32_t CompiledMessage::findAttribute(std::string_view attribute) const {
+        auto iter = std::lower_bound(
+            this->attributes.begin(), this->attributes.end(), attribute,
+            [&](const AttributeEntry &a, std::string_view id) {
+                return this->getName(a.name) < id;
+            });
+        if (iter != this->attributes.end() && this->getName(iter->name) == attribute)
+            return iter->entry;
+        return NONE;
+    }
+
+    bool CompiledMessage::hasAttribute(std::string_view attribute) const {
+        return this->findAttribute(attribute) != NONE;
+    }
+
+    bool CompiledMessage::usesArguments(const std::string *attribute,
+                                        const CompiledResolver &resolver,
+                                        size_t maxDepth) const {
+        uint32_t entry = attribute ? this->findAttribute(*attribute) : this->valueEntry;
+        return entry != NONE && this->usesArguments(entry, resolver, 0, maxDepth);
+    }
+
+    bool CompiledMessage::usesArguments(uint32_t entry, const CompiledResolver &resolver,
+                                        size_t depth, size_t maxDepth) const {
+        if (depth > maxDepth)
+            return true;
+        // The variants of select expressions end with a Jump, so the pattern starting
+        // at entry, including all of its variants, ends at the first Return
+        for (uint32_t pc = entry; this->code[pc].op != OpCode::Return; pc++) {
+            const Instruction &instruction = this->code[pc];
+            if (instruction.op == OpCode::Variable)
+                return true;
+            if (instruction.op == OpCode::Select &&
+                this->selects[instruction.a].variable != NONE)
+                return true;
+            // Terms, and anything they reference, are only passed the arguments of the
+            // term reference
+            if (instruction.op == OpCode::Message) {
+                const Reference &ref = this->references[instruction.a];
+                const CompiledMessage *message =
+                    resolver.getMessage(MessageId(this->getId(ref, false)));
+                if (!message)
+                    continue;
+                uint32_t target = ref.attribute == NONE
+                                      ? message->valueEntry
+                                      : message->findAttribute(this->getName(ref.attribute));
+                if (target != NONE &&
+                    message->usesArguments(target, resolver, depth + 1, maxDepth))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t CompiledMessage::select(const SelectTable &table,
+                                     const FormatContext &context,
+                                     const FluentArgs &args, bool termScope) const {
+        if (table.literal != NONE) {
+            return std::visit(
+                [&](auto value) {
+                    return this->select(table, context, VariableView(value));
+                },
+                this->literals[table.literal].getValue());
+        }
+        std::string_view variable = this->getName(table.variable);
+        const VariableView *found = args.find(variable);
+        if (!found && termScope)
+            return table.defaultTarget;
+        return this->select(table, context, found ? *found : args.at(variable));
+    }
+
+    uint32_t CompiledMessage::select(const SelectTable &table,
+                                     const FormatContext &context,
+                                     const VariableView &selector) const {
+        if (const std::string_view *key = std::get_if<std::string_view>(&selector)) {
+            if (table.stringCount == 0)
+                return table.defaultTarget;
+            const StringVariant *strings = &this->stringVariants[table.strings];
+            uint64_t hash = hashKey(*key);
+            size_t mask = table.stringCount - 1;
+            for (size_t slot = hash & mask; strings[slot].name != NONE;
+                 slot = (slot + 1) & mask) {
+                const StringVariant &variant = strings[slot];
+                if (variant.hash == hash && this->getName(variant.name) == *key)
+                    return variant.target;
+            }
+            return table.defaultTarget;
+        }
+
+        return std::visit(
+            [&](const auto &key) {
+                using T = std::decay_t<decltype(key)>;
+                if constexpr (std::is_same_v<T, std::string_view>) {
+                    return table.defaultTarget;
+                } else {
+                    uint32_t target =
+                        table.categories[size_t(context.selectPluralCategory(key))];
+                    // Numbers are compared as ast::NumberLiteral does, so a number
+                    // which differs by rounding error is either the lower bound or
+                    // just before it
+                    double value = static_cast<double>(key);
+                    const NumberVariant *begin = &this->numberVariants[0] + table.numbers;
+                    const NumberVariant *end = begin + table.numberCount;
+                    const NumberVariant *iter = std::lower_bound(
+                        begin, end, value,
+                        [](const auto &variant, double value) { return variant.value < value; });
+                    auto matches = [&](auto candidate) {
+                        double a = candidate->value;
+                        return std::abs(a - value) <=
+                               std::abs(std::min(a, value)) *
+                                   std::numeric_limits<double>::epsilon();
+                    };
+                    if (iter != begin && matches(iter - 1))
+                        target = std::min(target, (iter - 1)->target);
+                    if (iter != end && matches(iter))
+                        target = std::min(target, iter->target);
+                    return target == NONE ? table.defaultTarget : target;
+                }
+            },
+            selector);
+    }
+
+    /// A pattern being executed, and the position of its next instruction
+    struct ExecutionFrame {
+        const CompiledMessage *message = nullptr;
+        uint32_t entry = 0;
+        uint32_t pc = 0;
+        const FluentArgs *args = nullptr;
+        /// Whether the pattern belongs to a term, or something a term references
+        bool termScope = false;
+    };
+
+    void CompiledMessage::execute(uint32_t entry, const FormatContext &context,
+                                  const FluentArgs &args,
+                                  const CompiledResolver &resolver,
+                                  OutputSink &output, const FormatLimits &limits) const {
+        static const FluentArgs noArgs;
+        FormatBudget out(output, limits);
+        FrameStack<ExecutionFrame> stack;
+        stack.push(ExecutionFrame{this, entry, entry, &args, false});
+
+        while (!stack.empty() && !out.isExhausted()) {
+            ExecutionFrame &frame = stack.top();
+            const CompiledMessage &message = *frame.message;
+            const Instruction &instruction = message.code[frame.pc++];
+            switch (instruction.op) {
+            case OpCode::Text:
+                out.append(message.text.substr(instruction.a, instruction.b));
+                break;
+            case OpCode::Variable: {
+                if (!out.expand())
+                    break;
+                std::string_view name = message.getName(instruction.a);
+                const VariableView *variable = frame.args->find(name);
+                if (variable || !frame.termScope)
+                    ast::formatVariable(out, context, variable ? *variable : frame.args->at(name));
+                else
+                    ast::appendUnknownVariable(out, name);
+                break;
+            }
+            case OpCode::Number:
+                message.literals[instruction.a].format(out, context);
+                break;
+            case OpCode::Message:
+            case OpCode::Term: {
+                if (!out.expand())
+                    break;
+                bool isTerm = instruction.op == OpCode::Term;
+                const Reference &ref = message.references[instruction.a];
+                auto appendError = [&](const char *error) {
+                    out.append(error);
+                    out.append(isTerm ? " { -" : " { ");
+                    out.append(message.getName(ref.name));
+                    out.append(" }");
+                };
+                uint32_t id = message.getId(ref, isTerm);
+                const CompiledMessage *reference = isTerm ? resolver.getTerm(TermId(id))
+                                                          : resolver.getMessage(MessageId(id));
+                if (!reference) {
+                    // FIXME: This could probably be handled better
+                    appendError("unknown message");
+                    break;
+                }
+                uint32_t target = reference->valueEntry;
+                if (ref.attribute != NONE)
+                    target = reference->findAttribute(message.getName(ref.attribute));
+                if (target == NONE) {
+                    appendError("unknown attribute");
+                    break;
+                }
+                bool cyclic = false;
+                for (size_t i = 0; i < stack.size() && !cyclic; i++)
+                    cyclic = stack[i].message == reference && stack[i].entry == target;
+                if (cyclic) {
+                    appendError("cyclic reference");
+                } else if (stack.size() > limits.maxDepth) {
+                    appendError("reference too deep");
+                } else {
+                    const FluentArgs *args = frame.args;
+                    if (isTerm && ref.arguments != NONE)
+                        args = &message.arguments[ref.arguments]->getArgs();
+                    else if (isTerm)
+                        args = &noArgs;
+                    // Invalidates frame
+                    stack.push(ExecutionFrame{reference, target, target, args,
+                                              isTerm || frame.termScope});
+                }
+                break;
+            }
+            case OpCode::Select:
+                frame.pc = message.select(message.selects[instruction.a], context, *frame.args,
+                                          frame.termScope);
+                break;
+            case OpCode::Jump:
+                frame.pc = instruction.a;
+                break;
+            case OpCode::Return:
+                stack.pop();
+                break;
+            }
+        }
+    }
+
+    const std::string
+    CompiledMessage::format(const FormatContext &context,
+                            const FluentArgs &args,
+                            const CompiledResolver &resolver) const {
+        std::string result;
+        StringSink sink(result);
+        this->execute(this->valueEntry, context, args, resolver, sink, FormatLimits());
+        return result;
+    }
+
+    std::optional<std::string>
+    CompiledMessage::formatAttribute(const std::string &attribute,
+                                     const FormatContext &context,
+                                     const FluentArgs &args,
+                                     const CompiledResolver &resolver) const {
+        std::string result;
+        StringSink sink(result);
+        if (!this->formatAttribute(sink, attribute, context, args, resolver))
+            return std::optional<std::string>();
+        return result;
+    }
+
+    void CompiledMessage::format(OutputSink &out, const FormatContext &context,
+                                 const FluentArgs &args,
+                                 const CompiledResolver &resolver,
+                                 const FormatLimits &limits) const {
+        this->execute(this->valueEntry, context, args, resolver, out, limits);
+    }
+
+    bool CompiledMessage::formatAttribute(OutputSink &out, const std::string &attribute,
+                                          const FormatContext &context,
+                                          const FluentArgs &args,
+                                          const CompiledResolver &resolver,
+                                          const FormatLimits &limits) const {
+        uint32_t entry = this->findAttribute(attribute);
+        if (entry == NONE)
+            return false;
+        this->execute(entry, context, args, resolver, out, limits);
+        return true;
+    }
+
+    /*
+     * Layout of a compiled image:
+     *
+     *   ImageHeader
+     *   The sections listed in ImageSection, each aligned to 8 bytes
+     *
+     * Each ImageEntry refers to the ranges of the sections holding the arrays of its
+     * CompiledMessage, which are used in place. Indices within a message are
+     * relative to its own ranges, and the offsets of its names to its range of
+     * STRINGS, so they are the same as when the message was compiled in memory.
+     * Identifiers, literals and argument values refer to STRINGS as a whole.
+     *
+     * Integers and records are stored as they are laid out in memory on the platform
+     * which wrote the image, and padding is zero.
+     */
+    enum ImageSection : uint32_t {
+        ENTRIES,
+        IDENTIFIERS,
+        CODE,
+        TEXT,
+        STRINGS,
+        NAMES,
+        REFERENCES,
+        SELECTS,
+        NUMBER_VARIANTS,
+        STRING_VARIANTS,
+        LITERALS,
+        ARGUMENTS,
+        ARGUMENT_VALUES,
+        ATTRIBUTES,
+        SECTION_COUNT
+    };
+
+    /// A range of elements of a section; for the header, a range of bytes
+    struct ImageRange {
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    struct ImageHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t layout;
+        /// The number of message identifiers in IDENTIFIERS, which are followed by
+        /// those of the terms
+        uint32_t messageIdentifiers;
+        uint32_t termIdentifiers;
+        ImageRange sections[SECTION_COUNT];
+    };
+
+    struct ImageEntry {
+        /// Index of the identifier in IDENTIFIERS. References within the message
+        /// refer to terms relative to the first term identifier instead.
+        uint32_t identifier;
+        uint32_t isTerm;
+        uint32_t valueEntry;
+        ImageRange code, text, strings, names, references, selects, numberVariants,
+            stringVariants, literals, arguments, attributes;
+    };
+
+    /// An argument of a term reference
+    struct ImageArgument {
+        /// The name of a named argument, or an offset of NONE for a positional one
+        StringRef name;
+        /// Whether value is a number literal rather than a string literal
+        uint32_t isNumber;
+        StringRef value;
+    };
+
+    static constexpr char IMAGE_MAGIC[4] = {'F', 'T', 'L', 'C'};
+    static constexpr uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+    /// Differs between platforms which lay out the records of an image differently
+    static constexpr uint32_t IMAGE_LAYOUT =
+        sizeof(Instruction) | sizeof(SelectTable) << 8 | sizeof(NumberVariant) << 16 |
+        alignof(NumberVariant) << 24;
+    static constexpr size_t IMAGE_ALIGNMENT = 8;
+
+    class CompiledImageWriter {
+    private:
+        std::vector<ImageEntry> entries;
+        std::vector<StringRef> identifiers;
+        std::vector<Instruction> code;
+        std::string text;
+        std::string strings;
+        std::vector<StringRef> names;
+        std::vector<CompiledMessage::Reference> references;
+        std::vector<SelectTable> selects;
+        std::vector<NumberVariant> numberVariants;
+        std::vector<StringVariant> stringVariants;
+        std::vector<StringRef> literals;
+        std::vector<ImageRange> arguments;
+        std::vector<ImageArgument> argumentValues;
+        std::vector<AttributeEntry> attributes;
+
+        template <typename T>
+        static ImageRange append(std::vector<T> &to, CompiledMessage::Span<T> values) {
+            ImageRange range{static_cast<uint32_t>(to.size()), values.size};
+            to.insert(to.end(), values.begin(), values.end());
+            return range;
+        }
+
+        static ImageRange append(std::string &to, std::string_view values) {
+            ImageRange range{static_cast<uint32_t>(to.size()),
+                             static_cast<uint32_t>(values.size())};
+            to += values;
+            return range;
+        }
+
+        StringRef addString(std::string_view value) {
+            ImageRange range = append(this->strings, value);
+            return StringRef{range.offset, range.count};
+        }
+
+        // Records are copied a field at a time where they contain padding, so that the
+        // padding in the image is zero and the same resource always gives the same
+        // image
+        template <typename T> static void store(char *out, const T &value) {
+            static_assert(std::has_unique_object_representations_v<T>,
+                          "records with padding need their own overload");
+            std::memcpy(out, &value, sizeof(T));
+        }
+
+        static void store(char *out, const Instruction &value) {
+            std::memcpy(out + offsetof(Instruction, op), &value.op, sizeof(value.op));
+            std::memcpy(out + offsetof(Instruction, a), &value.a, sizeof(value.a));
+            std::memcpy(out + offsetof(Instruction, b), &value.b, sizeof(value.b));
+        }
+
+        static void store(char *out, const NumberVariant &value) {
+            std::memcpy(out + offsetof(NumberVariant, value), &value.value,
+                        sizeof(value.value));
+            std::memcpy(out + offsetof(NumberVariant, target), &value.target,
+                        sizeof(value.target));
+        }
+
+        template <typename Values>
+        static void write(std::string &image, ImageHeader &header, ImageSection section,
+                          const Values &values) {
+            using T = std::decay_t<decltype(values[0])>;
+            image.resize((image.size() + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT *
+                         IMAGE_ALIGNMENT);
+            size_t offset = image.size();
+            image.resize(offset + values.size() * sizeof(T));
+            for (size_t i = 0; i < values.size(); i++)
+                store(&image[offset + i * sizeof(T)], values[i]);
+            header.sections[section] = ImageRange{static_cast<uint32_t>(offset),
+                                                  static_cast<uint32_t>(values.size())};
+        }
+
+    public:
+        void add(uint32_t identifier, bool isTerm, const CompiledMessage &message) {
+            ImageEntry entry{};
+            entry.identifier = identifier;
+            entry.isTerm = isTerm;
+            entry.valueEntry = message.valueEntry;
+            entry.code = append(this->code, message.code);
+            entry.text = append(this->text, message.text);
+            // The pool ends with the last name added to it
+            size_t pool = 0;
+            for (const StringRef &name : message.names)
+                pool = std::max<size_t>(pool, name.offset + name.length);
+            entry.strings =
+                append(this->strings, std::string_view(message.strings, pool));
+            entry.names = append(this->names, message.names);
+            entry.references = append(this->references, message.references);
+            entry.selects = append(this->selects, message.selects);
+            entry.numberVariants = append(this->numberVariants, message.numberVariants);
+            entry.stringVariants = append(this->stringVariants, message.stringVariants);
+            entry.literals = ImageRange{static_cast<uint32_t>(this->literals.size()),
+                                        message.literals.size};
+            for (const ast::NumberLiteral &literal : message.literals)
+                this->literals.push_back(this->addString(literal.value));
+
+            entry.arguments = ImageRange{static_cast<uint32_t>(this->arguments.size()),
+                                         message.arguments.size};
+            for (const auto &arguments : message.arguments) {
+                ImageRange range{static_cast<uint32_t>(this->argumentValues.size()), 0};
+                auto addArgument = [&](StringRef name,
+                                       const ast::CallArguments::Literal &value) {
+                    const auto *number = std::get_if<ast::NumberLiteral>(&value);
+                    const std::string &text =
+                        number ? number->value
+                               : std::get<ast::StringLiteral>(value).value;
+                    this->argumentValues.push_back(
+                        ImageArgument{name, number != nullptr, this->addString(text)});
+                    range.count++;
+                };
+                for (const auto &value : arguments->getPositional())
+                    addArgument(StringRef{CompiledMessage::NONE, 0}, value);
+                for (const auto &[name, value] : arguments->getNamed())
+                    addArgument(this->addString(name), value);
+                this->arguments.push_back(range);
+            }
+            entry.attributes = append(this->attributes, message.attributes);
+            this->entries.push_back(entry);
+        }
+
+        std::string finish(const SymbolTable<MessageId> &messageIds,
+                           const SymbolTable<TermId> &termIds) {
+            for (uint32_t i = 0; i < messageIds.size(); i++)
+                this->identifiers.push_back(
+                    this->addString(messageIds.getName(MessageId(i))));
+            for (uint32_t i = 0; i < termIds.size(); i++)
+                this->identifiers.push_back(
+                    this->addString(termIds.getName(TermId(i))));
+            // Terms may be added before all of the messages are interned
+            for (ImageEntry &entry : this->entries)
+                if (entry.isTerm)
+                    entry.identifier += static_cast<uint32_t>(messageIds.size());
+
+            ImageHeader header{};
+            std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+            header.version = COMPILED_RESOURCE_VERSION;
+            header.byteOrder = IMAGE_BYTE_ORDER;
+            header.layout = IMAGE_LAYOUT;
+            header.messageIdentifiers = static_cast<uint32_t>(messageIds.size());
+            header.termIdentifiers = static_cast<uint32_t>(termIds.size());
+
+            std::string image(sizeof(ImageHeader), '\0');
+            write(image, header, ENTRIES, this->entries);
+            write(image, header, IDENTIFIERS, this->identifiers);
+            write(image, header, CODE, this->code);
+            write(image, header, TEXT, this->text);
+            write(image, header, STRINGS, this->strings);
+            write(image, header, NAMES, this->names);
+            write(image, header, REFERENCES, this->references);
+            write(image, header, SELECTS, this->selects);
+            write(image, header, NUMBER_VARIANTS, this->numberVariants);
+            write(image, header, STRING_VARIANTS, this->stringVariants);
+            write(image, header, LITERALS, this->literals);
+            write(image, header, ARGUMENTS, this->arguments);
+            write(image, header, ARGUMENT_VALUES, this->argumentValues);
+            write(image, header, ATTRIBUTES, this->attributes);
+            if (image.size() > std::numeric_limits<uint32_t>::max())
+                throw std::length_error("Resource is too large for a compiled image");
+            std::memcpy(&image[0], &header, sizeof(header));
+            return image;
+        }
+    };
+
+    std::string serializeCompiledResource(const std::vector<ast::Entry> &entries,
+                                          const icu::Locale &locale) {
+        FormatContext context(locale);
+        SymbolTable<MessageId> messageIds;
+        SymbolTable<TermId> termIds;
+        CompiledImageWriter writer;
+        for (const ast::Entry &entry : entries) {
+            std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, ast::Message>) {
+                        uint32_t id = messageIds.intern(arg.getId()).index;
+                        writer.add(id, false,
+                                   CompiledMessage::compile(arg, context, messageIds,
+                                                            termIds));
+                    } else if constexpr (std::is_same_v<T, ast::Term>) {
+                        uint32_t id = termIds.intern(arg.getId()).index;
+                        writer.add(id, true,
+                                   CompiledMessage::compile(arg, context, messageIds,
+                                                            termIds));
+                    }
+                },
+                entry);
+        }
+        return writer.finish(messageIds, termIds);
+    }
+
+    /// The memory shared by the messages loaded from an image
+    struct ImageStorage {
+        std::shared_ptr<const void> owner;
+        std::vector<ast::NumberLiteral> literals;
+        std::vector<std::shared_ptr<const ast::CallArguments>> arguments;
+        std::vector<uint32_t> messageIds;
+        std::vector<uint32_t> termIds;
+    };
+
+    class CompiledImageReader {
+    private:
+        template <typename T> using Span = CompiledMessage::Span<T>;
+
+        std::string_view image;
+        const ImageHeader *header = nullptr;
+        Span<char> strings;
+
+        [[noreturn]] static void fail(const char *reason) {
+            throw std::runtime_error(std::string("Invalid compiled resource: ") +
+                                     reason);
+        }
+
+        template <typename T> Span<T> section(ImageSection index) const {
+            ImageRange range = this->header->sections[index];
+            if (range.offset % alignof(T) != 0 || range.offset < sizeof(ImageHeader) ||
+                range.offset + uint64_t(range.count) * sizeof(T) > this->image.size())
+                fail("section out of bounds");
+            const char *data = this->image.data() + range.offset;
+            return Span<T>{reinterpret_cast<const T *>(data), range.count};
+        }
+
+        template <typename T> static Span<T> slice(Span<T> values, ImageRange range) {
+            if (uint64_t(range.offset) + range.count > values.size)
+                fail("range out of bounds");
+            return Span<T>{values.data + range.offset, range.count};
+        }
+
+        static void checkString(StringRef ref, uint64_t size) {
+            if (uint64_t(ref.offset) + ref.length > size)
+                fail("string out of bounds");
+        }
+
+        std::string_view getString(StringRef ref) const {
+            checkString(ref, this->strings.size);
+            return std::string_view(this->strings.data + ref.offset, ref.length);
+        }
+
+        /// Checks that formatting the message only reads within its arrays, and that
+        /// it terminates: every pattern ends with a Return, and jumps only go forwards,
+        /// as they do in compiled messages
+        void check(const CompiledMessage &message, uint32_t poolSize) const {
+            uint32_t codeSize = message.code.size;
+            auto name = [&](uint32_t name) {
+                if (name >= message.names.size)
+                    fail("name out of range");
+            };
+            for (const StringRef &ref : message.names)
+                checkString(ref, poolSize);
+
+            // Execution moves to the next instruction unless it jumps, so ending with a
+            // Return means it never runs past the end
+            if (codeSize == 0 || message.code[codeSize - 1].op != OpCode::Return)
+                fail("code does not end with a return");
+            for (uint32_t pc = 0; pc < codeSize; pc++) {
+                const Instruction &instruction = message.code[pc];
+                auto target = [&](uint32_t target) {
+                    if (target <= pc || target >= codeSize)
+                        fail("invalid jump target");
+                };
+                switch (instruction.op) {
+                case OpCode::Text:
+                    checkString(StringRef{instruction.a, instruction.b},
+                                message.text.size());
+                    break;
+                case OpCode::Variable:
+                    name(instruction.a);
+                    break;
+                case OpCode::Number:
+                    if (instruction.a >= message.literals.size)
+                        fail("literal out of range");
+                    break;
+                case OpCode::Message:
+                case OpCode::Term: {
+                    if (instruction.a >= message.references.size)
+                        fail("reference out of range");
+                    bool isTerm = instruction.op == OpCode::Term;
+                    const auto &ref = message.references[instruction.a];
+                    uint32_t ids = isTerm ? this->header->termIdentifiers
+                                          : this->header->messageIdentifiers;
+                    if (ref.id >= ids)
+                        fail("reference to an unknown identifier");
+                    name(ref.name);
+                    if (ref.attribute != CompiledMessage::NONE)
+                        name(ref.attribute);
+                    if (isTerm && ref.arguments != CompiledMessage::NONE &&
+                        ref.arguments >= message.arguments.size)
+                        fail("arguments out of range");
+                    break;
+                }
+                case OpCode::Select: {
+                    if (instruction.a >= message.selects.size)
+                        fail("select out of range");
+                    const SelectTable &table = message.selects[instruction.a];
+                    if (table.literal != CompiledMessage::NONE) {
+                        if (table.literal >= message.literals.size)
+                            fail("literal out of range");
+                    } else {
+                        name(table.variable);
+                    }
+                    for (uint32_t category : table.categories)
+                        if (category != CompiledMessage::NONE)
+                            target(category);
+                    target(table.defaultTarget);
+                    for (const NumberVariant &variant :
+                         slice(message.numberVariants,
+                               ImageRange{table.numbers, table.numberCount}))
+                        target(variant.target);
+                    // Lookups stop at an empty slot, so there must be one
+                    if (table.stringCount & (table.stringCount - 1))
+                        fail("string variants are not a power of two");
+                    bool empty = table.stringCount == 0;
+                    for (const StringVariant &variant :
+                         slice(message.stringVariants,
+                               ImageRange{table.strings, table.stringCount})) {
+                        if (variant.name == CompiledMessage::NONE) {
+                            empty = true;
+                        } else {
+                            name(variant.name);
+                            target(variant.target);
+                        }
+                    }
+                    if (!empty)
+                        fail("string variants are full");
+                    break;
+                }
+                case OpCode::Jump:
+                    target(instruction.a);
+                    break;
+                case OpCode::Return:
+                    break;
+                default:
+                    fail("unknown instruction");
+                }
+            }
+
+            if (message.valueEntry >= codeSize)
+                fail("invalid entry point");
+            for (size_t i = 0; i < message.attributes.size; i++) {
+                name(message.attributes[i].name);
+                if (message.attributes[i].entry >= codeSize)
+                    fail("invalid entry point");
+                if (i > 0 && !(message.getName(message.attributes[i - 1].name) <
+                               message.getName(message.attributes[i].name)))
+                    fail("attributes are not sorted");
+            }
+        }
+
+        static ast::NumberLiteral readLiteral(std::string_view value) {
+            try {
+                return ast::NumberLiteral(std::string(value));
+            } catch (const std::logic_error &) {
+                fail("invalid number literal");
+            }
+        }
+
+    public:
+        explicit CompiledImageReader(std::string_view image) : image(image) {
+            if (image.size() < sizeof(ImageHeader))
+                fail("truncated header");
+            if (reinterpret_cast<uintptr_t>(image.data()) % IMAGE_ALIGNMENT != 0)
+                fail("image is misaligned");
+            this->header = reinterpret_cast<const ImageHeader *>(image.data());
+            if (std::memcmp(this->header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+                fail("not a compiled image");
+            if (this->header->version != COMPILED_RESOURCE_VERSION)
+                fail("unsupported version");
+            if (this->header->byteOrder != IMAGE_BYTE_ORDER ||
+                this->header->layout != IMAGE_LAYOUT)
+                fail("written on an incompatible platform");
+            this->strings = this->section<char>(STRINGS);
+        }
+
+        std::vector<CompiledEntry> read(std::shared_ptr<const void> owner,
+                                        const FormatContext &context,
+                                        SymbolTable<MessageId> &messageIds,
+                                        SymbolTable<TermId> &termIds) const {
+            auto entries = this->section<ImageEntry>(ENTRIES);
+            auto identifiers = this->section<StringRef>(IDENTIFIERS);
+            auto code = this->section<Instruction>(CODE);
+            auto text = this->section<char>(TEXT);
+            auto names = this->section<StringRef>(NAMES);
+            auto references = this->section<CompiledMessage::Reference>(REFERENCES);
+            auto selects = this->section<SelectTable>(SELECTS);
+            auto numberVariants = this->section<NumberVariant>(NUMBER_VARIANTS);
+            auto stringVariants = this->section<StringVariant>(STRING_VARIANTS);
+            auto literals = this->section<StringRef>(LITERALS);
+            auto arguments = this->section<ImageRange>(ARGUMENTS);
+            auto argumentValues = this->section<ImageArgument>(ARGUMENT_VALUES);
+            auto attributes = this->section<AttributeEntry>(ATTRIBUTES);
+            uint32_t messageCount = this->header->messageIdentifiers;
+            uint64_t identifierCount =
+                uint64_t(messageCount) + this->header->termIdentifiers;
+            if (identifierCount != identifiers.size)
+                fail("wrong number of identifiers");
+
+            auto storage = std::make_shared<ImageStorage>();
+            storage->owner = std::move(owner);
+            storage->literals.reserve(literals.size);
+            for (const StringRef &literal : literals) {
+                storage->literals.push_back(readLiteral(this->getString(literal)));
+                storage->literals.back().localize(context);
+            }
+            storage->arguments.reserve(arguments.size);
+            for (const ImageRange &range : arguments) {
+                std::vector<ast::CallArguments::Argument> values;
+                for (const ImageArgument &argument : slice(argumentValues, range)) {
+                    std::string value(this->getString(argument.value));
+                    using Literal = ast::CallArguments::Literal;
+                    Literal literal =
+                        argument.isNumber
+                            ? Literal(readLiteral(value))
+                            : Literal(ast::StringLiteral(std::move(value)));
+                    if (argument.name.offset == CompiledMessage::NONE)
+                        values.push_back(std::move(literal));
+                    else
+                        values.push_back(ast::CallArguments::NamedArgument(
+                            this->getString(argument.name), std::move(literal)));
+                }
+                storage->arguments.push_back(
+                    std::make_shared<const ast::CallArguments>(std::move(values)));
+            }
+
+            std::vector<CompiledMessage> messages;
+            messages.reserve(entries.size);
+            for (const ImageEntry &entry : entries) {
+                if (entry.identifier >= identifiers.size ||
+                    entry.isTerm != (entry.identifier >= messageCount))
+                    fail("entry has an invalid identifier");
+                CompiledMessage message;
+                message.code = slice(code, entry.code);
+                Span<char> entryText = slice(text, entry.text);
+                message.text = std::string_view(entryText.data, entryText.size);
+                message.strings = slice(this->strings, entry.strings).data;
+                message.names = slice(names, entry.names);
+                message.references = slice(references, entry.references);
+                message.selects = slice(selects, entry.selects);
+                message.numberVariants = slice(numberVariants, entry.numberVariants);
+                message.stringVariants = slice(stringVariants, entry.stringVariants);
+                message.literals = slice(
+                    Span<ast::NumberLiteral>{storage->literals.data(), literals.size},
+                    entry.literals);
+                message.arguments = slice(
+                    Span<std::shared_ptr<const ast::CallArguments>>{
+                        storage->arguments.data(), arguments.size},
+                    entry.arguments);
+                message.attributes = slice(attributes, entry.attributes);
+                message.valueEntry = entry.valueEntry;
+                this->check(message, entry.strings.count);
+                messages.push_back(message);
+            }
+
+            // The image is valid, so its identifiers can be interned
+            for (uint32_t i = 0; i < identifiers.size; i++) {
+                std::string name(this->getString(identifiers[i]));
+                if (i < messageCount)
+                    storage->messageIds.push_back(messageIds.intern(name).index);
+                else
+                    storage->termIds.push_back(termIds.intern(name).index);
+            }
+            std::vector<CompiledEntry> result;
+            result.reserve(messages.size());
+            for (size_t i = 0; i < messages.size(); i++) {
+                CompiledMessage &message = messages[i];
+                message.messageIds =
+                    Span<uint32_t>{storage->messageIds.data(), messageCount};
+                message.termIds = Span<uint32_t>{storage->termIds.data(),
+                                                 this->header->termIdentifiers};
+                message.storage = storage;
+                uint32_t identifier = entries[i].identifier;
+                result.push_back(CompiledEntry{
+                    this->getString(identifiers[identifier]), entries[i].isTerm != 0,
+                    std::make_shared<const CompiledMessage>(std::move(message))});
+            }
+            return result;
+        }
+    };
+
+    std::vector<CompiledEntry> loadCompiledResource(std::shared_ptr<const void> owner,
+                                                    std::string_view image,
+                                                    const FormatContext &context,
+                                                    SymbolTable<MessageId> &messageIds,
+                                                    SymbolTable<TermId> &termIds) {
+        return CompiledImageReader(image).read(std::move(owner), context, messageIds,
+                                               termIds);
+    }
+
+} // namespace fluent
@@ -0,0 +1,170 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/context.hpp"
+#include <atomic>
+#include <unicode/bytestream.h>
+#include <unicode/errorcode.h>
+
+namespace fluent {
+    using icu::number::LocalizedNumberFormatter;
+    using icu::number::NumberFormatter;
+    using icu::number::Precision;
+
+    static std::atomic<uint64_t> nextSerial{0};
+
+    FormatContext::FormatContext(const icu::Locale &locale)
+        : serial(nextSerial.fetch_add(1, std::memory_order_relaxed)), locale(locale),
+          numberFormatter(NumberFormatter::withLocale(locale)) {
+        icu::ErrorCode status;
+        this->pluralRules.reset(icu::PluralRules::forLocale(locale, status));
+        if (status.isFailure()) {
+            this->pluralRules.reset();
+        }
+
+        for (size_t digits = 0; digits <= MAX_CACHED_FRACTION_DIGITS; digits++) {
+            this->fractionFormatters.push_back(
+                this->numberFormatter.precision(Precision::minFraction(digits)));
+        }
+    }
+
+    /// Appends UTF-8 to an OutputSink
+    class OutputByteSink : public icu::ByteSink {
+    private:
+        OutputSink &out;
+
+    public:
+        explicit OutputByteSink(OutputSink &out) : out(out) {}
+        void Append(const char *bytes, int32_t n) override {
+            this->out.append(std::string_view(bytes, static_cast<size_t>(n)));
+        }
+    };
+
+    static bool appendFormatted(OutputSink &out,
+                                const icu::number::FormattedNumber &formatted,
+                                icu::ErrorCode &status) {
+        // toTempString aliases the formatter's buffer instead of copying it
+        icu::UnicodeString text = formatted.toTempString(status);
+        if (status.isFailure())
+            return false;
+        OutputByteSink sink(out);
+        text.toUTF8(sink);
+        return true;
+    }
+
+    template <typename... Args>
+    static std::optional<std::string> formatToString(const FormatContext &context,
+                                                     Args... args) {
+        std::string buffer;
+        StringSink sink(buffer);
+        if (context.formatNumber(sink, args...))
+            return buffer;
+        return std::optional<std::string>();
+    }
+
+    bool FormatContext::formatNumber(OutputSink &out, long value) const {
+        icu::ErrorCode status;
+        return appendFormatted(out, this->numberFormatter.formatInt(value, status),
+                               status);
+    }
+
+    bool FormatContext::formatNumber(OutputSink &out, double value) const {
+        icu::ErrorCode status;
+        return appendFormatted(out, this->numberFormatter.formatDouble(value, status),
+                               status);
+    }
+
+    bool FormatContext::formatNumber(OutputSink &out, double value,
+                                     size_t minFractionDigits) const {
+        icu::ErrorCode status;
+        if (minFractionDigits < this->fractionFormatters.size()) {
+            const LocalizedNumberFormatter &formatter =
+                this->fractionFormatters[minFractionDigits];
+            return appendFormatted(out, formatter.formatDouble(value, status), status);
+        }
+        LocalizedNumberFormatter formatter = this->numberFormatter.precision(
+            Precision::minFraction(static_cast<int32_t>(minFractionDigits)));
+        return appendFormatted(out, formatter.formatDouble(value, status), status);
+    }
+
+    std::optional<std::string> FormatContext::formatNumber(long value) const {
+        return formatToString(*this, value);
+    }
+
+    std::optional<std::string> FormatContext::formatNumber(double value) const {
+        return formatToString(*this, value);
+    }
+
+    std::optional<std::string>
+    FormatContext::formatNumber(double value, size_t minFractionDigits) const {
+        return formatToString(*this, value, minFractionDigits);
+    }
+
+    static constexpr std::string_view PLURAL_CATEGORY_NAMES[PLURAL_CATEGORY_COUNT] = {
+        "zero", "one", "two", "few", "many", "other"};
+
+    std::optional<PluralCategory> toPluralCategory(std::string_view name) {
+        for (size_t i = 0; i < PLURAL_CATEGORY_COUNT; i++) {
+            if (PLURAL_CATEGORY_NAMES[i] == name)
+                return static_cast<PluralCategory>(i);
+        }
+        return std::optional<PluralCategory>();
+    }
+
+    std::string_view getPluralCategoryName(PluralCategory category) {
+        return PLURAL_CATEGORY_NAMES[static_cast<size_t>(category)];
+    }
+
+    /// Compares the keyword ICU selected against the ASCII category names, code unit
+    /// by code unit, rather than converting either side
+    static PluralCategory toPluralCategory(const icu::UnicodeString &keyword) {
+        for (size_t i = 0; i < PLURAL_CATEGORY_COUNT; i++) {
+            std::string_view name = PLURAL_CATEGORY_NAMES[i];
+            if (static_cast<size_t>(keyword.length()) != name.size())
+                continue;
+            bool equal = true;
+            for (size_t c = 0; c < name.size() && equal; c++)
+                equal = keyword.charAt(static_cast<int32_t>(c)) == char16_t(name[c]);
+            if (equal)
+                return static_cast<PluralCategory>(i);
+        }
+        return PluralCategory::Other;
+    }
+
+    PluralCategory FormatContext::selectPluralCategory(double value) const {
+        if (!this->pluralRules)
+            return PluralCategory::Other;
+        return toPluralCategory(this->pluralRules->select(value));
+    }
+
+    PluralCategory FormatContext::selectPluralCategory(long value) const {
+        if (!this->pluralRules)
+            return PluralCategory::Other;
+        return toPluralCategory(this->pluralRules->select(static_cast<int32_t>(value)));
+    }
+
+    std::string FormatContext::getPluralCategory(double value) const {
+        return std::string(getPluralCategoryName(this->selectPluralCategory(value)));
+    }
+
+    std::string FormatContext::getPluralCategory(long value) const {
+        return std::string(getPluralCategoryName(this->selectPluralCategory(value)));
+    }
+
+} // namespace fluent
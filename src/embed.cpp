@@ -1,11 +1,206 @@
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <sstream>
+#include <string_view>
+#include <vector>
+
+#include "fluent/binary.hpp"
+#include "fluent/compiler.hpp"
+#include "fluent/parser.hpp"
+
+static void writeBytes(std::ostream &output, std::string_view data) {
+    output << "static const unsigned char ftl_data[] = {";
+    for (char c : data) {
+        output << "0x" << std::hex << static_cast<int>(static_cast<unsigned char>(c)) << ",";
+    }
+    output << std::dec << "0};" << std::endl;
+    output << std::endl;
+}
+
+template <class> inline constexpr bool always_false_v = false;
+
+static const std::set<std::string_view> CPP_KEYWORDS = {
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool",
+    "break", "case", "catch", "char", "char16_t", "char32_t", "class", "compl", "const",
+    "const_cast", "constexpr", "continue", "decltype", "default", "delete", "do",
+    "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false",
+    "float", "for", "friend", "goto", "if", "inline", "int", "long", "mutable",
+    "namespace", "new", "noexcept", "not", "not_eq", "nullptr", "operator", "or",
+    "or_eq", "private", "protected", "public", "register", "reinterpret_cast", "return",
+    "short", "signed", "sizeof", "static", "static_assert", "static_cast", "struct",
+    "switch", "template", "this", "thread_local", "throw", "true", "try", "typedef",
+    "typeid", "typename", "union", "unsigned", "using", "virtual", "void", "volatile",
+    "wchar_t", "while", "xor", "xor_eq"};
+
+/// Converts a fluent identifier into a valid C++ identifier
+static std::string toCppIdentifier(std::string_view identifier) {
+    std::string result(identifier);
+    std::replace(result.begin(), result.end(), '-', '_');
+    if (CPP_KEYWORDS.count(result))
+        result += '_';
+    return result;
+}
+
+typedef std::map<std::string, const fluent::ast::Message *> MessageMap;
+
+static void collectVariables(const fluent::ast::Message &message, const MessageMap &messages,
+                             std::set<std::string> &visited,
+                             std::vector<std::string> &variables);
+
+/// Appends the variables used by pattern to variables, in order of first use. Messages
+/// of the same resource referenced by the pattern are followed, as they are formatted
+/// with the same arguments.
+static void collectVariables(const std::vector<fluent::ast::PatternElement> &pattern,
+                             const MessageMap &messages, std::set<std::string> &visited,
+                             std::vector<std::string> &variables) {
+    for (const fluent::ast::PatternElement &element : pattern) {
+        std::visit(
+            [&](const auto &arg) {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, fluent::ast::VariableReference>) {
+                    if (std::find(variables.begin(), variables.end(), arg.identifier) ==
+                        variables.end())
+                        variables.push_back(arg.identifier);
+                } else if constexpr (std::is_same_v<T, fluent::ast::MessageReference>) {
+                    auto message = messages.find(arg.identifier);
+                    if (message != messages.end())
+                        collectVariables(*message->second, messages, visited, variables);
+                } else if constexpr (std::is_same_v<T, fluent::ast::SelectExpression>) {
+                    collectVariables(arg.selector, messages, visited, variables);
+                    for (const auto &variant : arg.variants)
+                        collectVariables(variant.second, messages, visited, variables);
+                } else if constexpr (std::is_same_v<T, std::string> ||
+                                     std::is_same_v<T, fluent::ast::StringLiteral> ||
+                                     std::is_same_v<T, fluent::ast::NumberLiteral> ||
+                                     std::is_same_v<T, fluent::ast::TermReference>) {
+                    // Terms are passed their own arguments, not those of the message
+                } else {
+                    static_assert(always_false_v<T>, "non-exhaustive visitor!");
+                }
+            },
+            element);
+    }
+}
+
+static void collectVariables(const fluent::ast::Message &message, const MessageMap &messages,
+                             std::set<std::string> &visited,
+                             std::vector<std::string> &variables) {
+    if (!visited.insert(message.getId()).second)
+        return;
+    collectVariables(message.getPattern(), messages, visited, variables);
+    for (const fluent::ast::Attribute &attribute : message.getAttributes())
+        collectVariables(attribute.getPattern(), messages, visited, variables);
+}
+
+/**
+ * Writes a header declaring a type for each message of the resource, with a
+ * constructor taking each of the variables the message uses, for use with the
+ * formatStaticMessage overload taking a message type.
+ *
+ * \returns false if two messages have the same name in C++
+ */
+static bool writeCatalog(std::ostream &output, const std::vector<fluent::ast::Entry> &entries,
+                         const std::string &ns, const std::string &source) {
+    MessageMap messages;
+    for (const fluent::ast::Entry &entry : entries) {
+        if (const auto *message = std::get_if<fluent::ast::Message>(&entry))
+            messages.emplace(message->getId(), message);
+    }
+
+    std::string guard = "FLUENT_CATALOG_";
+    for (size_t i = 0; i < ns.size(); i++) {
+        if (ns.compare(i, 2, "::") == 0)
+            i++;
+        guard += std::isalnum(static_cast<unsigned char>(ns[i])) ? std::toupper(ns[i]) : '_';
+    }
+    guard += "_HPP";
+    output << "// Generated by ftlembed from " << source << ". Do not edit." << std::endl;
+    output << "#ifndef " << guard << std::endl;
+    output << "#define " << guard << std::endl << std::endl;
+    output << "#include <fluent/loader.hpp>" << std::endl;
+    output << "#include <string_view>" << std::endl << std::endl;
+    output << "namespace " << ns << " {" << std::endl;
+
+    std::set<std::string> typeNames;
+    for (const fluent::ast::Entry &entry : entries) {
+        const auto *message = std::get_if<fluent::ast::Message>(&entry);
+        if (!message)
+            continue;
+        std::string type = toCppIdentifier(message->getId());
+        if (!typeNames.insert(type).second) {
+            std::cerr << source << ": more than one message is named " << type << " in C++"
+                      << std::endl;
+            return false;
+        }
+
+        std::set<std::string> visited;
+        std::vector<std::string> variables;
+        collectVariables(*message, messages, visited, variables);
+        // Fields must not clash with the type or its other members
+        std::set<std::string> members = {type, "identifier", "getArgs"};
+        std::vector<std::string> fields;
+        for (const std::string &variable : variables) {
+            std::string field = toCppIdentifier(variable);
+            while (!members.insert(field).second)
+                field = "arg_" + field;
+            fields.push_back(field);
+        }
+
+        output << "    struct " << type << " {" << std::endl;
+        output << "        static constexpr std::string_view identifier = \""
+               << message->getId() << "\";" << std::endl;
+        for (const std::string &field : fields)
+            output << "        fluent::VariableView " << field << ";" << std::endl;
+        if (!fields.empty()) {
+            output << std::endl << "        explicit " << type << "(";
+            for (size_t i = 0; i < fields.size(); i++)
+                output << (i ? ", " : "") << "fluent::VariableView " << fields[i];
+            output << ")" << std::endl << "            : ";
+            for (size_t i = 0; i < fields.size(); i++)
+                output << (i ? ", " : "") << fields[i] << "(" << fields[i] << ")";
+            output << " {}" << std::endl;
+        }
+        output << std::endl << "        fluent::FluentArgs getArgs() const { return {";
+        for (size_t i = 0; i < fields.size(); i++)
+            output << (i ? ", " : "") << "{\"" << variables[i] << "\", this->" << fields[i]
+                   << "}";
+        output << "}; }" << std::endl;
+        output << "    };" << std::endl << std::endl;
+    }
+    output << "} // namespace " << ns << std::endl << std::endl;
+    output << "#endif" << std::endl;
+    return true;
+}
 
 int main(int argc, char **argv) {
+    bool binary = argc > 1 && std::string_view(argv[1]) == "--binary";
+    if (binary) {
+        argc--;
+        argv++;
+    }
+    // Writes the image itself rather than a source file, so that it can be mapped with
+    // FluentLoader::addCompiledResource
+    bool compiled = !binary && argc > 1 && std::string_view(argv[1]) == "--compiled";
+    if (compiled) {
+        argc--;
+        argv++;
+    }
+    std::optional<std::string> catalog;
+    if (!binary && !compiled && argc > 2 && std::string_view(argv[1]) == "--catalog") {
+        catalog = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
     if (argc < 3) {
-        std::cerr << "usage: " << argv[0] << "<filename.ftl> <out.cpp>" << std::endl;
+        std::cerr << "usage: " << argv[0]
+                  << " [--binary | --catalog <namespace>] <filename.ftl> <out.cpp>"
+                  << std::endl
+                  << "       " << argv[0] << " --compiled <filename.ftl> <out.ftlc>"
+                  << std::endl;
         return 2;
     }
 
@@ -14,25 +209,43 @@ int main(int argc, char **argv) {
     std::string localeName =
         std::filesystem::path(argv[1]).parent_path().stem().string();
 
-    std::ifstream input(argv[1], std::ifstream::in);
+    if (compiled) {
+        std::string image = fluent::serializeCompiledResource(
+            fluent::parseFile(argv[1]), icu::Locale(localeName.c_str()));
+        std::ofstream output(argv[2], std::ofstream::out | std::ofstream::binary);
+        output.write(image.data(), static_cast<std::streamsize>(image.size()));
+        return output ? 0 : 1;
+    }
+
     std::ofstream output(argv[2], std::ofstream::out);
 
+    if (catalog) {
+        std::string source = std::filesystem::path(argv[1]).filename().string();
+        return writeCatalog(output, fluent::parseFile(argv[1]), *catalog, source) ? 0 : 1;
+    }
+
     output << "#include <fluent/loader.hpp>" << std::endl;
     output << "#include <unicode/locid.h>" << std::endl;
 
-    output << "static char ftl_data[] = {";
-
-    char c = input.get();
-    while (input.good()) {
-        output << "0x" << std::hex << (int)c << ",";
-        c = input.get();
+    if (binary) {
+        // Parse the resource now, so that only the precompiled image is embedded and
+        // nothing needs to be parsed at startup
+        std::string image = fluent::serializeResource(fluent::parseFile(argv[1]));
+        writeBytes(output, image);
+        output << "static bool _ = [](){ fluent::addStaticBinaryResource(icu::Locale(\""
+               << localeName << "\"), std::string_view(reinterpret_cast<const char *>"
+               << "(ftl_data), " << image.size() << ")); return true; }();" << std::endl;
+    } else {
+        std::ifstream input(argv[1], std::ifstream::in);
+        std::string contents((std::istreambuf_iterator<char>(input)),
+                             std::istreambuf_iterator<char>());
+        writeBytes(output, contents);
+        output << "static bool _ = [](){ fluent::addStaticResource(icu::Locale(\""
+               << localeName << "\"), std::string(reinterpret_cast<const char *>"
+               << "(ftl_data), " << contents.size() << ")); return true; }();"
+               << std::endl;
+        input.close();
     }
-    output << 0 << "};" << std::endl;
-    output << std::endl;
-    output << "static bool _ = [](){ fluent::addStaticResource(icu::Locale(\""
-           << localeName << "\"), std::string(ftl_data)); return true; }();"
-           << std::endl;
 
-    input.close();
     output.close();
 }
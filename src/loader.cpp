@@ -18,8 +18,19 @@
  */
 
 #include "fluent/loader.hpp"
+#include "fluent/binary.hpp"
+#include "fluent/mapped_file.hpp"
 #include "fluent/parser.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <map>
+#include <thread>
+
 using recursive_directory_iterator = std::filesystem::recursive_directory_iterator;
 using directory_entry = std::filesystem::recursive_directory_iterator;
 using std::function;
@@ -30,158 +41,1626 @@ using std::filesystem::path;
 namespace fluent {
     template <class> inline constexpr bool always_false_v = false;
 
+    /**
+     * Rendered messages which do not depend on their arguments, indexed by MessageId and
+     * keyed by the fallback chain and attribute they were formatted with.
+     *
+     * Entries are only ever added, with a compare-and-swap onto a per-message list, so
+     * lookups and insertions never lock. The cache belongs to a single State, which
+     * makes invalidation implicit: any change to the loader publishes a new State,
+     * starting with an empty cache.
+     */
+    class RenderCache {
+    public:
+        struct Node {
+            /// The locales of the fallback chain which have a bundle
+            std::vector<LocaleId> chain;
+            optional<string> attribute;
+            /// The rendered message, or empty if the message depends on its arguments
+            optional<string> value;
+            Node *next = nullptr;
+        };
+
+    private:
+        static constexpr size_t CHUNK_SIZE = 64;
+        typedef std::array<std::atomic<Node *>, CHUNK_SIZE> Chunk;
+
+        // The per-message lists, in chunks which are allocated when a message in the
+        // chunk is first inserted, so that publishing a State stays cheap
+        std::unique_ptr<std::atomic<Chunk *>[]> chunks;
+        size_t size = 0;
+
+        static bool matches(const Node &node, const std::vector<LocaleId> &chain,
+                            const string *attribute) {
+            if (attribute ? !node.attribute || *node.attribute != *attribute : node.attribute.has_value())
+                return false;
+            return std::equal(node.chain.begin(), node.chain.end(), chain.begin(), chain.end());
+        }
+
+        size_t chunkCount() const { return (this->size + CHUNK_SIZE - 1) / CHUNK_SIZE; }
+
+    public:
+        RenderCache() = default;
+        // Copies of a State start out with an empty cache
+        RenderCache(const RenderCache &) {}
+        RenderCache &operator=(const RenderCache &) = delete;
+
+        ~RenderCache() {
+            for (size_t index = 0; index < this->chunkCount(); index++) {
+                Chunk *chunk = this->chunks[index].load(std::memory_order_relaxed);
+                if (!chunk)
+                    continue;
+                for (std::atomic<Node *> &slot : *chunk) {
+                    Node *node = slot.load(std::memory_order_relaxed);
+                    while (node) {
+                        Node *next = node->next;
+                        delete node;
+                        node = next;
+                    }
+                }
+                delete chunk;
+            }
+        }
+
+        /// Makes room for messages with ids below size. Must be called before the
+        /// cache is shared with readers.
+        void reserve(size_t size) {
+            this->size = size;
+            this->chunks.reset(new std::atomic<Chunk *>[this->chunkCount()]);
+            for (size_t index = 0; index < this->chunkCount(); index++)
+                this->chunks[index].store(nullptr, std::memory_order_relaxed);
+        }
+
+        const Node *find(MessageId id, const std::vector<LocaleId> &chain,
+                         const string *attribute) const {
+            if (id.index >= this->size)
+                return nullptr;
+            const Chunk *chunk =
+                this->chunks[id.index / CHUNK_SIZE].load(std::memory_order_acquire);
+            if (!chunk)
+                return nullptr;
+            const std::atomic<Node *> &slot = (*chunk)[id.index % CHUNK_SIZE];
+            for (const Node *node = slot.load(std::memory_order_acquire); node;
+                 node = node->next) {
+                if (matches(*node, chain, attribute))
+                    return node;
+            }
+            return nullptr;
+        }
+
+        /// Adds a node to the cache, returning it. If the id is out of range the node
+        /// cannot be cached, and nullptr is returned.
+        const Node *insert(MessageId id, std::unique_ptr<Node> node) const {
+            if (id.index >= this->size)
+                return nullptr;
+            std::atomic<Chunk *> &chunkSlot = this->chunks[id.index / CHUNK_SIZE];
+            Chunk *chunk = chunkSlot.load(std::memory_order_acquire);
+            if (!chunk) {
+                std::unique_ptr<Chunk> created(new Chunk());
+                for (std::atomic<Node *> &slot : *created)
+                    slot.store(nullptr, std::memory_order_relaxed);
+                // Another thread may have allocated the chunk first, in which case
+                // chunk is set to its chunk and ours is discarded
+                if (chunkSlot.compare_exchange_strong(chunk, created.get(),
+                                                      std::memory_order_acq_rel,
+                                                      std::memory_order_acquire))
+                    chunk = created.release();
+            }
+            std::atomic<Node *> &slot = (*chunk)[id.index % CHUNK_SIZE];
+            node->next = slot.load(std::memory_order_relaxed);
+            while (!slot.compare_exchange_weak(node->next, node.get(), std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+            }
+            return node.release();
+        }
+    };
+
+    struct FluentLoader::State {
+        /// Interned identifiers of all messages, terms and locales known to the loader
+        SymbolTable<MessageId> messageIds;
+        SymbolTable<TermId> termIds;
+        SymbolTable<LocaleId> localeIds;
+        /// Bundles indexed by LocaleId
+        std::vector<std::shared_ptr<const FluentBundle>> bundles;
+        /// Terms shared between the bundles, or nullptr unless enabled by
+        /// setShareTerms. Copies of the state share the pool.
+        std::shared_ptr<TermPool> termPool;
+        /// Whether bundles are compiled when they are created. Set by compile.
+        bool compiled = false;
+        /// Whether resources loaded from now on are parsed lazily. Set by setLazyParsing.
+        bool lazy = false;
+        /// Whether comments attached to messages are kept. Set by setKeepComments.
+        bool keepComments = true;
+        /// How entries already defined for a locale are handled. Set by
+        /// setConflictPolicy.
+        ConflictPolicy conflictPolicy = ConflictPolicy::FirstWins;
+        /// Set by setFormatLimits
+        FormatLimits formatLimits;
+        /// Rendered argument-independent messages
+        RenderCache cache;
+        /// Set by setObserver
+        std::shared_ptr<FluentObserver> observer;
+
+        /// Returns the bundle for the given locale, or nullptr if there is none
+        const FluentBundle *getBundle(const icu::Locale &locId) const;
+
+        /// The options with which resources are parsed before being added
+        ParseOptions getParseOptions() const;
+
+        bool formatMessageTo(OutputSink &out, const ResolvedChain &chain,
+                             MessageId id, const string *attribute,
+                             const FluentArgs &args) const;
+
+        /// Formats a message without using the cache
+        bool renderMessageTo(OutputSink &out, const ResolvedChain &chain,
+                             MessageId id, const string *attribute,
+                             const FluentArgs &args) const;
+
+        /// Returns the cache node for the message, rendering it first if it has not
+        /// been cached. Returns nullptr if the message or attribute doesn't exist, or if
+        /// it cannot be cached.
+        const RenderCache::Node *getCachedRender(const ResolvedChain &chain,
+                                                 MessageId id, const string *attribute) const;
+
+        /// Whether formatting the pattern with this fallback chain may depend on the
+        /// arguments passed, either directly or through the messages and terms it
+        /// references
+        bool usesArguments(const ResolvedChain &chain,
+                           const std::vector<ast::PatternElement> &pattern,
+                           size_t depth = 0) const;
+
+        bool formatCompiledMessageTo(OutputSink &out,
+                                     const ResolvedChain &chain,
+                                     MessageId id, const string *attribute,
+                                     const FluentArgs &args) const;
+    };
+
+    /// Marks an id which is not in any bundle of a ResolvedChain
+    static constexpr uint32_t NOT_IN_CHAIN = std::numeric_limits<uint32_t>::max();
+
+    struct FluentLoader::ResolvedChain {
+        /// The snapshot the chain was resolved against, which owns its bundles
+        std::shared_ptr<const State> state;
+        /// The locales of the chain which have a bundle, in order, and their bundles
+        std::vector<LocaleId> localeIds;
+        std::vector<const FluentBundle *> bundles;
+        /// The index of each bundle's locale in the original fallback chain
+        std::vector<uint32_t> positions;
+        /// For each message and term id, one more than the index of the first bundle
+        /// containing it, NOT_IN_CHAIN, or 0 if it has not been looked up yet. Only
+        /// allocated for chains which are kept by a LocaleChain.
+        std::unique_ptr<std::atomic<uint32_t>[]> messageOwners;
+        std::unique_ptr<std::atomic<uint32_t>[]> termOwners;
+
+        ResolvedChain(std::shared_ptr<const State> state,
+                      const std::vector<icu::Locale> &locIdFallback, bool memoize);
+
+        /// Finds the first bundle in the chain containing the message.
+        /// Returns the message and the bundle it was found in, both of which are
+        /// non-owning, or a pair of nullptrs if the message was not found.
+        std::pair<const ast::Message *, const FluentBundle *> getMessage(MessageId id) const;
+
+        const ast::Term *getTerm(TermId id) const;
+
+        /// As getMessage, but looks up the compiled form, which is all that messages
+        /// added from a compiled image have. Used once the loader is compiled, when
+        /// every other message has a compiled form too.
+        std::pair<const CompiledMessage *, const FluentBundle *>
+        getCompiledMessage(MessageId id) const;
+
+        const CompiledMessage *getCompiledTerm(TermId id) const;
+
+        /// The bundle formatting the message starts in, or nullptr if the message is
+        /// not in the chain
+        const FluentBundle *findBundle(MessageId id) const {
+            return this->state->compiled ? this->getCompiledMessage(id).second
+                                         : this->getMessage(id).second;
+        }
+
+        /// Resolves compiled messages and terms through the chain
+        class FallbackResolver;
+    };
+
+    static std::unique_ptr<std::atomic<uint32_t>[]> makeOwners(size_t size) {
+        std::unique_ptr<std::atomic<uint32_t>[]> owners(new std::atomic<uint32_t>[size]);
+        for (size_t index = 0; index < size; index++)
+            owners[index].store(0, std::memory_order_relaxed);
+        return owners;
+    }
+
+    FluentLoader::ResolvedChain::ResolvedChain(std::shared_ptr<const State> state,
+                                               const std::vector<icu::Locale> &locIdFallback,
+                                               bool memoize)
+        : state(std::move(state)) {
+        for (size_t index = 0; index < locIdFallback.size(); index++) {
+            std::optional<LocaleId> id =
+                this->state->localeIds.find(locIdFallback[index].getName());
+            if (id && this->state->bundles[id->index]) {
+                this->localeIds.push_back(*id);
+                this->bundles.push_back(this->state->bundles[id->index].get());
+                this->positions.push_back(static_cast<uint32_t>(index));
+            }
+        }
+        if (memoize) {
+            this->messageOwners = makeOwners(this->state->messageIds.size());
+            this->termOwners = makeOwners(this->state->termIds.size());
+        }
+    }
+
+    /// Looks up an id in each bundle of the chain in turn, recording which bundle it
+    /// was found in, if owners is non-null. Different threads may race to record the
+    /// owner of an id, but always record the same value.
+    template <typename T, typename Id, typename Get>
+    static std::pair<const T *, const FluentBundle *>
+    findInChain(const std::vector<const FluentBundle *> &bundles,
+                std::atomic<uint32_t> *owners, size_t count, Id id, Get get) {
+        std::atomic<uint32_t> *owner =
+            owners && id.index < count ? &owners[id.index] : nullptr;
+        if (owner) {
+            uint32_t index = owner->load(std::memory_order_relaxed);
+            if (index == NOT_IN_CHAIN)
+                return std::make_pair(nullptr, nullptr);
+            if (index != 0) {
+                const FluentBundle *bundle = bundles[index - 1];
+                return std::make_pair(get(*bundle), bundle);
+            }
+        }
+        for (size_t index = 0; index < bundles.size(); index++) {
+            const T *value = get(*bundles[index]);
+            if (value) {
+                if (owner)
+                    owner->store(index + 1, std::memory_order_relaxed);
+                return std::make_pair(value, bundles[index]);
+            }
+        }
+        if (owner)
+            owner->store(NOT_IN_CHAIN, std::memory_order_relaxed);
+        return std::make_pair(nullptr, nullptr);
+    }
+
+    std::pair<const ast::Message *, const FluentBundle *>
+    FluentLoader::ResolvedChain::getMessage(MessageId id) const {
+        return findInChain<ast::Message>(
+            this->bundles, this->messageOwners.get(), this->state->messageIds.size(), id,
+            [&](const FluentBundle &bundle) { return bundle.getMessage(id); });
+    }
+
+    const ast::Term *FluentLoader::ResolvedChain::getTerm(TermId id) const {
+        return findInChain<ast::Term>(
+                   this->bundles, this->termOwners.get(), this->state->termIds.size(), id,
+                   [&](const FluentBundle &bundle) { return bundle.getTerm(id); })
+            .first;
+    }
+
+    std::pair<const CompiledMessage *, const FluentBundle *>
+    FluentLoader::ResolvedChain::getCompiledMessage(MessageId id) const {
+        return findInChain<CompiledMessage>(
+            this->bundles, this->messageOwners.get(), this->state->messageIds.size(), id,
+            [&](const FluentBundle &bundle) { return bundle.getCompiledMessage(id); });
+    }
+
+    const CompiledMessage *
+    FluentLoader::ResolvedChain::getCompiledTerm(TermId id) const {
+        return findInChain<CompiledMessage>(
+                   this->bundles, this->termOwners.get(), this->state->termIds.size(), id,
+                   [&](const FluentBundle &bundle) { return bundle.getCompiledTerm(id); })
+            .first;
+    }
+
+    /// Resolves compiled messages and terms through a locale fallback chain
+    class FluentLoader::ResolvedChain::FallbackResolver : public CompiledResolver {
+    private:
+        const ResolvedChain &chain;
+
+    public:
+        FallbackResolver(const ResolvedChain &chain) : chain(chain) {}
+
+        const CompiledMessage *getMessage(MessageId id) const override {
+            return this->chain.getCompiledMessage(id).first;
+        }
+
+        const CompiledMessage *getTerm(TermId id) const override {
+            return this->chain.getCompiledTerm(id);
+        }
+    };
+
+    /// A resource whose entries have been located, but will only be parsed when used
+    struct LazyResource {
+        /// Owns the memory the spans point into
+        std::shared_ptr<const void> source;
+        std::vector<EntrySpan> spans;
+    };
+
+    /// A compiled image, whose messages are formatted from it in place
+    struct CompiledResource {
+        /// Owns the memory of the image
+        std::shared_ptr<const void> owner;
+        std::string_view image;
+    };
+
+    /// The contents of a resource, either fully parsed, to be parsed lazily, or
+    /// compiled
+    typedef std::variant<std::vector<ast::Entry>, LazyResource, CompiledResource>
+        ResourceContents;
+
+    static ResourceContents scanLazily(std::string &&contents) {
+        auto source = std::make_shared<const std::string>(std::move(contents));
+        return LazyResource{source, scanResource(*source)};
+    }
+
+    /// The file stays mapped for as long as any of its entries is in use
+    static ResourceContents scanLazily(MappedFile &&file) {
+        auto source = std::make_shared<const MappedFile>(std::move(file));
+        return LazyResource{source, scanResource(source->getContents())};
+    }
+
+    /// The messages and terms which were added to a bundle from a single resource
+    struct ResourceIds {
+        std::vector<MessageId> messages;
+        std::vector<TermId> terms;
+    };
+
+    class FluentLoader::Writer {
+    private:
+        FluentLoader &loader;
+        std::lock_guard<std::mutex> lock;
+        std::shared_ptr<State> next;
+        // Bundles which have already been copied by this writer, indexed by LocaleId.
+        // These are not visible to readers yet, so may be modified in place.
+        std::vector<std::shared_ptr<FluentBundle>> owned;
+
+    public:
+        explicit Writer(FluentLoader &loader)
+            : loader(loader), lock(loader.writeMutex),
+              next(std::make_shared<State>(*loader.snapshot())) {}
+
+        State &getState() { return *this->next; }
+
+        /// Returns a modifiable copy of the bundle with the given id
+        FluentBundle &getBundle(LocaleId id) {
+            if (id.index >= this->owned.size())
+                this->owned.resize(id.index + 1);
+            if (!this->owned[id.index]) {
+                this->owned[id.index] =
+                    std::make_shared<FluentBundle>(*this->next->bundles[id.index]);
+                this->next->bundles[id.index] = this->owned[id.index];
+            }
+            return *this->owned[id.index];
+        }
+
+        /// Returns a modifiable copy of the bundle for the given locale, creating it
+        /// if necessary
+        FluentBundle &getOrCreateBundle(const icu::Locale &locId) {
+            LocaleId id = this->next->localeIds.intern(locId.getName());
+            if (id.index < this->next->bundles.size())
+                return this->getBundle(id);
+            auto bundle = std::make_shared<FluentBundle>(locId);
+            if (this->next->compiled)
+                bundle->compile(this->next->messageIds, this->next->termIds);
+            this->next->bundles.push_back(bundle);
+            this->owned.resize(id.index + 1);
+            this->owned[id.index] = std::move(bundle);
+            return *this->owned[id.index];
+        }
+
+        /// Compiles every bundle, and those created from here on
+        void compile() {
+            for (uint32_t index = 0; index < this->next->bundles.size(); index++) {
+                this->getBundle(LocaleId(index))
+                    .compile(this->next->messageIds, this->next->termIds);
+            }
+            this->next->compiled = true;
+        }
+
+        /// Merges the entries of a resource into the bundle for the given locale. If ids
+        /// is given, the ids of the messages and terms which were added are appended to
+        /// it.
+        void addEntries(const icu::Locale &locId, ResourceContents &&entries,
+                        ResourceIds *ids = nullptr, const string &source = string());
+
+        /// Replaces the messages and terms ids previously added from a resource with
+        /// the given entries
+        void replaceEntries(const icu::Locale &locId, ResourceIds &ids,
+                            ResourceContents &&entries, const string &source);
+
+        /// Reports a resource to the observer, if there is one
+        void notify(const ResourceEvent &event) const {
+#ifndef FLUENT_NO_INSTRUMENTATION
+            if (this->next->observer)
+                this->next->observer->onResourceLoaded(event);
+#else
+            (void)event;
+#endif
+        }
+
+        /// Makes the new state visible to readers. The writer must not be used
+        /// afterwards.
+        void publish() {
+            this->next->cache.reserve(this->next->messageIds.size());
+            std::atomic_store(&this->loader.state,
+                              std::shared_ptr<const State>(std::move(this->next)));
+        }
+    };
+
+    /// A resource file loaded by addDirectory
+    struct WatchedFile {
+        icu::Locale locale;
+        std::filesystem::file_time_type modified;
+        std::uintmax_t size;
+        ResourceIds ids;
+    };
+
+    /// A resource file which has been parsed, but not yet added to a bundle
+    struct ParsedResource {
+        path file;
+        icu::Locale locale;
+        std::filesystem::file_time_type modified;
+        std::uintmax_t size;
+        ResourceContents contents;
+    };
+
+    struct FluentLoader::Watcher {
+        /// Directories passed to addDirectory, and the resources filter used, if any.
+        /// These and files are only modified with both the writer lock and mutex held,
+        /// so either is enough to read them.
+        std::vector<std::pair<string, optional<std::set<string>>>> directories;
+        std::map<path, WatchedFile> files;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool stopping = false;
+
+        void addDirectory(const string &dir, const std::set<string> *resources);
+        void addResource(Writer &writer, ParsedResource &&resource,
+                         std::map<path, WatchedFile> &files);
+        /// Whether any file has been added to, changed in or removed from the watched
+        /// directories since it was last loaded
+        bool hasChanges() const;
+        size_t reload(Writer &writer);
+    };
+
+    static bool isModified(const path &file, const WatchedFile &watched) {
+        return watched.modified != std::filesystem::last_write_time(file) ||
+               watched.size != std::filesystem::file_size(file);
+    }
+
+    /// Lists the ftl files within dir, sorted so that they are always loaded in the
+    /// same order. If resources is given, only files with a matching name are listed.
+    static std::vector<path> findResources(const string &dir,
+                                           const std::set<string> *resources) {
+        std::vector<path> files;
+        for (const auto &dirEntry : recursive_directory_iterator(dir)) {
+            if (dirEntry.is_regular_file()) {
+                path file = dirEntry.path();
+                if (file.extension() == ".ftl" &&
+                    (!resources || resources->find(file.stem().string()) != resources->end()))
+                    files.push_back(std::move(file));
+            }
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    static ParsedResource parseResource(const path &file, bool lazy, const ParseOptions &options) {
+        // The file is checked before being parsed, so that a change made while it is
+        // being parsed will be picked up by the next reload
+        std::filesystem::file_time_type modified = std::filesystem::last_write_time(file);
+        std::uintmax_t size = std::filesystem::file_size(file);
+        ResourceContents contents;
+        if (lazy)
+            contents = scanLazily(MappedFile(file));
+        else
+            contents = parseFile(file, options);
+        return ParsedResource{file,
+                              icu::Locale(file.parent_path().stem().string().c_str()),
+                              modified, size, std::move(contents)};
+    }
+
+    void FluentLoader::Watcher::addDirectory(const string &dir,
+                                             const std::set<string> *resources) {
+        optional<std::set<string>> filter;
+        if (resources)
+            filter = *resources;
+        for (const auto &directory : this->directories) {
+            if (directory.first == dir && directory.second == filter)
+                return;
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->directories.emplace_back(dir, std::move(filter));
+    }
+
+    void FluentLoader::Watcher::addResource(Writer &writer, ParsedResource &&resource,
+                                            std::map<path, WatchedFile> &files) {
+        if (files.find(resource.file) != files.end())
+            return;
+        WatchedFile file{resource.locale, resource.modified, resource.size, {}};
+        writer.addEntries(resource.locale, std::move(resource.contents), &file.ids,
+                          resource.file.string());
+        std::lock_guard<std::mutex> lock(this->mutex);
+        files.emplace(std::move(resource.file), std::move(file));
+    }
+
+    bool FluentLoader::Watcher::hasChanges() const {
+        std::set<path> seen;
+        for (const auto &[dir, resources] : this->directories) {
+            for (const path &file : findResources(dir, resources ? &*resources : nullptr)) {
+                auto watched = this->files.find(file);
+                if (watched == this->files.end() || isModified(file, watched->second))
+                    return true;
+                seen.insert(file);
+            }
+        }
+        return seen.size() != this->files.size();
+    }
+
+    size_t FluentLoader::Watcher::reload(Writer &writer) {
+        // Changes are made to a copy, so that nothing is recorded as reloaded if
+        // parsing a file throws
+        std::map<path, WatchedFile> next = this->files;
+        const State &state = writer.getState();
+        std::set<path> seen;
+        size_t changes = 0;
+        for (const auto &[dir, resources] : this->directories) {
+            for (const path &file : findResources(dir, resources ? &*resources : nullptr)) {
+                seen.insert(file);
+                auto watched = next.find(file);
+                if (watched == next.end()) {
+                    this->addResource(
+                        writer, parseResource(file, state.lazy, state.getParseOptions()), next);
+                    changes++;
+                } else if (isModified(file, watched->second)) {
+                    ParsedResource resource =
+                        parseResource(file, state.lazy, state.getParseOptions());
+                    watched->second.modified = resource.modified;
+                    watched->second.size = resource.size;
+                    writer.replaceEntries(watched->second.locale, watched->second.ids,
+                                          std::move(resource.contents), file.string());
+                    changes++;
+                }
+            }
+        }
+        for (auto watched = next.begin(); watched != next.end();) {
+            if (seen.find(watched->first) == seen.end()) {
+                writer.replaceEntries(watched->second.locale, watched->second.ids,
+                                      std::vector<ast::Entry>(), watched->first.string());
+                watched = next.erase(watched);
+                changes++;
+            } else {
+                ++watched;
+            }
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->files = std::move(next);
+        return changes;
+    }
+
+    FluentLoader::FluentLoader()
+        : state(std::make_shared<const State>()), watcher(std::make_unique<Watcher>()) {}
+
+    FluentLoader::~FluentLoader() { this->stopWatching(); }
+
+    std::shared_ptr<const FluentLoader::State> FluentLoader::snapshot() const {
+        return std::atomic_load(&this->state);
+    }
+
     void FluentLoader::addResource(const icu::Locale locId, const path &ftlpath) {
-        std::vector<ast::Entry> entries = parseFile(ftlpath);
-        this->addResource(locId, std::move(entries));
+        std::shared_ptr<const State> state = this->snapshot();
+        ResourceContents contents;
+        if (state->lazy)
+            contents = scanLazily(MappedFile(ftlpath));
+        else
+            contents = parseFile(ftlpath, state->getParseOptions());
+        Writer writer(*this);
+        writer.addEntries(locId, std::move(contents), nullptr, ftlpath.string());
+        writer.publish();
     }
 
     void FluentLoader::addResource(const icu::Locale locId, std::string &&input) {
-        std::vector<ast::Entry> entries = parse(std::move(input));
+        std::shared_ptr<const State> state = this->snapshot();
+        if (state->lazy) {
+            Writer writer(*this);
+            writer.addEntries(locId, scanLazily(std::move(input)));
+            writer.publish();
+            return;
+        }
+        std::vector<ast::Entry> entries = parse(std::move(input), state->getParseOptions());
+        this->addResource(locId, std::move(entries));
+    }
+
+    void FluentLoader::addResource(const icu::Locale locId, std::istream &input) {
+        static constexpr size_t CHUNK_SIZE = 64 * 1024;
+        std::vector<ast::Entry> entries;
+        StreamParser parser([&](ast::Entry &&entry) { entries.push_back(std::move(entry)); },
+                            this->snapshot()->getParseOptions());
+        std::string chunk(CHUNK_SIZE, '\0');
+        while (input) {
+            input.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            parser.feed(std::string_view(chunk.data(), static_cast<size_t>(input.gcount())));
+        }
+        if (input.bad())
+            throw std::runtime_error("Failed to read resource for locale " +
+                                     string(locId.getName()));
+        parser.finish();
         this->addResource(locId, std::move(entries));
     }
 
+    const FluentBundle *FluentLoader::State::getBundle(const icu::Locale &locId) const {
+        std::optional<LocaleId> id = this->localeIds.find(locId.getName());
+        if (id)
+            return this->bundles[id->index].get();
+        return nullptr;
+    }
+
+    ParseOptions FluentLoader::State::getParseOptions() const {
+        ParseOptions options;
+        options.keepComments = this->keepComments;
+        // Junk is only ever counted for the observer
+    #ifndef FLUENT_NO_INSTRUMENTATION
+        options.keepJunk = this->observer != nullptr;
+    #else
+        options.keepJunk = false;
+    #endif
+        return options;
+    }
+
     void FluentLoader::addResource(const icu::Locale locId,
                                 std::vector<ast::Entry> &&entries) {
-        // FIXME: Handle bundle already existing for this resource by merging with
-        // existing bundle
-        FluentBundle bundle;
-        for (ast::Entry entry : entries) {
+        Writer writer(*this);
+        writer.addEntries(locId, std::move(entries));
+        writer.publish();
+    }
+
+    /// Counts a message or term passed to FluentBundle::addMessage or addTerm
+    template <typename Id>
+    static void countEntry(bool added, Id id, std::vector<Id> *ids, size_t &count,
+                           ResourceEvent &event) {
+        if (added) {
+            count++;
+            if (ids)
+                ids->push_back(id);
+        } else {
+            event.rejected++;
+        }
+    }
+
+    /// Applies policy before adding an entry with the given id to bundle: an existing
+    /// entry is removed if the new one replaces it.
+    /// \throws std::runtime_error if there is an existing entry and policy is Error
+    template <typename Id>
+    static void resolveConflict(FluentBundle &bundle, Id id, std::string_view identifier,
+                                std::string_view locale, ConflictPolicy policy) {
+        constexpr bool isMessage = std::is_same_v<Id, MessageId>;
+        bool exists;
+        if constexpr (isMessage)
+            exists = bundle.hasMessage(id);
+        else
+            exists = bundle.hasTerm(id);
+        if (!exists || policy == ConflictPolicy::FirstWins)
+            return;
+        if (policy == ConflictPolicy::Error)
+            throw std::runtime_error(string(isMessage ? "Message " : "Term -") +
+                                     string(identifier) + " is already defined for locale " +
+                                     string(locale));
+        if constexpr (isMessage)
+            bundle.removeMessage(id);
+        else
+            bundle.removeTerm(id);
+    }
+
+    /// Adds entries to a bundle, recording the ids of those which were added, and
+    /// counting them in event
+    static void insertEntries(FluentBundle &bundle, std::vector<ast::Entry> &&entries,
+                              SymbolTable<MessageId> &messageIds,
+                              SymbolTable<TermId> &termIds, TermPool *termPool,
+                              ResourceIds *ids, ResourceEvent &event, bool keepComments,
+                              ConflictPolicy policy) {
+        for (ast::Entry &entry : entries) {
             std::visit(
-                [&bundle](auto &&arg) {
+                [&](auto &&arg) {
                     using T = std::decay_t<decltype(arg)>;
-                    if constexpr (std::is_same_v<T, ast::Message>)
-                        bundle.addMessage(std::move(arg));
-                    else if constexpr (std::is_same_v<T, ast::Term>)
-                        bundle.addTerm(std::move(arg));
-                    else if constexpr (std::is_same_v<T, ast::AnyComment>) {
+                    if constexpr (std::is_same_v<T, ast::Message> ||
+                                  std::is_same_v<T, ast::Term>) {
+                        arg.compact(keepComments);
+                    }
+                    if constexpr (std::is_same_v<T, ast::Message>) {
+                        MessageId id = messageIds.intern(arg.getId());
+                        resolveConflict(bundle, id, arg.getId(), event.locale, policy);
+                        countEntry(bundle.addMessage(id, std::move(arg), messageIds, termIds),
+                                   id, ids ? &ids->messages : nullptr, event.messages, event);
+                    } else if constexpr (std::is_same_v<T, ast::Term>) {
+                        TermId id = termIds.intern(arg.getId());
+                        resolveConflict(bundle, id, arg.getId(), event.locale, policy);
+                        bool added;
+                        if (termPool)
+                            added = bundle.addTerm(id, termPool->intern(std::move(arg)),
+                                                   messageIds, termIds);
+                        else
+                            added =
+                                bundle.addTerm(id, std::move(arg), messageIds, termIds);
+                        countEntry(added, id, ids ? &ids->terms : nullptr, event.terms,
+                                   event);
+                    } else if constexpr (std::is_same_v<T, ast::AnyComment>) {
                     } else if constexpr (std::is_same_v<T, ast::Junk>) {
+                        event.junk++;
                     } else {
                         static_assert(always_false_v<T>, "non-exhaustive visitor!");
                     }
                 },
                 std::move(entry));
         }
-        this->bundles.insert(std::make_pair(string(locId.getName()), bundle));
+    }
+
+    static void insertEntries(FluentBundle &bundle, LazyResource &&resource,
+                              SymbolTable<MessageId> &messageIds,
+                              SymbolTable<TermId> &termIds, TermPool *,
+                              ResourceIds *ids, ResourceEvent &event, bool keepComments,
+                              ConflictPolicy policy) {
+        for (const EntrySpan &span : resource.spans) {
+            if (span.kind == EntrySpan::Kind::Message) {
+                MessageId id = messageIds.intern(span.identifier);
+                resolveConflict(bundle, id, span.identifier, event.locale, policy);
+                auto message = std::make_shared<const LazyEntry<ast::Message>>(
+                    resource.source, span.source, keepComments);
+                countEntry(bundle.addLazyMessage(id, std::move(message), messageIds, termIds),
+                           id, ids ? &ids->messages : nullptr, event.messages, event);
+            } else {
+                TermId id = termIds.intern(span.identifier);
+                resolveConflict(bundle, id, span.identifier, event.locale, policy);
+                auto term = std::make_shared<const LazyEntry<ast::Term>>(
+                    resource.source, span.source, keepComments);
+                countEntry(bundle.addLazyTerm(id, std::move(term), messageIds, termIds), id,
+                           ids ? &ids->terms : nullptr, event.terms, event);
+            }
+        }
+    }
+
+    static void insertEntries(FluentBundle &bundle, CompiledResource &&resource,
+                              SymbolTable<MessageId> &messageIds,
+                              SymbolTable<TermId> &termIds, TermPool *,
+                              ResourceIds *ids, ResourceEvent &event, bool,
+                              ConflictPolicy policy) {
+        std::vector<CompiledEntry> entries =
+            loadCompiledResource(std::move(resource.owner), resource.image,
+                                 bundle.getContext(), messageIds, termIds);
+        for (CompiledEntry &entry : entries) {
+            if (entry.isTerm) {
+                TermId id = termIds.intern(entry.identifier);
+                resolveConflict(bundle, id, entry.identifier, event.locale, policy);
+                countEntry(bundle.addCompiledTerm(id, std::move(entry.message)), id,
+                           ids ? &ids->terms : nullptr, event.terms, event);
+            } else {
+                MessageId id = messageIds.intern(entry.identifier);
+                resolveConflict(bundle, id, entry.identifier, event.locale, policy);
+                countEntry(bundle.addCompiledMessage(id, std::move(entry.message)), id,
+                           ids ? &ids->messages : nullptr, event.messages, event);
+            }
+        }
+    }
+
+    static void insertEntries(FluentBundle &bundle, ResourceContents &&contents,
+                              SymbolTable<MessageId> &messageIds,
+                              SymbolTable<TermId> &termIds, TermPool *termPool,
+                              ResourceIds *ids, ResourceEvent &event, bool keepComments,
+                              ConflictPolicy policy) {
+        std::visit(
+            [&](auto &&arg) {
+                insertEntries(bundle, std::move(arg), messageIds, termIds, termPool, ids,
+                              event, keepComments, policy);
+            },
+            std::move(contents));
+    }
+
+    void FluentLoader::Writer::addEntries(const icu::Locale &locId,
+                                          ResourceContents &&entries,
+                                          ResourceIds *ids, const string &source) {
+        ResourceEvent event;
+        event.locale = locId.getName();
+        event.source = source;
+        FluentBundle &bundle = this->getOrCreateBundle(locId);
+        insertEntries(bundle, std::move(entries), this->next->messageIds,
+                      this->next->termIds, this->next->termPool.get(), ids, event,
+                      this->next->keepComments, this->next->conflictPolicy);
+        this->notify(event);
+    }
+
+    void FluentLoader::Writer::replaceEntries(const icu::Locale &locId, ResourceIds &ids,
+                                              ResourceContents &&entries,
+                                              const string &source) {
+        FluentBundle &bundle = this->getOrCreateBundle(locId);
+        for (MessageId id : ids.messages)
+            bundle.removeMessage(id);
+        for (TermId id : ids.terms)
+            bundle.removeTerm(id);
+        ids = ResourceIds();
+        ResourceEvent event;
+        event.locale = locId.getName();
+        event.source = source;
+        insertEntries(bundle, std::move(entries), this->next->messageIds,
+                      this->next->termIds, this->next->termPool.get(), &ids, event,
+                      this->next->keepComments, this->next->conflictPolicy);
+        this->notify(event);
     }
 
     void FluentLoader::addMessage(icu::Locale &locId, string &&identifier,
                                 string &&messageContents) {
-        string localeName = string(locId.getName());
         optional<std::vector<ast::PatternElement>> pattern =
             parsePattern(std::move(messageContents));
         if (pattern) {
+            Writer writer(*this);
+            State &state = writer.getState();
+            MessageId id = state.messageIds.intern(identifier);
+            FluentBundle &bundle = writer.getOrCreateBundle(locId);
+            resolveConflict(bundle, id, identifier, locId.getName(), state.conflictPolicy);
             ast::Message message(std::move(identifier), std::move(*pattern));
-            auto iter = this->bundles.find(localeName);
-            if (iter != this->bundles.end()) {
-                iter->second.addMessage(std::move(message));
-            } else {
-                FluentBundle bundle;
-                bundle.addMessage(std::move(message));
-                this->bundles.insert(std::make_pair(localeName, bundle));
-            }
+            bundle.addMessage(id, std::move(message), state.messageIds, state.termIds);
+            writer.publish();
         } else {
             throw std::runtime_error("Failed to parse message contents: " +
                                     messageContents);
         }
     }
 
+    void FluentLoader::setConflictPolicy(ConflictPolicy policy) {
+        Writer writer(*this);
+        writer.getState().conflictPolicy = policy;
+        writer.publish();
+    }
+
+    void FluentLoader::setFormatLimits(const FormatLimits &limits) {
+        Writer writer(*this);
+        writer.getState().formatLimits = limits;
+        writer.publish();
+    }
+
+    void FluentLoader::setKeepComments(bool enabled) {
+        Writer writer(*this);
+        writer.getState().keepComments = enabled;
+        writer.publish();
+    }
+
+    void FluentLoader::setShareTerms(bool enabled) {
+        Writer writer(*this);
+        State &state = writer.getState();
+        if (!enabled)
+            state.termPool = nullptr;
+        else if (!state.termPool)
+            state.termPool = std::make_shared<TermPool>();
+        writer.publish();
+    }
+
+    void FluentLoader::setLazyParsing(bool enabled) {
+        Writer writer(*this);
+        writer.getState().lazy = enabled;
+        writer.publish();
+    }
+
+    void FluentLoader::compile() {
+        Writer writer(*this);
+        writer.compile();
+        writer.publish();
+    }
+
     void FluentLoader::addDirectory(const string &dir) {
-        for (const auto &dirEntry : recursive_directory_iterator(dir)) {
-            if (dirEntry.is_regular_file()) {
-                path file = dirEntry.path();
-                if (file.extension() == ".ftl") {
-                    icu::Locale locId =
-                        icu::Locale(file.parent_path().stem().string().c_str());
-                    this->addResource(locId, file);
-                }
-            }
-        }
+        std::shared_ptr<const State> state = this->snapshot();
+        ParseOptions options = state->getParseOptions();
+        std::vector<ParsedResource> parsed;
+        for (const path &file : findResources(dir, nullptr))
+            parsed.push_back(parseResource(file, state->lazy, options));
+        Writer writer(*this);
+        this->watcher->addDirectory(dir, nullptr);
+        for (ParsedResource &resource : parsed)
+            this->watcher->addResource(writer, std::move(resource), this->watcher->files);
+        writer.publish();
     }
 
     void FluentLoader::addDirectory(const std::string &dir,
                                     const std::set<std::string> &resources) {
-        for (const auto &dirEntry : recursive_directory_iterator(dir)) {
-            if (dirEntry.is_regular_file()) {
-                path file = dirEntry.path();
-                if (file.extension() == ".ftl" &&
-                    resources.find(file.stem().string()) != resources.end()) {
-                    icu::Locale locId =
-                        icu::Locale(file.parent_path().stem().string().c_str());
-                    this->addResource(locId, file);
-                }
+        std::shared_ptr<const State> state = this->snapshot();
+        ParseOptions options = state->getParseOptions();
+        std::vector<ParsedResource> parsed;
+        for (const path &file : findResources(dir, &resources))
+            parsed.push_back(parseResource(file, state->lazy, options));
+        Writer writer(*this);
+        this->watcher->addDirectory(dir, &resources);
+        for (ParsedResource &resource : parsed)
+            this->watcher->addResource(writer, std::move(resource), this->watcher->files);
+        writer.publish();
+    }
+
+    void FluentLoader::loadDirectory(const string &dir, optional<std::set<string>> resources,
+                                     unsigned threads,
+                                     const std::function<void(const icu::Locale &)> &onLocaleLoaded) {
+        const std::set<string> *filter = resources ? &*resources : nullptr;
+        std::vector<path> files = findResources(dir, filter);
+        std::shared_ptr<const State> state = this->snapshot();
+        bool lazy = state->lazy;
+        ParseOptions options = state->getParseOptions();
+
+        // Files are grouped by locale, and each group is published once all of its
+        // files have been parsed. Files are parsed in group order, so that the first
+        // locales become available as early as possible.
+        struct LocaleGroup {
+            icu::Locale locale;
+            std::vector<size_t> files;
+            std::atomic<size_t> remaining = 0;
+            std::atomic<bool> failed = false;
+        };
+        std::deque<LocaleGroup> groups;
+        std::map<string, LocaleGroup *> groupsByName;
+        std::vector<LocaleGroup *> fileGroups(files.size());
+        for (size_t index = 0; index < files.size(); index++) {
+            string name = files[index].parent_path().stem().string();
+            LocaleGroup *&group = groupsByName[name];
+            if (!group) {
+                group = &groups.emplace_back();
+                group->locale = icu::Locale(name.c_str());
             }
+            group->files.push_back(index);
+            group->remaining++;
+            fileGroups[index] = group;
         }
-    }
+        std::vector<size_t> order;
+        for (const LocaleGroup &group : groups)
+            order.insert(order.end(), group.files.begin(), group.files.end());
+
+        std::vector<optional<ParsedResource>> parsed(files.size());
+        std::atomic<size_t> nextFile = 0;
+        std::mutex errorMutex;
+        std::exception_ptr error;
 
-    optional<std::pair<ast::Message, icu::Locale>>
-    FluentLoader::getMessage(const std::vector<icu::Locale> &locIdFallback,
-                            const string &resId) const {
-        for (icu::Locale locId : locIdFallback) {
-            auto result = this->bundles.find(string(locId.getName()));
-            if (result != this->bundles.end()) {
-                auto message = result->second.getMessage(resId);
-                if (message)
-                    return std::make_optional(std::make_pair(*message, locId));
+        auto publish = [&](LocaleGroup &group) {
+            {
+                Writer writer(*this);
+                this->watcher->addDirectory(dir, filter);
+                for (size_t index : group.files) {
+                    this->watcher->addResource(writer, std::move(*parsed[index]),
+                                               this->watcher->files);
+                    parsed[index].reset();
+                }
+                writer.publish();
+            }
+            if (onLocaleLoaded)
+                onLocaleLoaded(group.locale);
+        };
+        auto setError = [&]() {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+        };
+        auto work = [&]() {
+            for (size_t next = nextFile++; next < order.size(); next = nextFile++) {
+                size_t index = order[next];
+                LocaleGroup &group = *fileGroups[index];
+                try {
+                    if (!group.failed)
+                        parsed[index] = parseResource(files[index], lazy, options);
+                } catch (...) {
+                    // Must be set before remaining is decremented, so that whichever
+                    // thread parses the last file of the group sees it
+                    group.failed = true;
+                    setError();
+                }
+                if (--group.remaining == 0 && !group.failed) {
+                    try {
+                        publish(group);
+                    } catch (...) {
+                        setError();
+                    }
+                }
             }
+        };
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = std::min<size_t>(threads, std::max<size_t>(1, files.size()));
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back(work);
+        work();
+        for (std::thread &worker : workers)
+            worker.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    std::future<void> FluentLoader::addDirectoryAsync(const string &dir, unsigned threads,
+                                                      LocaleCallback onLocaleLoaded) {
+        return std::async(std::launch::async, [this, dir, threads, onLocaleLoaded]() {
+            this->loadDirectory(dir, std::nullopt, threads, onLocaleLoaded);
+        });
+    }
+
+    std::future<void> FluentLoader::addDirectoryAsync(const string &dir,
+                                                      const std::set<string> &resources,
+                                                      unsigned threads,
+                                                      LocaleCallback onLocaleLoaded) {
+        return std::async(std::launch::async, [this, dir, resources, threads, onLocaleLoaded]() {
+            this->loadDirectory(dir, resources, threads, onLocaleLoaded);
+        });
+    }
+
+    void FluentLoader::addDirectory(const string &dir, unsigned threads) {
+        this->loadDirectory(dir, std::nullopt, threads, LocaleCallback());
+    }
+
+    void FluentLoader::addDirectory(const string &dir, const std::set<string> &resources,
+                                    unsigned threads) {
+        this->loadDirectory(dir, resources, threads, LocaleCallback());
+    }
+
+    size_t FluentLoader::reload() {
+        // Checking for changes first means polling unchanged files neither waits for
+        // nor blocks writers
+        {
+            std::lock_guard<std::mutex> lock(this->watcher->mutex);
+            if (!this->watcher->hasChanges())
+                return 0;
         }
-        return optional<std::pair<ast::Message, icu::Locale>>();
+        Writer writer(*this);
+        size_t changes = this->watcher->reload(writer);
+        if (changes > 0)
+            writer.publish();
+        return changes;
     }
 
-    optional<ast::Term> FluentLoader::getTerm(const std::vector<icu::Locale> &locIdFallback,
-                                            const string &resId) const {
-        for (icu::Locale locId : locIdFallback) {
-            auto result = this->bundles.find(string(locId.getName()));
-            if (result != this->bundles.end()) {
-                auto term = result->second.getTerm(resId);
-                if (term)
-                    return term;
+    void FluentLoader::watch(std::chrono::milliseconds interval) {
+        this->stopWatching();
+        this->watcher->stopping = false;
+        this->watcher->thread = std::thread([this, interval]() {
+            std::unique_lock<std::mutex> lock(this->watcher->mutex);
+            while (!this->watcher->wakeup.wait_for(
+                lock, interval, [this]() { return this->watcher->stopping; })) {
+                lock.unlock();
+                try {
+                    this->reload();
+                } catch (const std::exception &) {
+                    // Keep the resources currently loaded, and try again next time
+                }
+                lock.lock();
             }
+        });
+    }
+
+    void FluentLoader::stopWatching() {
+        if (!this->watcher->thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(this->watcher->mutex);
+            this->watcher->stopping = true;
         }
-        return optional<ast::Term>();
+        this->watcher->wakeup.notify_all();
+        this->watcher->thread.join();
+    }
+
+    MessageId FluentLoader::getMessageId(const string &identifier) {
+        std::optional<MessageId> id = this->snapshot()->messageIds.find(identifier);
+        if (id)
+            return *id;
+        Writer writer(*this);
+        MessageId result = writer.getState().messageIds.intern(identifier);
+        writer.publish();
+        return result;
     }
 
     optional<string>
     FluentLoader::formatMessage(const std::vector<icu::Locale> &locIdFallback,
                                 const string &resId,
                                 const std::map<string, ast::Variable> &args) const {
-        function<optional<ast::Message>(const string &)> messageLookup =
-            [&](const string &identifier) {
-                auto messagePair = this->getMessage(locIdFallback, identifier);
-                if (messagePair)
-                    return std::make_optional(messagePair->first);
-                return std::optional<ast::Message>();
-            };
-        function<optional<ast::Term>(const string &)> termLookup =
-            [&](const string &identifier) {
-                return this->getTerm(locIdFallback, identifier);
-            };
-
-        ast::MessageReference messageRef = parseMessageReference(resId);
-        auto messagePair = this->getMessage(locIdFallback, messageRef.identifier);
-        if (messagePair) {
-            ast::Message message = messagePair->first;
-            icu::Locale locid = messagePair->second;
-            if (messageRef.attribute) {
-                std::optional<ast::Attribute> attr =
-                    message.getAttribute(*messageRef.attribute);
+        string result;
+        if (this->formatMessageTo(result, locIdFallback, resId, FluentArgs(args)))
+            return result;
+        return optional<string>();
+    }
+
+    optional<string>
+    FluentLoader::formatMessage(const std::vector<icu::Locale> &locIdFallback,
+                                MessageId id,
+                                const std::map<string, ast::Variable> &args) const {
+        string result;
+        StringSink sink(result);
+        ResolvedChain chain(this->snapshot(), locIdFallback, false);
+        if (this->formatResolvedTo(sink, chain, id, nullptr, FluentArgs(args)))
+            return result;
+        return optional<string>();
+    }
+
+    optional<string>
+    FluentLoader::formatMessage(const std::vector<icu::Locale> &locIdFallback,
+                                MessageId id, const string &attribute,
+                                const std::map<string, ast::Variable> &args) const {
+        string result;
+        StringSink sink(result);
+        ResolvedChain chain(this->snapshot(), locIdFallback, false);
+        if (this->formatResolvedTo(sink, chain, id, &attribute, FluentArgs(args)))
+            return result;
+        return optional<string>();
+    }
+
+    optional<string> FluentLoader::formatMessage(const LocaleChain &chain, const string &resId,
+                                                 const FluentArgs &args) const {
+        string result;
+        StringSink sink(result);
+        if (this->formatResolvedTo(sink, *this->resolve(chain), resId, args))
+            return result;
+        return optional<string>();
+    }
+
+    optional<string> FluentLoader::formatMessage(const LocaleChain &chain, MessageId id,
+                                                 const FluentArgs &args) const {
+        string result;
+        StringSink sink(result);
+        if (this->formatResolvedTo(sink, *this->resolve(chain), id, nullptr, args))
+            return result;
+        return optional<string>();
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out,
+                                       const std::vector<icu::Locale> &locIdFallback,
+                                       const string &resId,
+                                       const FluentArgs &args) const {
+        ResolvedChain chain(this->snapshot(), locIdFallback, false);
+        return this->formatResolvedTo(out, chain, resId, args);
+    }
+
+    bool FluentLoader::formatMessageTo(string &out,
+                                       const std::vector<icu::Locale> &locIdFallback,
+                                       const string &resId,
+                                       const FluentArgs &args) const {
+        StringSink sink(out);
+        return this->formatMessageTo(sink, locIdFallback, resId, args);
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out,
+                                       const std::vector<icu::Locale> &locIdFallback,
+                                       MessageId id,
+                                       const FluentArgs &args) const {
+        ResolvedChain chain(this->snapshot(), locIdFallback, false);
+        return this->formatResolvedTo(out, chain, id, nullptr, args);
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out, const LocaleChain &chain,
+                                       const string &resId, const FluentArgs &args) const {
+        return this->formatResolvedTo(out, *this->resolve(chain), resId, args);
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out, const LocaleChain &chain,
+                                       MessageId id, const FluentArgs &args) const {
+        return this->formatResolvedTo(out, *this->resolve(chain), id, nullptr, args);
+    }
+
+    optional<string> FluentLoader::formatMessage(const std::vector<icu::Locale> &locIdFallback,
+                                                 const MessageKey &key,
+                                                 const FluentArgs &args) const {
+        string result;
+        StringSink sink(result);
+        if (this->formatMessageTo(sink, locIdFallback, key, args))
+            return result;
+        return optional<string>();
+    }
+
+    optional<string> FluentLoader::formatMessage(const LocaleChain &chain, const MessageKey &key,
+                                                 const FluentArgs &args) const {
+        string result;
+        StringSink sink(result);
+        if (this->formatMessageTo(sink, chain, key, args))
+            return result;
+        return optional<string>();
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out,
+                                       const std::vector<icu::Locale> &locIdFallback,
+                                       const MessageKey &key, const FluentArgs &args) const {
+        ResolvedChain chain(this->snapshot(), locIdFallback, false);
+        return this->formatResolvedTo(out, chain, key.getIdentifier(), key.getAttribute(), args);
+    }
+
+    bool FluentLoader::formatMessageTo(OutputSink &out, const LocaleChain &chain,
+                                       const MessageKey &key, const FluentArgs &args) const {
+        return this->formatResolvedTo(out, *this->resolve(chain), key.getIdentifier(),
+                                      key.getAttribute(), args);
+    }
+
+    /// Reports a message which could not be found to the observer, if there is one
+    static void notifyMissing(FluentObserver *observer, std::string_view identifier,
+                              const string *attribute) {
+#ifndef FLUENT_NO_INSTRUMENTATION
+        if (observer) {
+            observer->onFormat(FormatEvent{identifier, attribute, {}, 0, false,
+                                           std::chrono::nanoseconds(0)});
+        }
+#else
+        (void)observer, (void)identifier, (void)attribute;
+#endif
+    }
+
+    bool FluentLoader::formatResolvedTo(OutputSink &out, const ResolvedChain &chain,
+                                        std::string_view resId, const FluentArgs &args) const {
+        std::optional<MessageKeyView> key = splitMessageKey(resId);
+        if (!key) {
+            notifyMissing(chain.state->observer.get(), resId, nullptr);
+            return false;
+        }
+        if (!key->attribute)
+            return this->formatResolvedTo(out, chain, key->identifier, nullptr, args);
+        string attribute(*key->attribute);
+        return this->formatResolvedTo(out, chain, key->identifier, &attribute, args);
+    }
+
+    bool FluentLoader::formatResolvedTo(OutputSink &out, const ResolvedChain &chain,
+                                        std::string_view identifier, const string *attribute,
+                                        const FluentArgs &args) const {
+        std::optional<MessageId> id = chain.state->messageIds.find(identifier);
+        if (!id) {
+            notifyMissing(chain.state->observer.get(), identifier, attribute);
+            return false;
+        }
+        return this->formatResolvedTo(out, chain, *id, attribute, args);
+    }
+
+    /// Batches smaller than this per thread are not worth splitting between threads
+    static constexpr size_t MIN_BATCH_PER_THREAD = 128;
+
+    void FluentLoader::formatMessages(const LocaleChain &chain, const MessageRequest *requests,
+                                      size_t count, FormattedBatch &out,
+                                      unsigned threads) const {
+        std::shared_ptr<const ResolvedChain> resolved = this->resolve(chain);
+        const FluentArgs noArgs;
+
+        // Formats requests [begin, end) into batch
+        auto formatRange = [&](size_t begin, size_t end, FormattedBatch &batch) {
+            StringSink sink(batch.buffer);
+            for (size_t index = begin; index < end; index++) {
+                const MessageRequest &request = requests[index];
+                size_t offset = batch.buffer.size();
+                bool found = this->formatResolvedTo(sink, *resolved, request.resId,
+                                                    request.args ? *request.args : noArgs);
+                if (found)
+                    batch.ranges.emplace_back(offset, batch.buffer.size() - offset);
+                else
+                    batch.ranges.emplace_back(string::npos, 0);
+            }
+        };
+
+        threads = std::max(1u, threads);
+        threads = std::min<size_t>(threads, std::max<size_t>(1, count / MIN_BATCH_PER_THREAD));
+        if (threads == 1) {
+            size_t bufferSize = out.buffer.size(), rangesSize = out.ranges.size();
+            try {
+                formatRange(0, count, out);
+            } catch (...) {
+                out.buffer.resize(bufferSize);
+                out.ranges.resize(rangesSize);
+                throw;
+            }
+            return;
+        }
+
+        // Each thread formats a contiguous range into its own batch, which are then
+        // appended to out in order
+        std::vector<FormattedBatch> parts(threads);
+        std::vector<std::exception_ptr> errors(threads);
+        std::vector<std::thread> workers;
+        size_t perThread = (count + threads - 1) / threads;
+        auto work = [&](unsigned part) {
+            try {
+                formatRange(std::min(count, part * perThread),
+                            std::min(count, (part + 1) * perThread), parts[part]);
+            } catch (...) {
+                errors[part] = std::current_exception();
+            }
+        };
+        for (unsigned part = 1; part < threads; part++)
+            workers.emplace_back(work, part);
+        work(0);
+        for (std::thread &worker : workers)
+            worker.join();
+        for (const std::exception_ptr &error : errors) {
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        for (const FormattedBatch &part : parts) {
+            size_t base = out.buffer.size();
+            out.buffer += part.buffer;
+            for (const auto &[offset, length] : part.ranges) {
+                out.ranges.emplace_back(offset == string::npos ? offset : base + offset,
+                                        length);
+            }
+        }
+    }
+
+    bool FluentLoader::formatResolvedTo(OutputSink &out, const ResolvedChain &chain,
+                                        MessageId id, const string *attribute,
+                                        const FluentArgs &args) const {
+#ifndef FLUENT_NO_INSTRUMENTATION
+        FluentObserver *observer = chain.state->observer.get();
+        if (observer) {
+            auto start = std::chrono::steady_clock::now();
+            bool found = chain.state->formatMessageTo(out, chain, id, attribute, args);
+            auto duration = std::chrono::steady_clock::now() - start;
+
+            FormatEvent event{chain.state->messageIds.getName(id), attribute, {}, 0, found,
+                              std::chrono::duration_cast<std::chrono::nanoseconds>(duration)};
+            if (found) {
+                const FluentBundle *bundle = chain.findBundle(id);
+                size_t index = std::find(chain.bundles.begin(), chain.bundles.end(), bundle) -
+                               chain.bundles.begin();
+                event.locale = chain.state->localeIds.getName(chain.localeIds[index]);
+                event.fallbackDepth = chain.positions[index];
+            }
+            observer->onFormat(event);
+            return found;
+        }
+#endif
+        return chain.state->formatMessageTo(out, chain, id, attribute, args);
+    }
+
+    void FluentLoader::setObserver(std::shared_ptr<FluentObserver> observer) {
+        Writer writer(*this);
+        writer.getState().observer = std::move(observer);
+        writer.publish();
+    }
+
+    std::shared_ptr<const FluentLoader::ResolvedChain>
+    FluentLoader::resolve(const LocaleChain &chain) const {
+        std::shared_ptr<const State> state = this->snapshot();
+        std::shared_ptr<const ResolvedChain> resolved = std::atomic_load(&chain.resolved);
+        if (!resolved || resolved->state != state) {
+            // Threads racing to resolve the chain each build an equivalent resolution,
+            // and only the last one stored is kept
+            resolved = std::make_shared<const ResolvedChain>(std::move(state), chain.locales,
+                                                             true);
+            std::atomic_store(&chain.resolved, resolved);
+        }
+        return resolved;
+    }
+
+    LocaleChain::LocaleChain(std::vector<icu::Locale> locales) : locales(std::move(locales)) {}
+
+    LocaleChain::LocaleChain(const LocaleChain &other)
+        : locales(other.locales), resolved(std::atomic_load(&other.resolved)) {}
+
+    LocaleChain &LocaleChain::operator=(const LocaleChain &other) {
+        if (this != &other) {
+            this->locales = other.locales;
+            std::atomic_store(&this->resolved, std::atomic_load(&other.resolved));
+        }
+        return *this;
+    }
+
+    LocaleChain::~LocaleChain() = default;
+
+    /// References nested deeper than this are assumed to depend on the arguments, which
+    /// also stops the search when messages reference each other in a cycle
+    static constexpr size_t MAX_CACHED_REFERENCE_DEPTH = 32;
+
+    bool FluentLoader::State::usesArguments(const ResolvedChain &chain,
+                                            const std::vector<ast::PatternElement> &pattern,
+                                            size_t depth) const {
+        if (depth > MAX_CACHED_REFERENCE_DEPTH)
+            return true;
+        // Finds the pattern of a referenced message or term and its attribute, if any
+        auto referencedPattern = [&](const ast::Message *message,
+                                     const optional<string> &attribute)
+            -> const std::vector<ast::PatternElement> * {
+            if (!message)
+                return nullptr;
+            if (!attribute)
+                return &message->getPattern();
+            const ast::Attribute *attr = message->getAttribute(*attribute);
+            return attr ? &attr->getPattern() : nullptr;
+        };
+        for (const ast::PatternElement &element : pattern) {
+            bool dynamic = std::visit(
+                [&](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, ast::VariableReference>) {
+                        return true;
+                    } else if constexpr (std::is_same_v<T, ast::TermReference>) {
+                        // Terms, and anything they reference, are only passed the
+                        // arguments of the term reference
+                        return false;
+                    } else if constexpr (std::is_same_v<T, ast::MessageReference>) {
+                        optional<MessageId> messageId = this->messageIds.find(arg.identifier);
+                        const ast::Message *message =
+                            messageId ? chain.getMessage(*messageId).first
+                                      : nullptr;
+                        const std::vector<ast::PatternElement> *referenced =
+                            referencedPattern(message, arg.attribute);
+                        return referenced &&
+                               this->usesArguments(chain, *referenced, depth + 1);
+                    } else if constexpr (std::is_same_v<T, ast::SelectExpression>) {
+                        if (this->usesArguments(chain, arg.selector, depth))
+                            return true;
+                        for (const auto &variant : arg.variants) {
+                            if (this->usesArguments(chain, variant.second, depth))
+                                return true;
+                        }
+                        return false;
+                    } else {
+                        return false;
+                    }
+                },
+                element);
+            if (dynamic)
+                return true;
+        }
+        return false;
+    }
+
+    const RenderCache::Node *
+    FluentLoader::State::getCachedRender(const ResolvedChain &chain,
+                                         MessageId id, const string *attribute) const {
+        const RenderCache::Node *cached = this->cache.find(id, chain.localeIds, attribute);
+        if (cached)
+            return cached;
+
+        bool dynamic;
+        if (this->compiled) {
+            // Messages added from a compiled image have no AST to check
+            ResolvedChain::FallbackResolver resolver(chain);
+            const CompiledMessage *message = resolver.getMessage(id);
+            if (!message || (attribute && !message->hasAttribute(*attribute)))
+                return nullptr;
+            dynamic =
+                message->usesArguments(attribute, resolver, MAX_CACHED_REFERENCE_DEPTH);
+        } else {
+            const ast::Message *message = chain.getMessage(id).first;
+            if (!message)
+                return nullptr;
+            const std::vector<ast::PatternElement> *pattern = &message->getPattern();
+            if (attribute) {
+                const ast::Attribute *attr = message->getAttribute(*attribute);
+                if (!attr)
+                    return nullptr;
+                pattern = &attr->getPattern();
+            }
+            dynamic = this->usesArguments(chain, *pattern);
+        }
+
+        auto node = std::make_unique<RenderCache::Node>();
+        node->chain = chain.localeIds;
+        if (attribute)
+            node->attribute = *attribute;
+        if (!dynamic) {
+            string rendered;
+            StringSink sink(rendered);
+            this->renderMessageTo(sink, chain, id, attribute, FluentArgs());
+            node->value = std::move(rendered);
+        }
+        return this->cache.insert(id, std::move(node));
+    }
+
+    bool FluentLoader::State::formatMessageTo(OutputSink &out,
+                                              const ResolvedChain &chain,
+                                              MessageId id, const string *attribute,
+                                              const FluentArgs &args) const {
+        const RenderCache::Node *cached = this->getCachedRender(chain, id, attribute);
+        if (cached && cached->value) {
+            out.append(*cached->value);
+            return true;
+        }
+        return this->renderMessageTo(out, chain, id, attribute, args);
+    }
+
+    bool FluentLoader::State::renderMessageTo(OutputSink &out,
+                                              const ResolvedChain &chain,
+                                              MessageId id, const string *attribute,
+                                              const FluentArgs &args) const {
+        if (this->compiled)
+            return this->formatCompiledMessageTo(out, chain, id, attribute, args);
+
+        ast::MessageLookup messageLookup = [&](const string &identifier) {
+            std::optional<MessageId> messageId = this->messageIds.find(identifier);
+            return messageId ? chain.getMessage(*messageId).first : nullptr;
+        };
+        ast::TermLookup termLookup = [&](const string &identifier) {
+            std::optional<TermId> termId = this->termIds.find(identifier);
+            return termId ? chain.getTerm(*termId) : nullptr;
+        };
+
+        auto [message, bundle] = chain.getMessage(id);
+        if (message) {
+            const FormatContext &context = bundle->getContext();
+            if (attribute) {
+                const ast::Attribute *attr = message->getAttribute(*attribute);
                 if (attr) {
-                    return optional(
-                        attr->format(locid, std::move(args), messageLookup, termLookup));
+                    attr->format(out, context, args, messageLookup, termLookup,
+                                 this->formatLimits);
+                    return true;
                 }
             } else {
-                return optional(
-                    message.format(locid, std::move(args), messageLookup, termLookup));
+                message->format(out, context, args, messageLookup, termLookup,
+                                this->formatLimits);
+                return true;
             }
         }
-        return optional<string>();
+        return false;
     }
 
-    FluentLoader *STATIC_LOADER = nullptr;
+    bool FluentLoader::State::formatCompiledMessageTo(
+        OutputSink &out, const ResolvedChain &chain, MessageId id,
+        const string *attribute, const FluentArgs &args) const {
+        ResolvedChain::FallbackResolver resolver(chain);
+        auto [message, bundle] = chain.getCompiledMessage(id);
+        if (!message)
+            return false;
+
+        if (attribute) {
+            return message->formatAttribute(out, *attribute, bundle->getContext(), args,
+                                            resolver, this->formatLimits);
+        } else {
+            message->format(out, bundle->getContext(), args, resolver, this->formatLimits);
+            return true;
+        }
+    }
+
+    /// The loader used by addStaticResource and formatStaticMessage. Constructed on
+    /// first use, so that it is available to the static initialisers generated by
+    /// ftlembed regardless of initialisation order.
+    static FluentLoader &getStaticLoader() {
+        static FluentLoader loader;
+        return loader;
+    }
+
+    void FluentLoader::addBinaryResource(const icu::Locale locId, std::string_view image) {
+        this->addResource(locId, deserializeResource(image));
+    }
+
+    void FluentLoader::addCompiledResource(const icu::Locale locId, const path &file) {
+        auto mapped = std::make_shared<const MappedFile>(file);
+        std::string_view image = mapped->getContents();
+        this->addCompiledResource(locId, std::move(mapped), image);
+    }
+
+    void FluentLoader::addCompiledResource(const icu::Locale locId,
+                                           std::shared_ptr<const void> owner,
+                                           std::string_view image) {
+        Writer writer(*this);
+        if (!writer.getState().compiled)
+            writer.compile();
+        writer.addEntries(locId, CompiledResource{std::move(owner), image});
+        writer.publish();
+    }
 
     void addStaticResource(const icu::Locale locId, std::string &&resource) {
-        if (STATIC_LOADER == nullptr)
-            STATIC_LOADER = new FluentLoader();
-        STATIC_LOADER->addResource(locId, std::move(resource));
+        getStaticLoader().addResource(locId, std::move(resource));
+    }
+
+    void addStaticBinaryResource(const icu::Locale locId, std::string_view image) {
+        getStaticLoader().addResource(locId, deserializeResource(image));
+    }
+
+    std::shared_ptr<const string>
+    FluentLoader::getCachedMessage(const std::vector<icu::Locale> &locIdFallback,
+                                   const string &resId) const {
+        return this->getCachedResolved(ResolvedChain(this->snapshot(), locIdFallback, false),
+                                       resId);
+    }
+
+    std::shared_ptr<const string> FluentLoader::getCachedMessage(const LocaleChain &chain,
+                                                                 const string &resId) const {
+        return this->getCachedResolved(*this->resolve(chain), resId);
+    }
+
+    std::shared_ptr<const string>
+    FluentLoader::getCachedResolved(const ResolvedChain &chain, const string &resId) const {
+        std::optional<MessageKeyView> key = splitMessageKey(resId);
+        if (!key)
+            return nullptr;
+        std::optional<MessageId> id = chain.state->messageIds.find(key->identifier);
+        if (!id)
+            return nullptr;
+        optional<string> attribute;
+        if (key->attribute)
+            attribute = string(*key->attribute);
+        const RenderCache::Node *cached =
+            chain.state->getCachedRender(chain, *id, attribute ? &*attribute : nullptr);
+        if (!cached || !cached->value)
+            return nullptr;
+        // Keeps the snapshot, which owns the cached string, alive
+        return std::shared_ptr<const string>(chain.state, &*cached->value);
     }
 
     std::optional<std::string> formatStaticMessage(
@@ -189,9 +1668,19 @@ namespace fluent {
         const std::string& resId,
         const std::map<std::string, fluent::ast::Variable>& args
     ) {
-        if (STATIC_LOADER == nullptr)
-            return std::optional<std::string>();
-        return STATIC_LOADER->formatMessage(locIdFallback, resId, args);
+        return getStaticLoader().formatMessage(locIdFallback, resId, args);
+    }
+
+    MessageId getStaticMessageId(const std::string &identifier) {
+        return getStaticLoader().getMessageId(identifier);
+    }
+
+    std::optional<std::string> formatStaticMessage(
+        const std::vector<icu::Locale>& locIdFallback,
+        MessageId id,
+        const FluentArgs& args
+    ) {
+        return getStaticLoader().formatMessage(locIdFallback, id, args);
     }
 
 } // namespace fluent
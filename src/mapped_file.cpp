@@ -0,0 +1,154 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/mapped_file.hpp"
+
+#include <cerrno>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fluent {
+
+    using std::filesystem::filesystem_error;
+
+#ifdef _WIN32
+    MappedFile::MappedFile(const std::filesystem::path& file) {
+        HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            throw filesystem_error("Failed to open file", file,
+                               std::error_code(GetLastError(), std::system_category()));
+        this->fileHandle = handle;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(handle, &fileSize)) {
+            std::error_code error(GetLastError(), std::system_category());
+            this->close();
+            throw filesystem_error("Failed to read file size", file, error);
+        }
+        this->size = static_cast<size_t>(fileSize.QuadPart);
+        // Empty files cannot be mapped
+        if (this->size == 0)
+            return;
+
+        this->mappingHandle = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (this->mappingHandle)
+            this->data = static_cast<const char*>(
+                MapViewOfFile(this->mappingHandle, FILE_MAP_READ, 0, 0, 0));
+        if (!this->data) {
+            std::error_code error(GetLastError(), std::system_category());
+            this->close();
+            throw filesystem_error("Failed to map file", file, error);
+        }
+    }
+
+    void MappedFile::close() {
+        if (this->data)
+            UnmapViewOfFile(this->data);
+        if (this->mappingHandle)
+            CloseHandle(this->mappingHandle);
+        if (this->fileHandle)
+            CloseHandle(this->fileHandle);
+        this->data = nullptr;
+        this->size = 0;
+        this->mappingHandle = nullptr;
+        this->fileHandle = nullptr;
+    }
+#else
+    MappedFile::MappedFile(const std::filesystem::path& file) {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw filesystem_error("Failed to open file", file,
+                               std::error_code(errno, std::generic_category()));
+
+        struct stat status;
+        if (::fstat(fd, &status) != 0) {
+            std::error_code error(errno, std::generic_category());
+            ::close(fd);
+            throw filesystem_error("Failed to read file size", file, error);
+        }
+        this->size = static_cast<size_t>(status.st_size);
+        // Empty files cannot be mapped
+        if (this->size == 0) {
+            ::close(fd);
+            return;
+        }
+
+        void* mapping = ::mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping keeps its own reference to the file
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::error_code error(errno, std::generic_category());
+            this->size = 0;
+            throw filesystem_error("Failed to map file", file, error);
+        }
+    #ifdef MADV_SEQUENTIAL
+        ::madvise(mapping, this->size, MADV_SEQUENTIAL);
+    #endif
+        this->data = static_cast<const char*>(mapping);
+    }
+
+    void MappedFile::close() {
+        if (this->data)
+            ::munmap(const_cast<char*>(this->data), this->size);
+        this->data = nullptr;
+        this->size = 0;
+    }
+#endif
+
+    MappedFile::~MappedFile() { this->close(); }
+
+    MappedFile::MappedFile(MappedFile&& other) noexcept
+        : data(other.data), size(other.size)
+    #ifdef _WIN32
+        , fileHandle(other.fileHandle), mappingHandle(other.mappingHandle)
+    #endif
+    {
+        other.data = nullptr;
+        other.size = 0;
+    #ifdef _WIN32
+        other.fileHandle = nullptr;
+        other.mappingHandle = nullptr;
+    #endif
+    }
+
+    MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            this->close();
+            std::swap(this->data, other.data);
+            std::swap(this->size, other.size);
+    #ifdef _WIN32
+            std::swap(this->fileHandle, other.fileHandle);
+            std::swap(this->mappingHandle, other.mappingHandle);
+    #endif
+        }
+        return *this;
+    }
+
+} // namespace fluent
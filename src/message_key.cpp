@@ -0,0 +1,67 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/message_key.hpp"
+
+namespace fluent {
+
+    /// Whether text matches the Identifier production: [a-zA-Z_][a-zA-Z0-9_-]*
+    static bool isIdentifier(std::string_view text) {
+        auto isAlpha = [](char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        };
+        if (text.empty() || !isAlpha(text[0]))
+            return false;
+        for (char c : text.substr(1)) {
+            if (!isAlpha(c) && !(c >= '0' && c <= '9') && c != '-')
+                return false;
+        }
+        return true;
+    }
+
+    std::optional<MessageKeyView> splitMessageKey(std::string_view resId) noexcept {
+        size_t dot = resId.find('.');
+        MessageKeyView key{resId.substr(0, dot), std::nullopt};
+        if (!isIdentifier(key.identifier))
+            return std::nullopt;
+        if (dot != std::string_view::npos) {
+            key.attribute = resId.substr(dot + 1);
+            if (!isIdentifier(*key.attribute))
+                return std::nullopt;
+        }
+        return key;
+    }
+
+    std::optional<MessageKey> MessageKey::parse(std::string_view resId) {
+        std::optional<MessageKeyView> key = splitMessageKey(resId);
+        if (!key)
+            return std::nullopt;
+        std::optional<std::string> attribute;
+        if (key->attribute)
+            attribute = std::string(*key->attribute);
+        return MessageKey(std::string(key->identifier), std::move(attribute));
+    }
+
+    std::string MessageKey::toString() const {
+        if (this->attribute)
+            return this->identifier + "." + *this->attribute;
+        return this->identifier;
+    }
+
+} // namespace fluent
@@ -0,0 +1,144 @@
+/*
+ *  This file is part of fluent-cpp.
+ *
+ *  Copyright (C) 2021 Benjamin Winger
+ *
+ *  fluent-cpp is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fluent-cpp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fluent/metrics.hpp"
+
+namespace fluent {
+
+    void FluentMetrics::onFormat(const FormatEvent &event) {
+        if (!event.found) {
+            this->missing.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        bool fallback = event.fallbackDepth > 0;
+        this->formats.fetch_add(1, std::memory_order_relaxed);
+        if (fallback)
+            this->fallbacks.fetch_add(1, std::memory_order_relaxed);
+        this->nanoseconds.fetch_add(event.duration.count(), std::memory_order_relaxed);
+
+        if (this->perMessage) {
+            std::string key(event.identifier);
+            if (event.attribute)
+                key += "." + *event.attribute;
+            std::lock_guard<std::mutex> lock(this->mutex);
+            MessageStats &stats = this->messages[std::move(key)];
+            stats.formats++;
+            if (fallback)
+                stats.fallbacks++;
+            stats.duration += event.duration;
+        }
+    }
+
+    void FluentMetrics::onResourceLoaded(const ResourceEvent &event) {
+        this->resources.fetch_add(1, std::memory_order_relaxed);
+        this->junk.fetch_add(event.junk, std::memory_order_relaxed);
+        this->rejected.fetch_add(event.rejected, std::memory_order_relaxed);
+        if (event.junk) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->junkBySource[std::string(event.source)] += event.junk;
+        }
+    }
+
+    std::map<std::string, FluentMetrics::MessageStats, std::less<>>
+    FluentMetrics::getMessageStats() const {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->messages;
+    }
+
+    /// Escapes a label value as required by the Prometheus text format
+    static std::string escapeLabel(std::string_view value) {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for (char c : value) {
+            switch (c) {
+                case '\\':
+                    escaped += "\\\\";
+                    break;
+                case '"':
+                    escaped += "\\\"";
+                    break;
+                case '\n':
+                    escaped += "\\n";
+                    break;
+                default:
+                    escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    void FluentMetrics::writePrometheus(std::ostream &out, std::string_view prefix) const {
+        auto counter = [&](std::string_view name, std::string_view help, uint64_t value) {
+            out << "# HELP " << prefix << name << ' ' << help << '\n'
+                << "# TYPE " << prefix << name << " counter\n"
+                << prefix << name << ' ' << value << '\n';
+        };
+        counter("messages_formatted_total", "Messages formatted.", this->getFormatCount());
+        counter("messages_missing_total", "Messages requested which were not found.",
+                this->getMissingCount());
+        counter("messages_fallback_total",
+                "Messages found in a locale other than the preferred one.",
+                this->getFallbackCount());
+        out << "# HELP " << prefix << "format_seconds_total Time spent formatting messages.\n"
+            << "# TYPE " << prefix << "format_seconds_total counter\n"
+            << prefix << "format_seconds_total "
+            << std::chrono::duration<double>(this->getFormatDuration()).count() << '\n';
+        counter("resources_loaded_total", "Resources added or reloaded.",
+                this->getResourceCount());
+        counter("entries_rejected_total",
+                "Messages and terms not added as their identifier was already used.",
+                this->getRejectedCount());
+        counter("junk_entries_total", "Entries which could not be parsed.",
+                this->getJunkCount());
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->junkBySource.empty()) {
+            out << "# HELP " << prefix
+                << "resource_junk_entries_total Entries which could not be parsed, by resource.\n"
+                << "# TYPE " << prefix << "resource_junk_entries_total counter\n";
+            for (const auto &[source, count] : this->junkBySource) {
+                out << prefix << "resource_junk_entries_total{source=\"" << escapeLabel(source)
+                    << "\"} " << count << '\n';
+            }
+        }
+        if (!this->messages.empty()) {
+            out << "# HELP " << prefix << "message_formatted_total Formats, by message.\n"
+                << "# TYPE " << prefix << "message_formatted_total counter\n";
+            for (const auto &[id, stats] : this->messages) {
+                out << prefix << "message_formatted_total{message=\"" << escapeLabel(id)
+                    << "\"} " << stats.formats << '\n';
+            }
+            out << "# HELP " << prefix
+                << "message_fallback_total Formats using a fallback locale, by message.\n"
+                << "# TYPE " << prefix << "message_fallback_total counter\n";
+            for (const auto &[id, stats] : this->messages) {
+                out << prefix << "message_fallback_total{message=\"" << escapeLabel(id)
+                    << "\"} " << stats.fallbacks << '\n';
+            }
+            out << "# HELP " << prefix
+                << "message_format_seconds_total Time spent formatting, by message.\n"
+                << "# TYPE " << prefix << "message_format_seconds_total counter\n";
+            for (const auto &[id, stats] : this->messages) {
+                out << prefix << "message_format_seconds_total{message=\"" << escapeLabel(id)
+                    << "\"} " << std::chrono::duration<double>(stats.duration).count() << '\n';
+            }
+        }
+    }
+
+} // namespace fluent
@@ -19,7 +19,7 @@
 
 #include "fluent/parser.hpp"
 #include "fluent/ast.hpp"
-#include <fstream>
+#include "fluent/mapped_file.hpp"
 #include <lexy/action/parse.hpp>
 #include <lexy/action/trace.hpp>
 #include <lexy/callback.hpp>
@@ -31,10 +31,15 @@
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef DEBUG_PARSER
 #include <lexy/action/parse_as_tree.hpp>
 #include <lexy/visualize.hpp>
@@ -58,14 +63,150 @@ namespace fluent {
         static constexpr auto text_char = dsl::code_point - dsl::lit_c<'{'> - dsl::lit_c<'}'> - dsl::newline;
         static constexpr auto blank_inline = dsl::while_one(dsl::lit_c<' '>);
         // blank_block         ::= (blank_inline? line_end)+
-        static constexpr auto blank_block = dsl::while_one(dsl::peek(dsl::while_(dsl::lit_c<' '>) + dsl::newline) >> dsl::while_(dsl::lit_c<' '>) + dsl::newline);
+        static constexpr auto blank_line = dsl::peek(dsl::while_(dsl::lit_c<' '>) + dsl::newline) >> dsl::while_(dsl::lit_c<' '>) + dsl::newline;
+        static constexpr auto blank_block = dsl::while_one(blank_line);
         // blank               ::= (blank_inline | line_end)+
         static constexpr auto opt_blank = dsl::while_(blank_inline | dsl::newline);
         static constexpr auto indented_char = text_char - dsl::lit_c<'['> - dsl::lit_c<'*'> - dsl::lit_c<'.'>;
 
-        // \r is not considered a newline, but may appear by itself in the text
-        // So if a \r is read, we must peek and see if it's followed by a \n
-        static constexpr auto comment_contents = dsl::while_(dsl::code_point - dsl::newline);
+        /// The buffer being parsed on this thread, if it was set up by a ScannedInput.
+        /// Readers can only be advanced one character at a time, so char_run needs it
+        /// to scan the buffer directly.
+        struct ScanBuffer {
+            const char *begin = nullptr;
+            const char *end = nullptr;
+        };
+        static thread_local ScanBuffer scanBuffer;
+
+        /// The length of the UTF-8 encoded code point at pos, or 0 if it is not valid
+        /// UTF-8. Overlong encodings, surrogates and values above U+10FFFF are invalid.
+        static size_t codePointLength(const char *pos, const char *end) {
+            auto byte = [&](size_t index) {
+                return static_cast<unsigned char>(pos[index]);
+            };
+            auto continuation = [&](size_t index, unsigned char min,
+                                    unsigned char max) {
+                return pos + index < end && byte(index) >= min && byte(index) <= max;
+            };
+            unsigned char lead = byte(0);
+            if (lead < 0x80)
+                return 1;
+            if (lead >= 0xC2 && lead <= 0xDF)
+                return continuation(1, 0x80, 0xBF) ? 2 : 0;
+            if (lead >= 0xE0 && lead <= 0xEF) {
+                unsigned char min = lead == 0xE0 ? 0xA0 : 0x80;
+                unsigned char max = lead == 0xED ? 0x9F : 0xBF;
+                return continuation(1, min, max) && continuation(2, 0x80, 0xBF) ? 3 : 0;
+            }
+            if (lead >= 0xF0 && lead <= 0xF4) {
+                unsigned char min = lead == 0xF0 ? 0x90 : 0x80;
+                unsigned char max = lead == 0xF4 ? 0x8F : 0xBF;
+                bool valid = continuation(1, min, max) && continuation(2, 0x80, 0xBF) &&
+                             continuation(3, 0x80, 0xBF);
+                return valid ? 4 : 0;
+            }
+            return 0;
+        }
+
+        /**
+         * Returns the end of the run of text characters starting at pos: the first
+         * '{', '}', newline or invalid UTF-8 sequence, or end. If comment is set,
+         * braces are part of the run. A '\r' only ends the run if it is followed by
+         * '\n', as it is otherwise an ordinary character.
+         *
+         * Where SSE2 is available, blocks of 16 ASCII bytes containing none of these
+         * characters are skipped at once; everything else goes through the scalar loop.
+         */
+        static const char *scanText(const char *pos, const char *end, bool comment) {
+            while (pos < end) {
+#ifdef __SSE2__
+                const __m128i newline = _mm_set1_epi8('\n');
+                const __m128i carriageReturn = _mm_set1_epi8('\r');
+                const __m128i openBrace = _mm_set1_epi8(comment ? '\n' : '{');
+                const __m128i closeBrace = _mm_set1_epi8(comment ? '\n' : '}');
+                while (end - pos >= 16) {
+                    auto block =
+                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+                    auto stops = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(block, newline),
+                                     _mm_cmpeq_epi8(block, carriageReturn)),
+                        _mm_or_si128(_mm_cmpeq_epi8(block, openBrace),
+                                     _mm_cmpeq_epi8(block, closeBrace)));
+                    // Non-ASCII bytes have their high bit set, and are validated below
+                    if (_mm_movemask_epi8(_mm_or_si128(stops, block)) != 0)
+                        break;
+                    pos += 16;
+                }
+                if (pos == end)
+                    break;
+#endif
+                char c = *pos;
+                if (c == '\n' || (!comment && (c == '{' || c == '}')))
+                    return pos;
+                if (c == '\r' && pos + 1 < end && pos[1] == '\n')
+                    return pos;
+                size_t length = codePointLength(pos, end);
+                if (length == 0)
+                    return pos;
+                pos += length;
+            }
+            return pos;
+        }
+
+        /**
+         * Matches a run of text characters, or comment characters if Comment is set.
+         * Like text_char, the run ends before a newline, so a \r is only part of
+         * it if it is not followed by a \n. It may only be empty if Optional is set.
+         *
+         * Text makes up most of a resource, so when the reader points into the
+         * ScanBuffer, the run is found with scanText rather than one character at a
+         * time.
+         */
+        template <bool Comment, bool Optional>
+        struct char_run : dsl::token_base<char_run<Comment, Optional>> {
+            template <typename Reader>
+            struct tp {
+                typename Reader::iterator end;
+
+                constexpr explicit tp(const Reader &reader) : end(reader.position()) {}
+
+                bool try_parse(Reader reader) {
+                    auto begin = reader.position();
+                    using iterator = typename Reader::iterator;
+                    if constexpr (std::is_same_v<iterator, const char *>) {
+                        if (scanBuffer.begin <= begin && begin <= scanBuffer.end) {
+                            this->end = scanText(begin, scanBuffer.end, Comment);
+                            return Optional || this->end != begin;
+                        }
+                    }
+
+                    constexpr auto character = [] {
+                        if constexpr (Comment)
+                            return dsl::code_point - dsl::newline;
+                        else
+                            return text_char;
+                    }();
+                    while (true) {
+                        Reader lookahead = reader;
+                        if (lexy::try_match_token(dsl::newline, lookahead) ||
+                            !lexy::try_match_token(character, reader))
+                            break;
+                    }
+                    this->end = reader.position();
+                    return Optional || this->end != begin;
+                }
+
+                template <typename Context>
+                constexpr void report_error(Context &context, const Reader &reader) {
+                    auto name = Comment ? "comment character" : "text character";
+                    auto err = lexy::error<Reader, lexy::expected_char_class>(
+                        reader.position(), name);
+                    context.on(lexy::parse_events::error{}, err);
+                }
+            };
+        };
+
+        static constexpr auto comment_contents = char_run<true, true>{};
 
         struct MessageCommentLine : lexy::token_production {
             // The Message comment may be followed by a group comment
@@ -115,12 +256,19 @@ namespace fluent {
             static constexpr auto value = lexy::construct<ast::AnyComment>;
         };
 
+        // Matches a comment line of any type without producing a value, for resources
+        // parsed without comments
+        static constexpr auto skipped_comment_line =
+            dsl::peek((LEXY_LIT("###") / LEXY_LIT("##") / LEXY_LIT("#")) + (dsl::lit_c<' '> / dsl::eol)) >>
+            comment_contents + dsl::eol;
+
         // Junk                ::= junk_line (junk_line - "#" - "-" - [a-zA-Z])*
         // junk_line           ::= /[^\n]*/ ("\u000A" | EOF)
         static constexpr auto junk_line = dsl::until(dsl::eol);
         static constexpr auto junk = junk_line + dsl::while_(junk_line - dsl::lit_c<'#'> - dsl::lit_c<'-'> - dsl::ascii::alpha);
+        static constexpr auto junk_lines = junk_line + dsl::while_(dsl::peek_not(dsl::lit_c<'#'> / dsl::lit_c<'-'> / dsl::ascii::alpha / dsl::eof) >> junk_line);
         struct Junk : lexy::token_production {
-            static constexpr auto rule = dsl::capture(junk_line + dsl::while_(dsl::peek_not(dsl::lit_c<'#'> / dsl::lit_c<'-'> / dsl::ascii::alpha / dsl::eof) >> junk_line));
+            static constexpr auto rule = dsl::capture(junk_lines);
             static constexpr auto value = lexy::as_string<std::string, lexy::utf8_encoding> | lexy::construct<ast::Junk>;
         };
 
@@ -135,12 +283,12 @@ namespace fluent {
 
         // inline_text         ::= text_char+
         struct inline_text : lexy::token_production {
-            static constexpr auto rule = dsl::identifier(text_char);
+            static constexpr auto rule = dsl::capture(char_run<false, false>{});
             static constexpr auto value = lexy::as_string<std::string, lexy::utf8_encoding> | lexy::construct<ast::PatternElement>;
         };
 
         struct opt_inline_text : lexy::token_production {
-            static constexpr auto rule = dsl::capture(dsl::while_(text_char));
+            static constexpr auto rule = dsl::capture(char_run<false, true>{});
             static constexpr auto value = lexy::as_string<std::string, lexy::utf8_encoding>;
         };
 
@@ -179,13 +327,6 @@ namespace fluent {
             static constexpr auto value = lexy::construct<ast::MessageReference>;
         };
 
-        // TermReference       ::= "-" Identifier AttributeAccessor? CallArguments?
-        struct TermReference : lexy::token_production {
-            // FIXME: Add arguments
-            static constexpr auto rule = dsl::lit_c<'-'> >> dsl::p<Identifier> >> dsl::opt(dsl::p<AttributeAccessor>);
-            static constexpr auto value = lexy::construct<ast::TermReference>;
-        };
-
         // NumberLiteral       ::= "-"? digits ("." digits)?
         struct NumberLiteral : lexy::token_production {
             static constexpr auto rule = [] {
@@ -216,6 +357,37 @@ namespace fluent {
             static constexpr auto value = lexy::as_string<std::string, lexy::utf8_encoding> >> lexy::construct<ast::StringLiteral>;
         };
 
+        // NamedArgument       ::= Identifier blank? ":" blank? (StringLiteral | NumberLiteral)
+        struct NamedArgument {
+            static constexpr auto rule = dsl::p<Identifier> >> opt_blank + dsl::lit_c<':'> + opt_blank + (dsl::p<StringLiteral> | dsl::p<NumberLiteral>);
+            static constexpr auto value = lexy::construct<ast::CallArguments::NamedArgument>;
+        };
+
+        // Argument            ::= NamedArgument | InlineExpression
+        // Only literals are accepted as positional arguments, as they are only kept for
+        // the AST: terms ignore them.
+        struct Argument {
+            static constexpr auto rule = dsl::p<NamedArgument> | dsl::p<StringLiteral> | dsl::p<NumberLiteral>;
+            static constexpr auto value = lexy::construct<ast::CallArguments::Argument>;
+        };
+
+        // CallArguments       ::= blank? "(" blank? argument_list blank? ")"
+        // argument_list       ::= (Argument blank? "," blank?)* Argument?
+        struct CallArguments {
+            static constexpr auto rule = [] {
+                auto separator = dsl::peek(opt_blank + dsl::lit_c<','>) >> opt_blank + dsl::lit_c<','> + opt_blank;
+                auto arguments = dsl::opt(dsl::list(dsl::p<Argument>, dsl::trailing_sep(separator)));
+                return dsl::peek(opt_blank + dsl::lit_c<'('>) >> opt_blank + dsl::lit_c<'('> + opt_blank + arguments + opt_blank + dsl::lit_c<')'>;
+            }();
+            static constexpr auto value = lexy::as_list<std::vector<ast::CallArguments::Argument>>;
+        };
+
+        // TermReference       ::= "-" Identifier AttributeAccessor? CallArguments?
+        struct TermReference : lexy::token_production {
+            static constexpr auto rule = dsl::lit_c<'-'> >> dsl::p<Identifier> >> dsl::opt(dsl::p<AttributeAccessor>) + dsl::opt(dsl::p<CallArguments>);
+            static constexpr auto value = lexy::construct<ast::TermReference>;
+        };
+
         struct inline_placeable;
 
         // InlineExpression    ::= StringLiteral | NumberLiteral | FunctionReference |
@@ -312,13 +484,15 @@ namespace fluent {
         };
 
         // block_placeable     ::= blank_block blank_inline? inline_placeable
+        // Only the blank_block and indent are matched here, as a text element, since
+        // the newlines are part of the pattern and the indent is removed with the
+        // others later. The inline_placeable is then matched as the next element.
         struct block_placeable : lexy::token_production {
             static constexpr auto rule = [] {
                 auto block_prefix = blank_block + dsl::if_(blank_inline);
-                auto value = block_prefix + dsl::p<inline_placeable>;
-                return dsl::peek(block_prefix + dsl::lit_c<'{'>) >> value;
+                return dsl::peek(block_prefix + dsl::lit_c<'{'>) >> dsl::capture(block_prefix);
             }();
-            static constexpr auto value = lexy::forward<ast::PatternElement>;
+            static constexpr auto value = lexy::as_string<std::string, lexy::utf8_encoding> | lexy::construct<ast::PatternElement>;
         };
 
         // PatternElement      ::= inline_text | block_text | inline_placeable | block_placeable
@@ -392,49 +566,229 @@ namespace fluent {
                 );
         };
 
+        // Comments and Junk which are not kept are matched without building their
+        // values: comments are skipped along with blank lines, and Junk is skipped as
+        // the recovery from an invalid entry.
+        template <bool KeepComments = true, bool KeepJunk = true>
         struct Resource {
-            static constexpr auto ws = dsl::whitespace(blank_block);
-            static constexpr auto rule = dsl::terminator(dsl::eof).opt_list( ws + dsl::try_(dsl::p<Entry>, dsl::p<Junk>) + ws);
+            static constexpr auto ws = [] {
+                if constexpr (KeepComments)
+                    return dsl::whitespace(blank_block);
+                else
+                    return dsl::whitespace(dsl::while_one(blank_line | skipped_comment_line));
+            }();
+            static constexpr auto rule = [] {
+                auto entry = [] {
+                    if constexpr (KeepJunk)
+                        return dsl::try_(dsl::p<Entry>, dsl::p<Junk>);
+                    else
+                        return dsl::try_(dsl::p<Entry>, junk_lines);
+                }();
+                auto entries = dsl::terminator(dsl::eof).opt_list(ws + entry + ws);
+                // Otherwise a resource containing only comments would be parsed as an
+                // invalid entry at the end of the input
+                if constexpr (KeepComments)
+                    return entries;
+                else
+                    return ws + entries;
+            }();
             static constexpr auto value = lexy::as_list<std::vector<ast::Entry>>;
         };
 
     } // namespace grammar
 
-    std::vector<ast::Entry> parseFile(const std::filesystem::path &filename, bool strict) {
-        std::ifstream ifs(filename);
-        std::string content((std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()));
-        auto stringInput = lexy::string_input<lexy::utf8_encoding>(content);
+    /// A UTF-8 string input whose buffer is the thread's ScanBuffer for as long as it
+    /// exists, so that text in it is scanned directly.
+    class ScannedInput : public lexy::string_input<lexy::utf8_encoding> {
+        grammar::ScanBuffer previous;
+
+      public:
+        explicit ScannedInput(std::string_view content)
+            : lexy::string_input<lexy::utf8_encoding>(content.data(), content.size()),
+              previous(grammar::scanBuffer) {
+            grammar::scanBuffer = {content.data(), content.data() + content.size()};
+        }
+        ScannedInput(const ScannedInput &) = delete;
+        ScannedInput &operator=(const ScannedInput &) = delete;
+        ~ScannedInput() { grammar::scanBuffer = this->previous; }
+    };
+
+    template <typename Production, typename Input>
+    static std::vector<ast::Entry> parseResource(const Input &input, bool strict) {
     #ifdef DEBUG_PARSER
-        lexy::trace<grammar::Resource>(stdout, stringInput);
+        lexy::trace<Production>(stdout, input);
 
-        lexy::parse_tree_for<decltype(stringInput)> tree;
-        auto result = lexy::parse_as_tree<grammar::Resource>(tree, stringInput, lexy_ext::report_error);
+        lexy::parse_tree_for<Input> tree;
+        auto result = lexy::parse_as_tree<Production>(tree, input, lexy_ext::report_error);
         lexy::visualize(stdout, tree, {lexy::visualize_fancy});
     #endif
 
-        auto parse_result = lexy::parse<grammar::Resource>(stringInput, lexy_ext::report_error);
+        auto parse_result = lexy::parse<Production>(input, lexy_ext::report_error);
 
         if (strict && parse_result.is_error() || !strict && parse_result.is_fatal_error()) {
             // FIXME: This should be a more specific error
             throw std::runtime_error("Failed to parse");
         } else {
-            return parse_result.value();
+            return std::move(parse_result).value();
         }
     }
 
+    template <typename Input>
+    static std::vector<ast::Entry> parseResource(const Input &input, const ParseOptions &options) {
+        if (options.keepComments && options.keepJunk)
+            return parseResource<grammar::Resource<true, true>>(input, options.strict);
+        else if (options.keepComments)
+            return parseResource<grammar::Resource<true, false>>(input, options.strict);
+        else if (options.keepJunk)
+            return parseResource<grammar::Resource<false, true>>(input, options.strict);
+        else
+            return parseResource<grammar::Resource<false, false>>(input, options.strict);
+    }
+
+    std::vector<ast::Entry> parseFile(const std::filesystem::path &filename, bool strict) {
+        return parseFile(filename, ParseOptions{strict});
+    }
+
+    std::vector<ast::Entry> parseFile(const std::filesystem::path &filename,
+                                      const ParseOptions &options) {
+        // The file is parsed directly from the mapping. The AST owns copies of the text
+        // it needs, so the mapping can be released once parsing is finished.
+        MappedFile file(filename);
+        return parseResource(ScannedInput(file.getContents()), options);
+    }
+
     std::vector<ast::Entry> parse(std::string &&input, bool strict) {
-        auto parse_result = lexy::parse<grammar::Resource>(lexy::string_input<lexy::utf8_encoding>(input), lexy_ext::report_error);
+        return parse(std::move(input), ParseOptions{strict});
+    }
 
-        if (strict && parse_result.is_error() || !strict && parse_result.is_fatal_error()) {
-            // FIXME: This should be a more specific error
-            throw std::runtime_error("Failed to parse");
-        } else {
-            return parse_result.value();
+    std::vector<ast::Entry> parse(std::string &&input, const ParseOptions &options) {
+        return parseResource(ScannedInput(input), options);
+    }
+
+    static bool isIdentifierStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+    static bool isIdentifierChar(char c) {
+        return isIdentifierStart(c) || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    }
+
+    std::vector<EntrySpan> scanResource(std::string_view contents) {
+        std::vector<EntrySpan> spans;
+        // The entry currently being scanned, which ends at the next entry or comment
+        std::optional<EntrySpan> current;
+        size_t currentStart = 0;
+        // The start of the message comment on the lines just before, if any. Such a
+        // comment belongs to the entry following it, as in an eager parse.
+        std::optional<size_t> commentStart;
+        auto finish = [&](size_t end) {
+            if (current) {
+                current->source = contents.substr(currentStart, end - currentStart);
+                spans.push_back(*current);
+                current.reset();
+            }
+        };
+
+        size_t lineStart = 0;
+        while (lineStart < contents.size()) {
+            size_t lineEnd = contents.find('\n', lineStart);
+            lineEnd = lineEnd == std::string_view::npos ? contents.size() : lineEnd + 1;
+            char first = contents[lineStart];
+            // Any other line either continues the current entry, or is junk which will
+            // be rejected when the entry is parsed
+            if (isIdentifierStart(first) || first == '-' || first == '#') {
+                finish(lineStart);
+                // Only single # comments are attached to entries
+                char second = lineStart + 1 < lineEnd ? contents[lineStart + 1] : '\n';
+                bool messageComment =
+                    first == '#' && (second == ' ' || second == '\n' || second == '\r');
+                size_t start = lineStart + (first == '-' ? 1 : 0);
+                size_t end = start;
+                while (end < lineEnd && isIdentifierChar(contents[end]))
+                    end++;
+                size_t equals = end;
+                while (equals < lineEnd && contents[equals] == ' ')
+                    equals++;
+                if (first != '#' && end > start && isIdentifierStart(contents[start]) &&
+                    equals < lineEnd && contents[equals] == '=') {
+                    EntrySpan::Kind kind =
+                        first == '-' ? EntrySpan::Kind::Term : EntrySpan::Kind::Message;
+                    current = EntrySpan{kind, contents.substr(start, end - start), {}};
+                    currentStart = commentStart.value_or(lineStart);
+                }
+                if (!messageComment)
+                    commentStart.reset();
+                else if (!commentStart)
+                    commentStart = lineStart;
+            } else {
+                commentStart.reset();
+            }
+            lineStart = lineEnd;
+        }
+        finish(contents.size());
+        return spans;
+    }
+
+    StreamParser::StreamParser(Callback callback, const ParseOptions &options)
+        : callback(std::move(callback)), options(options) {}
+
+    void StreamParser::flush(size_t end) {
+        if (end == 0)
+            return;
+        std::vector<ast::Entry> entries = parse(this->buffer.substr(0, end), this->options);
+        this->buffer.erase(0, end);
+        this->lineStart -= std::min(this->lineStart, end);
+        for (ast::Entry &entry : entries)
+            this->callback(std::move(entry));
+    }
+
+    void StreamParser::feed(std::string_view chunk) {
+        this->buffer.append(chunk);
+        while (this->lineStart < this->buffer.size()) {
+            // Only the first character of a line is needed to tell whether it starts a
+            // new entry, so the previous entry is finished without waiting for the rest
+            if (!this->lineChecked) {
+                char first = this->buffer[this->lineStart];
+                bool comment = first == '#';
+                // Any other line continues the current entry, as in scanResource
+                if ((isIdentifierStart(first) || first == '-' || comment) &&
+                    !this->previousLineIsComment)
+                    this->flush(this->lineStart);
+                this->previousLineIsComment = comment;
+                this->lineChecked = true;
+            }
+            size_t lineEnd = this->buffer.find('\n', this->lineStart);
+            if (lineEnd == std::string::npos)
+                break;
+            this->lineStart = lineEnd + 1;
+            this->lineChecked = false;
+        }
+    }
+
+    void StreamParser::finish() {
+        this->flush(this->buffer.size());
+        this->buffer.clear();
+        this->lineStart = 0;
+        this->lineChecked = false;
+        this->previousLineIsComment = false;
+    }
+
+    std::optional<ast::Entry> parseEntry(std::string_view source) {
+        // Spans found by scanResource may start with the entry's comment
+        auto parse_result = lexy::parse<grammar::Resource<true, false>>(
+            ScannedInput(source), lexy_ext::report_error);
+        if (parse_result.is_fatal_error())
+            return std::optional<ast::Entry>();
+        std::vector<ast::Entry> entries = std::move(parse_result).value();
+        for (ast::Entry &entry : entries) {
+            if (std::holds_alternative<ast::Message>(entry) ||
+                std::holds_alternative<ast::Term>(entry))
+                return std::move(entry);
         }
+        return std::optional<ast::Entry>();
     }
 
     std::vector<ast::PatternElement> parsePattern(const std::string &input) {
-        auto parse_result = lexy::parse<grammar::Pattern>(lexy::string_input<lexy::utf8_encoding>(input), lexy_ext::report_error);
+        auto parse_result =
+            lexy::parse<grammar::Pattern>(ScannedInput(input), lexy_ext::report_error);
         if (parse_result) {
             return parse_result.value();
         } else {
@@ -443,7 +797,8 @@ namespace fluent {
     }
 
     ast::MessageReference parseMessageReference(const std::string &input) {
-        auto parse_result = lexy::parse<grammar::MessageReference>(lexy::string_input<lexy::utf8_encoding>(input), lexy_ext::report_error);
+        auto parse_result = lexy::parse<grammar::MessageReference>(
+            ScannedInput(input), lexy_ext::report_error);
         if (parse_result) {
             return parse_result.value();
         } else {
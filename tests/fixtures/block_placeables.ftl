@@ -0,0 +1,23 @@
+key01 =
+    {"A"}
+
+key02 = Text
+
+    {"B"}
+
+key03 =
+    Text
+        {"C"}
+    More
+
+key04 =
+    {"D"}
+
+    Text
+
+key05 =
+
+    {"E"}
+
+
+    {"F"}
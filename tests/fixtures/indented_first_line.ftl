@@ -0,0 +1,11 @@
+key01 = Inline
+        indented line
+
+key02 =
+        Four
+    Two
+
+key03 =
+        Four
+    Two
+        Four
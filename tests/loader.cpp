@@ -17,13 +17,24 @@
  *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <fluent/binary.hpp>
+#include <fluent/bundle.hpp>
+#include <fluent/compiler.hpp>
+#include <fluent/context.hpp>
 #include <fluent/loader.hpp>
 #include <fluent/parser.hpp>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <iostream>
 #include <optional>
+#include <sstream>
+#include <thread>
 #include <unicode/locid.h>
 
+#include "l10n/main.hpp"
+
 void check_result(std::string message,
                   std::map<std::string, fluent::ast::Variable> args,
                   std::string expected) {
@@ -63,3 +74,641 @@ TEST(TestStatic, SelectLiteralNum) {
 TEST(TestStatic, SelectLiteralString) {
     check_result("select-literal-string", {}, "Some things");
 }
+
+TEST(TestStatic, Catalog) {
+    std::vector<icu::Locale> locales = {icu::Locale("en")};
+    ASSERT_EQ(fluent::formatStaticMessage(locales, l10n::main::cli_help()),
+              "Print help message");
+    ASSERT_EQ(fluent::formatStaticMessage(locales, l10n::main::argument("Foo")), "Foo");
+    ASSERT_EQ(fluent::formatStaticMessage(locales, l10n::main::select(1L)), "One thing");
+    ASSERT_EQ(l10n::main::select::identifier, "select");
+}
+
+TEST(TestLoader, NumberLiteralUsesBundleLocale) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en"), de("de");
+    loader.addMessage(en, "number", "{ 1.50 }");
+    loader.addMessage(de, "number", "{ 1.50 }");
+    // Formatting one locale must not affect the formatter used for another
+    ASSERT_EQ(*loader.formatMessage({en}, "number", {}), "1.50");
+    ASSERT_EQ(*loader.formatMessage({de}, "number", {}), "1,50");
+}
+
+TEST(TestLoader, CompiledMatchesAST) {
+    fluent::FluentLoader loader, compiled, lazy;
+    loader.addDirectory("l10n", {"main"});
+    compiled.addDirectory("l10n", {"main"});
+    compiled.compile();
+    lazy.setLazyParsing(true);
+    lazy.addDirectory("l10n", {"main"});
+
+    std::vector<std::pair<std::string, std::map<std::string, fluent::ast::Variable>>>
+        cases = {{"cli-help", {}},
+                 {"float-format", {}},
+                 {"integer-format", {}},
+                 {"argument", {{"arg", "Foo"}}},
+                 {"argument", {{"arg", 10.1}}},
+                 {"indentation-with-expression", {}},
+                 {"select", {{"num", 0}}},
+                 {"select", {{"num", 1.0}}},
+                 {"select", {{"num", 2}}},
+                 {"select-cldr-plural", {{"num", 1}}},
+                 {"select-literal-num", {}},
+                 {"select-literal-string", {}}};
+    for (const auto &[id, args] : cases) {
+        std::optional<std::string> expected =
+            loader.formatMessage({icu::Locale("en")}, id, args);
+        ASSERT_TRUE(expected);
+        ASSERT_EQ(compiled.formatMessage({icu::Locale("en")}, id, args), expected);
+        ASSERT_EQ(lazy.formatMessage({icu::Locale("en")}, id, args), expected);
+    }
+}
+
+TEST(TestLoader, CompiledSelect) {
+    icu::Locale en("en");
+    std::string resource = "select = { $n ->\n"
+                           "    [0] zero\n"
+                           "    [one] one\n"
+                           "    [1] exactly one\n"
+                           "    [2.5] two and a half\n"
+                           "    [key] first key\n"
+                           "    [key] second key\n"
+                           "   *[other] other\n"
+                           "    [3] three\n"
+                           "}\n";
+    fluent::FluentLoader loader, compiled;
+    loader.addResource(en, std::string(resource));
+    compiled.compile();
+    compiled.addResource(en, std::string(resource));
+    // When several variants match, the first one wins
+    std::vector<std::pair<fluent::ast::Variable, std::string>> cases = {
+        {0L, "zero"},     {1L, "one"},   {1.0, "one"},         {2.5, "two and a half"},
+        {3L, "other"},    {7L, "other"}, {"key", "first key"}, {"one", "one"},
+        {"none", "other"}};
+    for (const auto &[value, expected] : cases) {
+        ASSERT_EQ(loader.formatMessage({en}, "select", {{"n", value}}), expected);
+        ASSERT_EQ(compiled.formatMessage({en}, "select", {{"n", value}}), expected);
+    }
+}
+
+TEST(TestLoader, CompiledCrossLocaleReference) {
+    // A message found in a fallback locale is formatted with the context of the
+    // locale formatting started in, whether or not the loader is compiled
+    icu::Locale en("en"), de("de"), ja("ja");
+    fluent::FluentLoader loader, compiled;
+    compiled.compile();
+    for (fluent::FluentLoader *target : {&loader, &compiled}) {
+        target->addResource(en, std::string("amount = { 1.5 } { 1 ->\n"
+                                            "    [one] one\n"
+                                            "   *[other] other\n"
+                                            "}\n"));
+        target->addResource(de, std::string("price = Preis: { amount }\n"));
+        target->addResource(ja, std::string("price = { amount }\n"));
+    }
+    ASSERT_EQ(*loader.formatMessage({de, en}, "price", {}), "Preis: 1,5 one");
+    ASSERT_EQ(*loader.formatMessage({ja, en}, "price", {}), "1.5 other");
+    ASSERT_EQ(compiled.formatMessage({de, en}, "price", {}),
+              loader.formatMessage({de, en}, "price", {}));
+    ASSERT_EQ(compiled.formatMessage({ja, en}, "price", {}),
+              loader.formatMessage({ja, en}, "price", {}));
+    ASSERT_EQ(compiled.formatMessage({en}, "amount", {}),
+              loader.formatMessage({en}, "amount", {}));
+}
+
+TEST(TestLoader, MessageIds) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    // Ids can be resolved before the message is loaded
+    fluent::MessageId id = loader.getMessageId("greeting");
+    ASSERT_FALSE(loader.formatMessage({en}, id, {}));
+    loader.addMessage(en, "greeting", "Hello { $name }");
+    ASSERT_EQ(loader.getMessageId("greeting"), id);
+    ASSERT_EQ(*loader.formatMessage({en}, id, {{"name", "World"}}),
+              *loader.formatMessage({en}, "greeting", {{"name", "World"}}));
+}
+
+TEST(TestLoader, FormatIntoBuffer) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory("l10n", {"main"});
+    std::string buffer = "> ";
+    ASSERT_TRUE(loader.formatMessageTo(buffer, {en}, "cli-help", {}));
+    ASSERT_TRUE(loader.formatMessageTo(buffer, {en}, "argument", {{"arg", "!"}}));
+    ASSERT_FALSE(loader.formatMessageTo(buffer, {en}, "missing", {}));
+    ASSERT_EQ(buffer, "> Print help message!");
+
+    std::ostringstream stream;
+    fluent::StreamSink sink(stream);
+    ASSERT_TRUE(loader.formatMessageTo(sink, {en}, "select", {{"num", 2}}));
+    ASSERT_EQ(stream.str(), "Some things");
+}
+
+TEST(TestLoader, FormatNumbersIntoSink) {
+    fluent::FormatContext de(icu::Locale("de")), ru(icu::Locale("ru"));
+    std::string buffer = "> ";
+    fluent::StringSink sink(buffer);
+    ASSERT_TRUE(de.formatNumber(sink, 1234567L));
+    ASSERT_TRUE(de.formatNumber(sink, 1.5, 2));
+    // Non-ASCII output must be transcoded intact
+    ASSERT_TRUE(ru.formatNumber(sink, 1234.5));
+    ASSERT_EQ(buffer, "> 1.234.5671,501\u00a0234,5");
+    ASSERT_EQ(*ru.formatNumber(1234.5), "1\u00a0234,5");
+
+    ASSERT_EQ(ru.selectPluralCategory(3L), fluent::PluralCategory::Few);
+    ASSERT_EQ(ru.getPluralCategory(5L), "many");
+    ASSERT_EQ(fluent::getPluralCategoryName(fluent::PluralCategory::Two), "two");
+}
+
+TEST(TestLoader, FluentArgs) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory("l10n", {"main"});
+
+    std::string value = "!";
+    fluent::FluentArgs args{{"arg", std::string_view(value)}};
+    ASSERT_EQ(args.size(), 1);
+    ASSERT_EQ(loader.formatMessage({en}, "argument", args),
+              loader.formatMessage({en}, "argument", {{"arg", "!"}}));
+
+    args.set("num", 2L);
+    args.set("num", 1L);
+    ASSERT_EQ(args.size(), 2);
+    ASSERT_EQ(std::get<long>(args.at("num")), 1);
+    ASSERT_EQ(args.find("missing"), nullptr);
+    ASSERT_THROW(args.at("missing"), std::out_of_range);
+    ASSERT_EQ(loader.formatMessage({en}, "select", args), "One thing");
+}
+
+TEST(TestLoader, ConcurrentReadsDuringWrites) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en"), fr("fr");
+    loader.addDirectory("l10n", {"main"});
+
+    std::atomic<bool> done = false;
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                std::optional<std::string> result =
+                    loader.formatMessage({fr, en}, "argument", {{"arg", "x"}});
+                if (result != "x" && result != "x!")
+                    failures++;
+            }
+        });
+    }
+    for (int i = 0; i < 100; i++) {
+        icu::Locale locale(("x-test-" + std::to_string(i)).c_str());
+        loader.addMessage(locale, "message-" + std::to_string(i), "Value");
+        if (i == 50) {
+            loader.compile();
+            loader.addMessage(fr, "argument", "{ $arg }!");
+        }
+    }
+    done = true;
+    for (std::thread& reader : readers)
+        reader.join();
+
+    ASSERT_EQ(failures, 0);
+    ASSERT_EQ(loader.formatMessage({fr, en}, "argument", {{"arg", "x"}}), "x!");
+}
+
+TEST(TestLoader, Reload) {
+    std::filesystem::path root = std::filesystem::temp_directory_path() / "fluent-cpp-reload";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "en");
+    std::ofstream(root / "en" / "main.ftl") << "first = First\nsecond = Second\n";
+
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory(root.string());
+    ASSERT_EQ(loader.formatMessage({en}, "first", {}), "First");
+    ASSERT_EQ(loader.reload(), 0);
+
+    std::ofstream(root / "en" / "main.ftl") << "first = Changed!\nthird = Third\n";
+    ASSERT_EQ(loader.reload(), 1);
+    ASSERT_EQ(loader.formatMessage({en}, "first", {}), "Changed!");
+    ASSERT_EQ(loader.formatMessage({en}, "second", {}), std::nullopt);
+    ASSERT_EQ(loader.formatMessage({en}, "third", {}), "Third");
+
+    std::filesystem::remove(root / "en" / "main.ftl");
+    ASSERT_EQ(loader.reload(), 1);
+    ASSERT_EQ(loader.formatMessage({en}, "first", {}), std::nullopt);
+    std::filesystem::remove_all(root);
+}
+
+TEST(TestLoader, CachedMessages) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory("l10n");
+
+    std::shared_ptr<const std::string> help = loader.getCachedMessage({en}, "cli-help");
+    ASSERT_TRUE(help);
+    ASSERT_EQ(*help, "Print help message");
+    ASSERT_EQ(loader.getCachedMessage({en}, "cli-help"), help);
+    ASSERT_EQ(loader.formatMessage({en}, "cli-help", {}), "Print help message");
+    ASSERT_FALSE(loader.getCachedMessage({en}, "argument"));
+    ASSERT_FALSE(loader.getCachedMessage({en}, "missing"));
+    ASSERT_EQ(loader.formatMessage({en}, "argument", {{"arg", "a"}}), "a");
+    ASSERT_EQ(loader.formatMessage({en}, "argument", {{"arg", "b"}}), "b");
+
+    // Adding resources clears the cache, but earlier results stay valid
+    icu::Locale fr("fr");
+    help = loader.getCachedMessage({fr, en}, "cli-help");
+    ASSERT_EQ(*help, "Print help message");
+    loader.addMessage(fr, "cli-help", "Afficher l'aide");
+    ASSERT_EQ(*loader.getCachedMessage({fr, en}, "cli-help"), "Afficher l'aide");
+    ASSERT_EQ(*help, "Print help message");
+}
+
+TEST(TestLoader, LocaleChain) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en"), fr("fr");
+    loader.addDirectory("l10n");
+
+    fluent::LocaleChain chain({fr, en});
+    ASSERT_EQ(loader.formatMessage(chain, "cli-help"), "Print help message");
+    ASSERT_EQ(loader.formatMessage(chain, "select", {{"num", 2}}), "Some things");
+    ASSERT_EQ(loader.formatMessage(chain, "missing"), std::nullopt);
+
+    // The chain is resolved again once the loader changes
+    loader.addMessage(fr, "cli-help", "Afficher l'aide");
+    ASSERT_EQ(loader.formatMessage(chain, "cli-help"), "Afficher l'aide");
+    ASSERT_EQ(loader.formatMessage(chain, loader.getMessageId("select"), {{"num", 1}}),
+              "One thing");
+
+    fluent::FluentLoader other;
+    other.addDirectory("l10n");
+    ASSERT_EQ(other.formatMessage(chain, "cli-help"), "Print help message");
+    ASSERT_EQ(loader.formatMessage(chain, "cli-help"), "Afficher l'aide");
+}
+
+#ifndef FLUENT_NO_INSTRUMENTATION
+TEST(TestLoader, Metrics) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en"), fr("fr");
+    auto metrics = std::make_shared<fluent::FluentMetrics>();
+    loader.setObserver(metrics);
+    loader.addDirectory("l10n");
+    ASSERT_EQ(metrics->getResourceCount(), 2);
+    ASSERT_EQ(metrics->getJunkCount(), 0);
+
+    ASSERT_TRUE(loader.formatMessage({en}, "cli-help", {}));
+    ASSERT_TRUE(loader.formatMessage({fr, en}, "cli-help", {}));
+    ASSERT_FALSE(loader.formatMessage({en}, "missing", {}));
+    ASSERT_EQ(metrics->getFormatCount(), 2);
+    ASSERT_EQ(metrics->getFallbackCount(), 1);
+    ASSERT_EQ(metrics->getMissingCount(), 1);
+    ASSERT_EQ(metrics->getMessageStats().at("cli-help").formats, 2);
+
+    std::stringstream prometheus;
+    metrics->writePrometheus(prometheus);
+    ASSERT_NE(prometheus.str().find("fluent_messages_formatted_total 2\n"), std::string::npos);
+    ASSERT_NE(prometheus.str().find("fluent_message_formatted_total{message=\"cli-help\"} 2\n"),
+              std::string::npos);
+
+    loader.setObserver(nullptr);
+    ASSERT_TRUE(loader.formatMessage({en}, "cli-help", {}));
+    ASSERT_EQ(metrics->getFormatCount(), 2);
+}
+#endif
+
+TEST(TestLoader, MergeResources) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addResource(en, std::string("first = First\nshared = From first\n"));
+    loader.addResource(en, std::string("second = Second\nshared = From second\n"));
+    ASSERT_EQ(loader.formatMessage({en}, "first", {}), "First");
+    ASSERT_EQ(loader.formatMessage({en}, "second", {}), "Second");
+    ASSERT_EQ(loader.formatMessage({en}, "shared", {}), "From first");
+
+    loader.setConflictPolicy(fluent::ConflictPolicy::LastWins);
+    loader.addResource(en, std::string("shared = From third\n"));
+    ASSERT_EQ(loader.formatMessage({en}, "shared", {}), "From third");
+
+    loader.setConflictPolicy(fluent::ConflictPolicy::Error);
+    ASSERT_THROW(loader.addResource(en, std::string("new = New\nshared = From fourth\n")),
+                 std::runtime_error);
+    ASSERT_FALSE(loader.formatMessage({en}, "new", {}));
+    ASSERT_EQ(loader.formatMessage({en}, "shared", {}), "From third");
+}
+
+TEST(TestLoader, TermArguments) {
+    icu::Locale en("en");
+    std::string resource = "-brand = { $case ->\n"
+                           "    *[nominative] Foo\n"
+                           "    [genitive] Foo's\n"
+                           "}\n"
+                           "-count = { $count } { $unit }\n"
+                           "about = About { -brand }\n"
+                           "settings = { -brand(case: \"genitive\") } settings\n"
+                           "count = { -count(count: 3, unit: \"items\") }\n"
+                           "caller = { -count(count: 1) } { $unit }\n";
+    for (bool compiled : {false, true}) {
+        fluent::FluentLoader loader;
+        if (compiled)
+            loader.compile();
+        loader.addResource(en, std::string(resource));
+        ASSERT_EQ(loader.formatMessage({en}, "about", {}), "About Foo");
+        ASSERT_EQ(loader.formatMessage({en}, "settings", {}), "Foo's settings");
+        ASSERT_EQ(loader.formatMessage({en}, "count", {}), "3 items");
+        // Terms only see the arguments passed to them
+        ASSERT_EQ(loader.formatMessage({en}, "caller", {{"unit", "boxes"}}),
+                  "1 unknown variable { $unit } boxes");
+    }
+}
+
+TEST(TestLoader, FormatLimits) {
+    icu::Locale en("en");
+    std::string resource = "self = a { self }\n"
+                           "first = { second }\n"
+                           "second = b { first }\n"
+                           "deep = { deep1 }\n"
+                           "deep1 = { deep2 }\n"
+                           "deep2 = { deep3 }\n"
+                           "deep3 = c\n"
+                           "lol0 = lol\n";
+    for (int i = 1; i <= 10; i++) {
+        std::string previous = "{ lol" + std::to_string(i - 1) + " }";
+        resource += "lol" + std::to_string(i) + " = " + previous + previous + "\n";
+    }
+    for (bool compiled : {false, true}) {
+        fluent::FluentLoader loader;
+        if (compiled)
+            loader.compile();
+        loader.addResource(en, std::string(resource));
+        ASSERT_EQ(loader.formatMessage({en}, "self", {}), "a cyclic reference { self }");
+        ASSERT_EQ(loader.formatMessage({en}, "first", {}), "b cyclic reference { first }");
+        ASSERT_EQ(loader.formatMessage({en}, "deep", {}), "c");
+        // Each lolN expands to 2^N lol0s, which would need far more placeables
+        std::optional<std::string> lol = loader.formatMessage({en}, "lol10", {});
+        ASSERT_TRUE(lol);
+        ASSERT_LT(lol->size(), 3 * 100);
+
+        fluent::FormatLimits limits;
+        limits.maxDepth = 2;
+        loader.setFormatLimits(limits);
+        ASSERT_EQ(loader.formatMessage({en}, "deep", {}), "reference too deep { deep3 }");
+        limits = fluent::FormatLimits();
+        limits.maxOutputSize = 10;
+        loader.setFormatLimits(limits);
+        ASSERT_EQ(loader.formatMessage({en}, "lol10", {}), "lollolloll");
+    }
+}
+
+TEST(TestLoader, FormatMessages) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory("l10n");
+    fluent::LocaleChain chain({en});
+
+    fluent::FluentArgs args{{"num", 1}, {"arg", "Foo"}};
+    std::vector<fluent::MessageRequest> requests;
+    for (size_t i = 0; i < 1000; i++) {
+        requests.push_back({"cli-help", nullptr});
+        requests.push_back({"select", &args});
+        requests.push_back({"missing", nullptr});
+        requests.push_back({"argument", &args});
+    }
+    for (unsigned threads : {1, 4}) {
+        fluent::FormattedBatch batch;
+        loader.formatMessages(chain, requests, batch, threads);
+        ASSERT_EQ(batch.size(), requests.size());
+        for (size_t i = 0; i < requests.size(); i += 4) {
+            ASSERT_EQ(batch[i], "Print help message");
+            ASSERT_EQ(batch[i + 1], "One thing");
+            ASSERT_FALSE(batch.found(i + 2));
+            ASSERT_EQ(batch[i + 3], "Foo");
+        }
+    }
+
+    // Missing arguments leave the batch unchanged
+    fluent::FormattedBatch batch;
+    loader.formatMessages(chain, requests.data(), 1, batch);
+    std::vector<fluent::MessageRequest> invalid(1000, {"argument", nullptr});
+    ASSERT_THROW(loader.formatMessages(chain, invalid, batch, 4), std::out_of_range);
+    ASSERT_EQ(batch.size(), 1);
+    ASSERT_EQ(batch[0], "Print help message");
+}
+
+TEST(TestLoader, MessageKey) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.addDirectory("l10n");
+    fluent::LocaleChain chain({en});
+
+    fluent::MessageKey help("cli-help");
+    ASSERT_EQ(loader.formatMessage({en}, help), "Print help message");
+    ASSERT_EQ(loader.formatMessage(chain, help), "Print help message");
+    ASSERT_EQ(loader.formatMessage(chain, fluent::MessageKey("argument"), {{"arg", "Foo"}}),
+              "Foo");
+    ASSERT_EQ(loader.formatMessage(chain, fluent::MessageKey("cli-help", "missing")),
+              std::nullopt);
+    // Invalid references are treated as missing messages rather than throwing
+    ASSERT_EQ(loader.formatMessage({en}, "not a reference", {}), std::nullopt);
+}
+
+TEST(TestLoader, AddDirectoryAsync) {
+    fluent::FluentLoader serial, parallel;
+    icu::Locale en("en");
+    serial.addDirectory("l10n");
+
+    std::vector<std::string> loaded;
+    std::future<void> done = parallel.addDirectoryAsync(
+        "l10n", 4, [&](const icu::Locale& locale) { loaded.push_back(locale.getName()); });
+    done.get();
+    ASSERT_EQ(loaded, std::vector<std::string>{"en"});
+    ASSERT_EQ(parallel.formatMessage({en}, "cli-help", {}),
+              serial.formatMessage({en}, "cli-help", {}));
+    ASSERT_EQ(parallel.formatMessage({en}, "select", {{"num", 1}}),
+              serial.formatMessage({en}, "select", {{"num", 1}}));
+}
+
+TEST(TestLoader, SharedTerms) {
+    fluent::TermPool pool;
+    auto parseTerm = [](const char *source) {
+        return std::get<fluent::ast::Term>(*fluent::parseEntry(source));
+    };
+    auto en = pool.intern(parseTerm("-brand = Firefox\n"));
+    auto de = pool.intern(parseTerm("-brand = Firefox\n"));
+    auto fr = pool.intern(parseTerm("-brand = Le Firefox\n"));
+    auto commented = pool.intern(parseTerm("# Comment\n-brand = Firefox\n"));
+    EXPECT_EQ(en, de);
+    EXPECT_NE(en, fr);
+    EXPECT_NE(en, commented);
+    EXPECT_EQ(pool.getSharedCount(), 1);
+
+    // Bundles compile their own copy of a shared term
+    fluent::SymbolTable<fluent::MessageId> messageIds;
+    fluent::SymbolTable<fluent::TermId> termIds;
+    fluent::FluentBundle enBundle(icu::Locale("en")), deBundle(icu::Locale("de"));
+    fluent::TermId id = termIds.intern("brand");
+    enBundle.compile(messageIds, termIds);
+    deBundle.compile(messageIds, termIds);
+    ASSERT_TRUE(enBundle.addTerm(id, en, messageIds, termIds));
+    ASSERT_TRUE(deBundle.addTerm(id, de, messageIds, termIds));
+    EXPECT_EQ(enBundle.getTerm(id), deBundle.getTerm(id));
+    EXPECT_NE(enBundle.getCompiledTerm(id), deBundle.getCompiledTerm(id));
+
+    // Sharing is opt-in for loaders
+    fluent::FluentLoader loader;
+    icu::Locale enLocale("en"), deLocale("de");
+    loader.setShareTerms(true);
+    std::string resource = "-brand = Firefox { 1.5 }\nabout = About { -brand }\n";
+    loader.addResource(enLocale, std::string(resource));
+    loader.addResource(deLocale, std::string(resource));
+    ASSERT_EQ(*loader.formatMessage({enLocale}, "about", {}), "About Firefox 1.5");
+    ASSERT_EQ(*loader.formatMessage({deLocale}, "about", {}), "About Firefox 1,5");
+}
+
+TEST(TestLoader, BinaryResource) {
+    std::string image = fluent::serializeResource(
+        fluent::parse("-brand = Firefox\nabout = About { -brand } { 1.5 }\n"));
+    fluent::FluentLoader loader;
+    icu::Locale en("en"), de("de");
+    loader.addBinaryResource(en, image);
+    loader.addBinaryResource(de, image);
+    ASSERT_EQ(*loader.formatMessage({en}, "about", {}), "About Firefox 1.5");
+    ASSERT_EQ(*loader.formatMessage({de}, "about", {}), "About Firefox 1,5");
+    ASSERT_THROW(loader.addBinaryResource(en, std::string_view(image).substr(1)),
+                 std::runtime_error);
+}
+
+TEST(TestLoader, CompiledResource) {
+    icu::Locale en("en");
+    std::string resource = "-brand = Firefox\n"
+                           "about = About { -brand } { 1.5 }\n"
+                           "    .title = { $n ->\n"
+                           "        [one] One { -brand(case: \"nominative\") }\n"
+                           "       *[other] { $n } items\n"
+                           "    }\n"
+                           "greeting = Hello { $name }, { about }\n";
+    std::string image =
+        fluent::serializeCompiledResource(fluent::parse(std::string(resource)), en);
+    // The same resource always gives the same image
+    ASSERT_EQ(
+        fluent::serializeCompiledResource(fluent::parse(std::string(resource)), en),
+        image);
+    std::filesystem::path file =
+        std::filesystem::temp_directory_path() / "fluent-cpp-compiled.ftlc";
+    std::ofstream(file, std::ofstream::binary) << image;
+
+    fluent::FluentLoader loader, compiled;
+    loader.addResource(en, std::string(resource));
+    compiled.addCompiledResource(en, file);
+    // Messages are formatted from the mapping, which outlives the name of the file
+    std::error_code error;
+    std::filesystem::remove(file, error);
+    std::vector<std::pair<std::string, std::map<std::string, fluent::ast::Variable>>>
+        cases = {{"about", {}},
+                 {"about.title", {{"n", 1}}},
+                 {"about.title", {{"n", 5}}},
+                 {"greeting", {{"name", "Anna"}}},
+                 {"about.missing", {}},
+                 {"missing", {}}};
+    for (const auto &[id, args] : cases) {
+        ASSERT_EQ(compiled.formatMessage({en}, id, args),
+                  loader.formatMessage({en}, id, args));
+    }
+
+    // Resources added later are compiled, and can refer to the image's entries
+    compiled.addResource(en, std::string("farewell = Bye from { -brand }\n"));
+    ASSERT_EQ(*compiled.formatMessage({en}, "farewell", {}), "Bye from Firefox");
+
+    std::string_view view(image);
+    ASSERT_THROW(
+        compiled.addCompiledResource(en, nullptr, view.substr(0, view.size() - 8)),
+        std::runtime_error);
+    std::string corrupt = image;
+    corrupt[0] = 'X';
+    ASSERT_THROW(compiled.addCompiledResource(en, nullptr, corrupt),
+                 std::runtime_error);
+}
+
+TEST(TestLoader, AddResourceFromStream) {
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    std::istringstream input("-brand = Firefox\n"
+                             "about = About { -brand }\n"
+                             "    .title = Title\n");
+    loader.addResource(en, input);
+    ASSERT_EQ(*loader.formatMessage({en}, "about", {}), "About Firefox");
+    ASSERT_EQ(*loader.formatMessage({en}, "about.title", {}), "Title");
+}
+
+TEST(TestLoader, StandaloneBundle) {
+    // A bundle used without a loader interns identifiers itself
+    fluent::FluentBundle bundle(icu::Locale("en"));
+    ASSERT_EQ(bundle.getMessage("greeting"), nullptr);
+    ASSERT_TRUE(bundle.addMessage(std::get<fluent::ast::Message>(
+        *fluent::parseEntry("greeting = Hello { -brand }\n"))));
+    ASSERT_TRUE(bundle.addTerm(
+        std::get<fluent::ast::Term>(*fluent::parseEntry("-brand = Firefox\n"))));
+    ASSERT_FALSE(bundle.addMessage(
+        std::get<fluent::ast::Message>(*fluent::parseEntry("greeting = Hi\n"))));
+    ASSERT_NE(bundle.getMessage("greeting"), nullptr);
+    ASSERT_EQ(bundle.getMessage("greeting")->getId(), "greeting");
+    ASSERT_NE(bundle.getTerm("brand"), nullptr);
+    ASSERT_EQ(bundle.getTerm("greeting"), nullptr);
+
+    // Copies stop sharing the tables once one of them adds an identifier
+    fluent::FluentBundle copy = bundle;
+    ASSERT_TRUE(copy.addMessage(
+        std::get<fluent::ast::Message>(*fluent::parseEntry("farewell = Bye\n"))));
+    ASSERT_NE(copy.getMessage("farewell"), nullptr);
+    ASSERT_EQ(bundle.getMessage("farewell"), nullptr);
+    copy.compile();
+    ASSERT_TRUE(copy.isCompiled());
+}
+
+TEST(TestLoader, LazyResourceKeepsFileMapped) {
+    std::filesystem::path file =
+        std::filesystem::temp_directory_path() / "fluent-cpp-lazy.ftl";
+    std::ofstream(file) << "hello = Hello\n-brand = Firefox\nabout = About { -brand }\n";
+    fluent::FluentLoader loader;
+    icu::Locale en("en");
+    loader.setLazyParsing(true);
+    loader.addResource(en, file);
+    // The entries point into the mapping rather than a copy of the file. On POSIX
+    // systems the mapping outlives the name of the file.
+    std::error_code error;
+    std::filesystem::remove(file, error);
+    ASSERT_EQ(*loader.formatMessage({en}, "about", {}), "About Firefox");
+    ASSERT_EQ(*loader.formatMessage({en}, "hello", {}), "Hello");
+}
+
+TEST(TestLoader, CopiesShareStorage) {
+    // Copies of symbol tables and bundles share their contents until either changes
+    fluent::SymbolTable<fluent::MessageId> messageIds;
+    fluent::SymbolTable<fluent::TermId> termIds;
+    fluent::FluentBundle bundle(icu::Locale("en"));
+    for (int index = 0; index < 200; index++) {
+        std::string id = "message" + std::to_string(index);
+        ASSERT_TRUE(bundle.addMessage(
+            messageIds.intern(id),
+            std::get<fluent::ast::Message>(*fluent::parseEntry(id + " = Text\n")),
+            messageIds, termIds));
+    }
+
+    fluent::SymbolTable<fluent::MessageId> copiedIds = messageIds;
+    fluent::FluentBundle copy = bundle;
+    fluent::MessageId added = copiedIds.intern("added");
+    ASSERT_EQ(added.index, 200);
+    ASSERT_FALSE(messageIds.find("added"));
+    ASSERT_EQ(copiedIds.find("message150")->index, 150);
+    ASSERT_EQ(messageIds.intern("other").index, 200);
+
+    copy.removeMessage(fluent::MessageId(5));
+    ASSERT_TRUE(copy.addMessage(
+        added, std::get<fluent::ast::Message>(*fluent::parseEntry("added = Text\n")),
+        copiedIds, termIds));
+    ASSERT_FALSE(copy.hasMessage(fluent::MessageId(5)));
+    ASSERT_TRUE(bundle.hasMessage(fluent::MessageId(5)));
+    ASSERT_FALSE(bundle.hasMessage(added));
+    ASSERT_EQ(copy.getMessage(fluent::MessageId(150)),
+              bundle.getMessage(fluent::MessageId(150)));
+
+    copy.compile(copiedIds, termIds);
+    ASSERT_NE(copy.getCompiledMessage(fluent::MessageId(150)), nullptr);
+    ASSERT_EQ(bundle.getCompiledMessage(fluent::MessageId(150)), nullptr);
+}
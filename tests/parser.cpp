@@ -17,11 +17,15 @@
  *  along with fluent-cpp.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "fluent/binary.hpp"
+#include "fluent/context.hpp"
+#include "fluent/message_key.hpp"
 #include "fluent/parser.hpp"
 #include "gtest/gtest.h"
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 
 namespace pt = boost::property_tree;
@@ -49,6 +53,14 @@ TEST_P(TestParser, ChecksParserOutput) {
     EXPECT_EQ(actual, expected);
 }
 
+TEST_P(TestParser, BinaryRoundTrip) {
+    std::string image = fluent::serializeResource(fluent::parseFile(GetParam()));
+    std::vector<fluent::ast::Entry> entries = fluent::deserializeResource(image);
+    EXPECT_EQ(fluent::serializeResource(entries), image);
+    EXPECT_THROW(fluent::deserializeResource(std::string_view(image).substr(0, image.size() - 1)),
+                 std::runtime_error);
+}
+
 static std::vector<std::string> collect_test_files() {
     std::vector<std::string> results;
 
@@ -64,3 +76,184 @@ static std::vector<std::string> collect_test_files() {
 }
 INSTANTIATE_TEST_SUITE_P(ParserTests, TestParser,
                          testing::ValuesIn(collect_test_files()));
+
+TEST(TestParseFile, EmptyFile) {
+    fs::path file = fs::temp_directory_path() / "fluent-cpp-empty.ftl";
+    std::ofstream{file};
+    ASSERT_TRUE(fluent::parseFile(file).empty());
+    fs::remove(file);
+}
+
+TEST(TestParseFile, MissingFile) {
+    ASSERT_THROW(fluent::parseFile("fixtures/does-not-exist.ftl"), fs::filesystem_error);
+}
+
+TEST(TestParseFile, ParseOptions) {
+    const std::string resource = "### Resource\n"
+                                 "\n"
+                                 "# Comment\n"
+                                 "message = Value\n"
+                                 "\n"
+                                 "## Group\n"
+                                 "\n"
+                                 "invalid\n"
+                                 "-term = Term\n"
+                                 "# Trailing\n";
+    std::vector<fluent::ast::Entry> entries = fluent::parse(std::string(resource));
+    ASSERT_EQ(entries.size(), 6);
+
+    entries = fluent::parse(std::string(resource), fluent::ParseOptions{false, false, true});
+    ASSERT_EQ(entries.size(), 3);
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Message>(entries[0]));
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Junk>(entries[1]));
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Term>(entries[2]));
+
+    entries = fluent::parse(std::string(resource), fluent::ParseOptions{false, false, false});
+    ASSERT_EQ(entries.size(), 2);
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Message>(entries[0]));
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Term>(entries[1]));
+
+    entries = fluent::parse("# Only a comment\n", fluent::ParseOptions{false, false, true});
+    EXPECT_TRUE(entries.empty());
+}
+
+TEST(TestParseFile, Indentation) {
+    std::vector<fluent::ast::Entry> entries = fluent::parse("message =\r\n"
+                                                            "      two\r\n"
+                                                            "\r\n"
+                                                            "    {\"zero\"}\r\n"
+                                                            "        four\r\n");
+    ASSERT_EQ(entries.size(), 1);
+    const std::vector<fluent::ast::PatternElement> &pattern =
+        std::get<fluent::ast::Message>(entries[0]).getPattern();
+    ASSERT_EQ(pattern.size(), 3);
+    EXPECT_EQ(std::get<std::string>(pattern[0]), "  two\n\n");
+    EXPECT_EQ(std::get<fluent::ast::StringLiteral>(pattern[1]).value, "zero");
+    EXPECT_EQ(std::get<std::string>(pattern[2]), "\n    four");
+}
+
+TEST(TestParseFile, ScanResource) {
+    std::string resource = "# Comment\n"
+                           "message = Value\n"
+                           "    continued\n"
+                           "    .attribute = Attribute\n"
+                           "-term = { $num ->\n"
+                           "    *[other] Term\n"
+                           "}\n"
+                           "not an entry\n";
+    std::vector<fluent::EntrySpan> spans = fluent::scanResource(resource);
+    ASSERT_EQ(spans.size(), 2);
+    EXPECT_EQ(spans[0].kind, fluent::EntrySpan::Kind::Message);
+    EXPECT_EQ(spans[0].identifier, "message");
+    // The comment belongs to the message, as it would in an eager parse
+    EXPECT_EQ(spans[0].source,
+              "# Comment\nmessage = Value\n    continued\n    .attribute = Attribute\n");
+    EXPECT_EQ(spans[1].kind, fluent::EntrySpan::Kind::Term);
+    EXPECT_EQ(spans[1].identifier, "term");
+    EXPECT_EQ(spans[1].source, "-term = { $num ->\n    *[other] Term\n}\n");
+    EXPECT_TRUE(std::holds_alternative<fluent::ast::Term>(*fluent::parseEntry(spans[1].source)));
+    std::optional<fluent::ast::Entry> message = fluent::parseEntry(spans[0].source);
+    ASSERT_TRUE(message);
+    ASSERT_TRUE(std::get<fluent::ast::Message>(*message).getComment());
+    EXPECT_EQ(std::get<fluent::ast::Message>(*message).getComment()->getValue(), "Comment");
+
+    // Comments separated from the entry by a blank line, and group comments, are not
+    // part of any span
+    spans = fluent::scanResource("# Detached\n\n## Group\nfirst = A\n# Second\nsecond = B\n");
+    ASSERT_EQ(spans.size(), 2);
+    EXPECT_EQ(spans[0].source, "first = A\n");
+    EXPECT_EQ(spans[1].source, "# Second\nsecond = B\n");
+}
+
+TEST(TestMessageKey, Split) {
+    std::optional<fluent::MessageKeyView> key = fluent::splitMessageKey("cli-help");
+    ASSERT_TRUE(key);
+    ASSERT_EQ(key->identifier, "cli-help");
+    ASSERT_FALSE(key->attribute);
+
+    key = fluent::splitMessageKey("message_1.title");
+    ASSERT_TRUE(key);
+    ASSERT_EQ(key->identifier, "message_1");
+    ASSERT_EQ(key->attribute, "title");
+
+    for (const char *invalid : {"", ".title", "message.", "1message", "message.a.b", "has space"})
+        ASSERT_FALSE(fluent::splitMessageKey(invalid)) << invalid;
+
+    ASSERT_EQ(fluent::MessageKey::parse("message.title"), fluent::MessageKey("message", "title"));
+    ASSERT_EQ(fluent::MessageKey::parse("message.title")->toString(), "message.title");
+    ASSERT_FALSE(fluent::MessageKey::parse("-term"));
+}
+
+TEST(TestParseFile, SortedAttributes) {
+    std::optional<fluent::ast::Entry> entry = fluent::parseEntry("message = Value\n"
+                                                                 "    .zeta = Last\n"
+                                                                 "    .alpha = First\n"
+                                                                 "    .middle = Middle\n");
+    ASSERT_TRUE(entry);
+    fluent::ast::Message &message = std::get<fluent::ast::Message>(*entry);
+    const std::vector<fluent::ast::Attribute> &attributes = message.getAttributes();
+    ASSERT_EQ(attributes.size(), 3);
+    EXPECT_EQ(attributes[0].getId(), "alpha");
+    EXPECT_EQ(attributes[1].getId(), "middle");
+    EXPECT_EQ(attributes[2].getId(), "zeta");
+    ASSERT_TRUE(message.getAttribute("middle"));
+    EXPECT_EQ(message.getAttribute("middle")->getId(), "middle");
+    EXPECT_FALSE(message.getAttribute("missing"));
+}
+
+TEST(TestParseFile, NumberLiteral) {
+    fluent::ast::NumberLiteral integer("-42"), decimal("3.140");
+    fluent::ast::NumberLiteral huge("100000000000000000000");
+    EXPECT_EQ(std::get<long>(integer.getValue()), -42);
+    EXPECT_EQ(integer.getPrecision(), 0);
+    EXPECT_DOUBLE_EQ(std::get<double>(decimal.getValue()), 3.14);
+    EXPECT_EQ(decimal.getPrecision(), 3);
+    EXPECT_TRUE(std::holds_alternative<double>(huge.getValue()));
+    EXPECT_TRUE(decimal == 3.14);
+    EXPECT_TRUE(integer == -42L);
+
+    // Each locale keeps its own rendering
+    fluent::FormatContext en(icu::Locale("en")), de(icu::Locale("de"));
+    decimal.localize(en);
+    EXPECT_EQ(decimal.format(en), "3.140");
+    EXPECT_EQ(decimal.format(de), "3,140");
+    EXPECT_EQ(decimal.format(en), "3.140");
+    EXPECT_EQ(decimal.format(de), "3,140");
+    fluent::ast::NumberLiteral copy = decimal;
+    EXPECT_EQ(copy.format(de), "3,140");
+    EXPECT_EQ(copy.format(en), "3.140");
+    fluent::ast::NumberLiteral moved = std::move(copy);
+    EXPECT_EQ(moved.format(en), "3.140");
+    copy = moved;
+    EXPECT_EQ(copy.format(de), "3,140");
+}
+
+TEST(TestParseFile, StreamParser) {
+    std::string source = "# Comment\n"
+                         "message = Value\n"
+                         "    .attr = Attribute\n"
+                         "\n"
+                         "## Group\n"
+                         "\n"
+                         "-term = { $n ->\n"
+                         "    [one] One\n"
+                         "   *[other] Other\n"
+                         "}\n"
+                         "last = { -term }";
+    std::vector<fluent::ast::Entry> expected = fluent::parse(std::string(source));
+    for (size_t chunkSize : {1, 3, 16, 1000}) {
+        std::vector<fluent::ast::Entry> entries;
+        fluent::StreamParser parser(
+            [&](fluent::ast::Entry &&entry) { entries.push_back(std::move(entry)); });
+        for (size_t start = 0; start < source.size(); start += chunkSize)
+            parser.feed(std::string_view(source).substr(start, chunkSize));
+        // The last entry only ends with the stream
+        EXPECT_EQ(entries.size(), expected.size() - 1) << chunkSize;
+        parser.finish();
+        ASSERT_EQ(entries.size(), expected.size()) << chunkSize;
+        EXPECT_EQ(fluent::serializeResource(entries), fluent::serializeResource(expected));
+        // The comment is parsed together with the message it belongs to
+        ASSERT_TRUE(std::holds_alternative<fluent::ast::Message>(entries[0]));
+        EXPECT_TRUE(std::get<fluent::ast::Message>(entries[0]).getComment());
+    }
+}